@@ -11,6 +11,15 @@
 
 static const uint64_t IS_WAY_REFERENCE = 0x8000000000000000ull;
 
+/* OSM ways have at most MAX_WAY_NODES nodes. The references from ways to nodes in the 
+ * nodeRefs buckets also store the position of the node in its way, in the 
+ * WAY_NODE_POSITION_BITS bits starting at bit WAY_NODE_POSITION_SHIFT (and below the
+ * IS_WAY_REFERENCE bit). So way ids have to be smaller than 2^WAY_NODE_POSITION_SHIFT */
+static const uint64_t MAX_WAY_NODES           = 2000;
+static const uint64_t WAY_NODE_POSITION_BITS  = 11;
+static const uint64_t WAY_NODE_POSITION_SHIFT = 48;
+static const uint64_t WAY_NODE_POSITION_MASK  = ((1ull << WAY_NODE_POSITION_BITS) - 1) << WAY_NODE_POSITION_SHIFT;
+
 
 /** 0x7FFFFFFF is the maximum positive value in signed ints, i.e. ~ 2.1 billion
  *  In OSMs int32_t lat/lng storage, this corresponds to ~ 210°, which is outside
@@ -25,4 +34,73 @@ static const uint64_t BUCKET_SIZE                   = 10000000;
 static const uint64_t NODES_OF_WAYS_BUCKET_SIZE     = 1000000;
 static const uint64_t WAYS_OF_RELATIONS_BUCKET_SIZE = 200000;
 
+/* default memory budget for the write buffers of a single BucketFileSet. It is split 
+ * evenly between all buckets of the set (but each bucket gets at least one 4kB page) */
+static const uint64_t BUCKET_WRITE_BUFFER_BUDGET    = 64 * (1 << 20);
+
+/* maximum number of bucket files that a single BucketFileSet keeps open at any time. The
+ * others are closed, and reopened on demand. So the number of buckets is not limited by the
+ * OS limit on open files (usually 1024 per process) */
+static const uint64_t MAX_OPEN_BUCKET_FILES         = 64;
+
+/* number of out-of-order ids an IdRemapTable keeps in memory before merging them into its
+ * sorted on-disk part */
+static const uint64_t ID_REMAP_MAX_OUT_OF_ORDER_ITEMS = 10000000;
+
+/* OsmConsumerShardedDumper: entities are assigned to shards in runs of this many consecutive
+ * ids (so that no two shards write to the same cache line of vertices.data), and
+ * ways are buffered and processed in batches of this many ways (as are the ways of
+ * OsmConsumerDumper whose node locations are resolved during the import) */
+static const uint64_t DUMPER_SHARD_ID_RANGE         = 256;
+static const uint64_t DUMPER_WAY_BATCH_SIZE         = 16384;
+
+/* coordsCreateStorage --resolve-locations creates this (empty) file in the storage directory
+ * once all ways have been written to ways.data with their node locations resolved. Its
+ * presence tells coordsResolveStorage to skip resolving the way locations */
+static const char* const WAYS_RESOLVED_FILE_NAME = "ways.resolved";
+
+// coordsResolveStorage resolves the node locations of ways in batches of this many ways
+static const uint64_t RESOLVE_WAY_BATCH_SIZE        = 16384;
+
+/* symbolic names (see SymbolicNameTable) are stored as varUints of at most two bytes, so
+ * there are at most 2^14 of them. coordsCreateStorage ranks the names found in about
+ * SYMBOLIC_NAME_SAMPLE_BLOBS blobs of its input, and only takes names that occur at
+ * least SYMBOLIC_NAME_MIN_COUNT times in that sample */
+static const uint64_t MAX_SYMBOLIC_NAMES            = 16384;
+static const uint64_t SYMBOLIC_NAME_SAMPLE_BLOBS    = 1024;
+static const uint64_t SYMBOLIC_NAME_MIN_COUNT       = 4;
+
+/* TagSetTable: only tag sets of up to TAG_SET_MAX_SIZE bytes (serialized) are shared, and
+ * at most TAG_SET_MAX_ENTRIES of them. Tag sets that have been seen once are remembered in
+ * a table of TAG_SET_CANDIDATE_SLOTS hashes (8 bytes each) */
+static const uint64_t TAG_SET_MAX_SIZE              = 64;
+static const uint64_t TAG_SET_MAX_ENTRIES           = 1 << 20;
+static const uint64_t TAG_SET_CANDIDATE_SLOTS       = 1 << 22;
+
+/* VertexStore: the compressed vertex formats split the node ids into blocks of
+ * VERTEX_BLOCK_SIZE consecutive ids, and each reader caches the last VERTEX_BLOCK_CACHE_SIZE
+ * decoded blocks (about 2kB each) */
+static const uint64_t VERTEX_BLOCK_SIZE             = 256;
+static const uint64_t VERTEX_BLOCK_CACHE_SIZE       = 64;
+
+/* TaggedNodeIndex: the chunk positions of tagged nodes are bit-packed in groups of
+ * NODE_INDEX_GROUP_SIZE entries, and the position of every NODE_INDEX_SELECT_SAMPLE-th
+ * zero bit of the Elias-Fano upper bits is stored to speed up lookups */
+static const uint64_t NODE_INDEX_GROUP_SIZE         = 64;
+static const uint64_t NODE_INDEX_SELECT_SAMPLE      = 512;
+
+/* a writeable memory map (see init_mmap()) reserves this much address space by default, so
+ * that it can grow in place up to this size. The address space of a process is 128 TB (on
+ * x86-64), so there can be hundreds of such maps */
+static const uint64_t MMAP_ADDRESS_SPACE            = 1ull << 38;
+
+/* ChunkedFile: each thread creates its chunks in an extent of (about) CHUNKED_FILE_ARENA_SIZE
+ * bytes that it has claimed from the end of the file. Threads are spread over
+ * CHUNKED_FILE_NUM_ARENAS such arenas (so more threads than that have to share them).
+ * The file is mapped into a reserved range of (at least) CHUNKED_FILE_ADDRESS_SPACE bytes of
+ * address space, and must never outgrow it (because other threads may hold pointers into it) */
+static const uint64_t CHUNKED_FILE_ARENA_SIZE       = 1 << 18;
+static const uint64_t CHUNKED_FILE_NUM_ARENAS       = 64;
+static const uint64_t CHUNKED_FILE_ADDRESS_SPACE    = 1ull << 40;
+
 #endif
@@ -11,5 +11,14 @@ OsmBaseConsumer::~OsmBaseConsumer(){}
 void OsmBaseConsumer::consumeNode    ( OsmNode &) {};
 void OsmBaseConsumer::consumeWay     ( OsmWay  &) {};
 void OsmBaseConsumer::consumeRelation( OsmRelation &) {};
+
+void OsmBaseConsumer::consumeNodeBatch( OsmNodeBatch &batch)
+{
+    for (uint64_t i = 0; i < batch.size(); i++)
+    {
+        OsmNode node = batch.getNode(i);
+        consumeNode(node);
+    }
+}
     
 
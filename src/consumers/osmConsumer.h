@@ -13,6 +13,10 @@ public:
     virtual void consumeNode    ( OsmNode &);
     virtual void consumeWay     ( OsmWay  &);
     virtual void consumeRelation( OsmRelation &);
+    /* called by parsers that decode whole groups of nodes at once (e.g. the PBF parser).
+     * The default implementation materializes each node and passes it to consumeNode(),
+     * so consumers only need to override this if they can profit from batch processing.*/
+    virtual void consumeNodeBatch( OsmNodeBatch &);
 };
 
 
@@ -0,0 +1,71 @@
+
+#include "consumers/osmConsumerBuffer.h"
+#include "config.h"
+
+#include <utility>  //for std::move()
+
+OsmConsumerBuffer::OsmConsumerBuffer() {}
+OsmConsumerBuffer::~OsmConsumerBuffer() {}
+
+void OsmConsumerBuffer::addToRun(ENTRY_TYPE type)
+{
+    if (runs.size() && runs.back().first == type)
+        runs.back().second += 1;
+    else
+        runs.push_back( std::make_pair(type, 1));
+}
+
+void OsmConsumerBuffer::consumeNode( OsmNode &node)
+{
+    nodes.push_back( std::move(node));
+    addToRun(ENTRY_TYPE::NODE);
+}
+
+void OsmConsumerBuffer::consumeWay( OsmWay &way)
+{
+    ways.push_back( std::move(way));
+    addToRun(ENTRY_TYPE::WAY);
+}
+
+void OsmConsumerBuffer::consumeRelation( OsmRelation &relation)
+{
+    relations.push_back( std::move(relation));
+    addToRun(ENTRY_TYPE::RELATION);
+}
+
+void OsmConsumerBuffer::consumeNodeBatch( OsmNodeBatch &batch)
+{
+    nodeBatches.push_back( std::move(batch));
+    //the batch's tag strings usually point into the parser's unpack buffer, which will be reused
+    nodeBatches.back().ownStringData();
+    addToRun(ENTRY_TYPE::NODE_BATCH);
+}
+
+void OsmConsumerBuffer::replayInto(OsmBaseConsumer *consumer)
+{
+    uint64_t nodePos = 0, wayPos = 0, relationPos = 0, nodeBatchPos = 0;
+
+    for (const std::pair<ENTRY_TYPE, uint64_t> &run : runs)
+        for (uint64_t i = 0; i < run.second; i++)
+            switch (run.first)
+            {
+                case ENTRY_TYPE::NODE:      consumer->consumeNode( nodes[nodePos++]); break;
+                case ENTRY_TYPE::WAY:       consumer->consumeWay( ways[wayPos++]); break;
+                case ENTRY_TYPE::RELATION:  consumer->consumeRelation( relations[relationPos++]); break;
+                case ENTRY_TYPE::NODE_BATCH:consumer->consumeNodeBatch( nodeBatches[nodeBatchPos++]); break;
+                default: MUST(false, "invalid entity type"); break;
+            }
+
+    MUST( nodePos == nodes.size() && wayPos == ways.size() && relationPos == relations.size() &&
+          nodeBatchPos == nodeBatches.size(), "entity buffer corruption");
+}
+
+void OsmConsumerBuffer::clear()
+{
+    nodes.clear();
+    ways.clear();
+    relations.clear();
+    nodeBatches.clear();
+    runs.clear();
+}
+
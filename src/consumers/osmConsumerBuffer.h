@@ -0,0 +1,46 @@
+#ifndef OSM_CONSUMER_BUFFER_H
+#define OSM_CONSUMER_BUFFER_H
+
+#include <vector>
+
+#include "consumers/osmConsumer.h"
+
+/* OsmConsumerBuffer does not process any entities itself, but instead keeps them in
+ * memory until they are handed on to another consumer via replayInto(). Entities are
+ * replayed in exactly the order in which they were consumed (including the order in
+ * which nodes, ways and relations were interleaved).
+ * This allows entities to be decoded on a worker thread, while they are still being
+ * delivered to the actual (not thread-safe) consumer on a single thread.
+ *
+ * Note: to avoid copies, the consume*() methods *move* the contents out of the entity
+ *       they are passed, so the caller must not use that entity afterwards.
+ */
+class OsmConsumerBuffer: public OsmBaseConsumer
+{
+public:
+    OsmConsumerBuffer();
+    virtual ~OsmConsumerBuffer();
+
+    virtual void consumeNode    ( OsmNode &);
+    virtual void consumeWay     ( OsmWay  &);
+    virtual void consumeRelation( OsmRelation &);
+    virtual void consumeNodeBatch( OsmNodeBatch &);
+
+    void replayInto(OsmBaseConsumer *consumer);
+    void clear();
+private:
+    enum struct ENTRY_TYPE : uint8_t { NODE, WAY, RELATION, NODE_BATCH };
+    void addToRun(ENTRY_TYPE type);
+
+private:
+    std::vector<OsmNode>     nodes;
+    std::vector<OsmWay>      ways;
+    std::vector<OsmRelation> relations;
+    std::vector<OsmNodeBatch> nodeBatches;
+    /* sequence of (entry type, number of consecutive entries of that type),
+     * used to restore the original order of entities on replay */
+    std::vector< std::pair<ENTRY_TYPE, uint64_t> > runs;
+};
+
+#endif
+
@@ -9,6 +9,7 @@ OsmConsumerCounter::OsmConsumerCounter(): nNodes(0), nWays(0), nRelations(0) {}
 void OsmConsumerCounter::consumeNode    ( OsmNode &)     { nNodes     += 1;}
 void OsmConsumerCounter::consumeWay     ( OsmWay  &)     { nWays      += 1;}
 void OsmConsumerCounter::consumeRelation( OsmRelation &) { nRelations += 1;}
+void OsmConsumerCounter::consumeNodeBatch( OsmNodeBatch &batch) { nNodes += batch.size();}
 
 
 OsmConsumerCounter::~OsmConsumerCounter() {
@@ -12,7 +12,11 @@ public:
     virtual void consumeNode    ( OsmNode &);
     virtual void consumeWay     ( OsmWay  &);
     virtual void consumeRelation( OsmRelation &);
-    
+    virtual void consumeNodeBatch( OsmNodeBatch &);
+
+    uint64_t getNumNodes()     const { return nNodes; }
+    uint64_t getNumWays()      const { return nWays; }
+    uint64_t getNumRelations() const { return nRelations; }
 private:
     uint64_t nNodes, nWays, nRelations;
 };
@@ -6,10 +6,13 @@
 #include <string>
 #include <map>
 #include <list>
+#include <utility>  //for std::move()
 
 #include "config.h"
 #include "consumers/osmConsumerDumper.h"
 #include "containers/chunkedFile.h"
+#include "misc/radixSort.h"
+#include "misc/tagSetTable.h"
 #include "osm/osmParserXml.h"
 #include "osm/osmTypes.h"
 #include "osm/osm_tags.h"
@@ -30,8 +33,8 @@ static void truncateFile(string filename) {
     fclose(f);
 }
 
-OsmConsumerDumper::OsmConsumerDumper(std::string destinationDirectory): 
-    nNodes(0), nWays(0), nRelations(0), node_data_synced_pos(0), node_index_synced_pos(0), 
+OsmConsumerDumper::OsmConsumerDumper(std::string destinationDirectory, bool resolveWayLocations): 
+    resolveWayLocations(resolveWayLocations), wayData(nullptr), nNodes(0), nWays(0), nRelations(0), node_data_synced_pos(0), 
     destinationDirectory( (destinationDirectory.back() == '/' || destinationDirectory.back() == '\\' ) ? destinationDirectory : destinationDirectory + "/"), 
     nodeRefBuckets ( this->destinationDirectory + "nodeRefs", BUCKET_SIZE, false),
     wayBuckets( this->destinationDirectory+"ways", NODES_OF_WAYS_BUCKET_SIZE, false)
@@ -51,38 +54,52 @@ OsmConsumerDumper::OsmConsumerDumper(std::string destinationDirectory):
     for (uint32_t i = 0; i < num_ignore_key_prefixes; i++)
         ignoreKeyPrefixes.insert(ignore_key_prefixes[i], 0);
         
-    truncateFile(nodesIndexFilename);
     truncateFile(nodesDataFilename);
     truncateFile(verticesDataFilename);
-    //truncateFile(waysIndexFilename);
-    //truncateFile(waysDataFilename);
+    if (resolveWayLocations)
+    {
+        truncateFile(waysIndexFilename);
+        truncateFile(waysDataFilename);
+    }
     truncateFile(relationsIndexFilename);
     truncateFile(relationsDataFilename);
 
     vertex_data = init_mmap(verticesDataFilename.c_str()); //holds just raw vertex coordinates indexed by node_id; no tags
 
-    node_index = init_mmap( nodesIndexFilename.c_str() );
+    nodeIndex = new TaggedNodeIndex::Builder(nodesIndexFilename);
     nodeData = new ChunkedFile(nodesDataFilename.c_str());
 
-    //way_index = init_mmap(waysIndexFilename.c_str());
-    //wayData = new ChunkedFile(waysDataFilename.c_str());
+    if (resolveWayLocations)
+    {
+        way_index = init_mmap(waysIndexFilename.c_str());
+        wayData = new ChunkedFile(waysDataFilename.c_str());
+    }
 
     relation_index = init_mmap(relationsIndexFilename.c_str());
     relationData = new ChunkedFile(relationsDataFilename.c_str());
+
+    tagSets = new TagSetTable();
 };
 
 OsmConsumerDumper::~OsmConsumerDumper()
 {
+    flushPendingWays();
     delete nodeData;    //close chunked file
-    free_mmap(&node_index);   
+    delete nodeIndex;   //writes the index
    
     free_mmap(&vertex_data);
-    //free_mmap(&way_index);
-    //delete wayData;
+    if (wayData)
+    {
+        free_mmap(&way_index);
+        delete wayData;
+    }
 
     free_mmap(&relation_index);
     delete relationData;
 
+    tagSets->store( destinationDirectory + TAG_SETS_FILE_NAME);
+    delete tagSets;
+
     cout << "statistics: " << nNodes << " nodes, " << nWays << " ways, " << nRelations << " relations" << endl;
 
 }
@@ -104,16 +121,134 @@ void OsmConsumerDumper::filterTags(vector<OsmKeyValuePair> &tags) const
 
 void OsmConsumerDumper::consumeNode( OsmNode &node) 
 {
+    flushPendingWays();
     nNodes++;
     filterTags(node.tags);
-    node.serialize(*nodeData, &node_index, &vertex_data);
+    node.serialize(*nodeData, nodeIndex, &vertex_data, tagSets);
+}
+
+/* Same result as calling consumeNode() for each node in the batch. But since most nodes have
+ * no tags, the vertices of all nodes are written in a tight loop, and only the tagged nodes 
+ * are materialized as OsmNodes. */
+void OsmConsumerDumper::consumeNodeBatch( OsmNodeBatch &batch)
+{
+    if (batch.size() == 0)
+        return;
+        
+    flushPendingWays();
+    nNodes += batch.size();
+
+    uint64_t maxId = 0;
+    for (uint64_t id : batch.ids)
+    {
+        MUST (id > 0, "Invalid non-positive node id in input file.");
+        maxId = max(maxId, id);
+    }
+    
+    ensure_mmap_size( &vertex_data, (maxId+1) * 2 * sizeof(int32_t));
+    int32_t* vertex_ptr = (int32_t*)vertex_data.ptr;
+    for (uint64_t i = 0; i < batch.size(); i++)
+    {
+        vertex_ptr[2*batch.ids[i]]   = batch.lats[i];
+        vertex_ptr[2*batch.ids[i]+1] = batch.lngs[i];
+    }
+
+    for (uint64_t i = 0; i < batch.size(); i++)
+    {
+        if (!batch.hasTags(i))
+            continue;
+            
+        OsmNode node = batch.getNode(i);
+        filterTags(node.tags);
+        node.serialize(*nodeData, nodeIndex, &vertex_data, tagSets);
+    }
+}
+
+/* the node references of all ways are looked up in node id order, so that the lookups in
+ * 'vertex_data' are as sequential as possible (the ways of a batch usually are close to each
+ * other, and so are their nodes). Node references beyond the vertices are left unresolved,
+ * just like coordsResolveStorage would leave them. */
+void OsmConsumerDumper::resolveNodeLocations(OsmWay * const *ways, uint64_t numWays) const
+{
+    // (nodeId, (way << WAY_NODE_POSITION_BITS) | position of the node in the way)
+    vector<pair<uint64_t, uint64_t> > refs;
+    for (uint64_t i = 0; i < numWays; i++)
+    {
+        MUST( ways[i]->refs.size() <= MAX_WAY_NODES, "More node refs in way than specification allows");
+        for (uint64_t j = 0; j < ways[i]->refs.size(); j++)
+            refs.push_back( make_pair( ways[i]->refs[j].id, (i << WAY_NODE_POSITION_BITS) | j));
+    }
+    radixSort( refs, [](const pair<uint64_t, uint64_t> &ref) { return ref.first; });
+
+    const int32_t *vertices = (const int32_t*)vertex_data.ptr;
+    uint64_t numVertices = vertex_data.size / (2 * sizeof(int32_t));
+    for (const pair<uint64_t, uint64_t> &ref : refs)
+    {
+        OsmWay &way = *ways[ref.second >> WAY_NODE_POSITION_BITS];
+        OsmGeoPosition &pos = way.refs[ ref.second & ((1ull << WAY_NODE_POSITION_BITS) - 1)];
+        if (ref.first >= numVertices)
+        {
+            cout << "[WARN] reference to node " << ref.first << " could not be resolved in way " << way.id << endl;
+            continue;
+        }
+        pos.lat = vertices[2 * ref.first];
+        pos.lng = vertices[2 * ref.first + 1];
+    }
+}
+
+void OsmConsumerDumper::storeWay(uint64_t wayId, const uint8_t *bytes, uint64_t numBytes)
+{
+    if (!resolveWayLocations)
+    {
+        wayBuckets.writeRaw( wayId, bytes, numBytes);
+        return;
+    }
+
+    ensure_mmap_size( &way_index, sizeof(uint64_t) * (wayId+1));
+    Chunk chunk = wayData->createChunk( numBytes);
+    ((uint64_t*)way_index.ptr)[wayId] = chunk.getPositionInFile();
+    chunk.put( bytes, numBytes);
 }
 
 void OsmConsumerDumper::consumeWay ( OsmWay  &way)
 {
     nWays++;
+    if (!resolveWayLocations)
+    {
+        writeWay(way);
+        return;
+    }
+
+    pendingWays.push_back( std::move(way));
+    if (pendingWays.size() >= DUMPER_WAY_BATCH_SIZE)
+        flushPendingWays();
+}
+
+// resolves the node locations of all buffered ways in a single pass, and writes the ways
+void OsmConsumerDumper::flushPendingWays()
+{
+    if (pendingWays.size() == 0)
+        return;
+
+    vector<OsmWay*> ways;
+    ways.reserve( pendingWays.size());
+    for (OsmWay &way : pendingWays)
+        ways.push_back( &way);
+    resolveNodeLocations( ways.data(), ways.size());
+
+    for (OsmWay &way : pendingWays)
+        writeWay(way);
+    pendingWays.clear();
+}
+
+void OsmConsumerDumper::writeWay( OsmWay &way)
+{
     filterTags(way.tags);
-    way.serialize( wayBuckets.getFile(way.id));
+    uint64_t numBytes = 0, tagsSize = 0;
+    uint8_t *wayBytes = way.serialize( &numBytes, &tagsSize);
+    numBytes = tagSets->deduplicate( wayBytes, numBytes, tagsSize);
+    storeWay( way.id, wayBytes, numBytes);
+    delete [] wayBytes;
     
     /* the following code dumps each (wayId, nodeId) tuple in a bucket file, where bucket 'i'
      * stores the tuples for all nodeIds in the range [i*10M, (i+1)*10M[. These bucket files are
@@ -121,17 +256,23 @@ void OsmConsumerDumper::consumeWay ( OsmWay  &way)
      * ids that reference said node).
      *
      * For a 2015 planet dump,
-     * the highest nodeId is about 3G, requiring about 300 buckets. Note that Linux has a soft
-     * ulimit at 1024 open files per process. So the bucket size needs to be adjusted
-     * once OSM reaches close to 10G node IDs, in order to not exceed the open file limit.
+     * the highest nodeId is about 3G, requiring about 300 buckets. The BucketFileSet only
+     * keeps a few bucket files open at a time, so the number of buckets is not limited by
+     * the OS limit on open files.
+     *
+     * Each tuple also stores the position of the node in the way (see WAY_NODE_POSITION_SHIFT),
+     * so that coordsResolveStorage can later put the resolved locations into the way by a
+     * linear merge.
     */
-    
-    for (const OsmGeoPosition &ref : way.refs)
-        nodeRefBuckets.write(ref.id, way.id | IS_WAY_REFERENCE);
+    MUST( way.refs.size() <= MAX_WAY_NODES, "More node refs in way than specification allows");
+    MUST( way.id < (1ull << WAY_NODE_POSITION_SHIFT), "way id out of range");
+    for (uint64_t i = 0; i < way.refs.size(); i++)
+        nodeRefBuckets.write(way.refs[i].id, way.id | (i << WAY_NODE_POSITION_SHIFT) | IS_WAY_REFERENCE);
 }
 
 void OsmConsumerDumper::consumeRelation( OsmRelation &relation) 
 {
+    flushPendingWays();
     nRelations++;
     filterTags(relation.tags);
     relation.serializeWithIndexUpdate( *relationData, &relation_index);
@@ -8,15 +8,27 @@
 
 #include "misc/mem_map.h"
 #include "consumers/osmConsumer.h"
-#include "containers/radixTree.h"
+#include "containers/compactRadixTree.h"
 #include "containers/bucketFileSet.h"
+#include "containers/taggedNodeIndex.h"
 
 class ChunkedFile;
+class TagSetTable;
 
+/* The class OsmConsumerDumper writes the nodes, ways and relations it consumes to the storage
+ * in 'destinationDirectory'. By default, the node locations of ways are only resolved later
+ * (by coordsResolveStorage), so the ways are written to the 'ways' buckets, and each of
+ * their node references to the 'nodeRefs' buckets.
+ * With 'resolveWayLocations', the node locations of the ways are instead looked up right away
+ * in the vertices written so far (in PBF files, all nodes come before the ways), and the
+ * ways are written to their final ways.data/ways.idx directly. For locality of these lookups,
+ * ways are buffered until DUMPER_WAY_BATCH_SIZE ways have been collected (or until a node or
+ * relation follows), and the node locations of each batch are resolved in a single sorted pass. That saves coordsResolveStorage
+ * several passes over the data, but needs enough RAM to keep vertices.data cached. */
 class OsmConsumerDumper: public OsmBaseConsumer
 {
 public:
-    OsmConsumerDumper(std::string destinationDirectory);
+    OsmConsumerDumper(std::string destinationDirectory, bool resolveWayLocations = false);
     virtual ~OsmConsumerDumper();
 protected:
     static const std::string base_path;
@@ -24,21 +36,34 @@ protected:
     virtual void consumeNode( OsmNode &node);
     virtual void consumeWay ( OsmWay  &way);
     virtual void consumeRelation( OsmRelation &relation); 
-private:
-    void filterTags(std::vector<OsmKeyValuePair> &tags) const;
+    virtual void consumeNodeBatch( OsmNodeBatch &batch);
 
+    void filterTags(std::vector<OsmKeyValuePair> &tags) const;
+    /* sets the node locations of the 'numWays' ways from the vertices written so far. Only
+     * reads 'vertex_data', so several threads may resolve (disjoint) ways concurrently */
+    void resolveNodeLocations(OsmWay * const *ways, uint64_t numWays) const;
+    // writes a serialized way to the way buckets, or to ways.data (with 'resolveWayLocations')
+    void storeWay(uint64_t wayId, const uint8_t *bytes, uint64_t numBytes);
 private:
-    mmap_t node_index, vertex_data, relation_index;
-    ChunkedFile *nodeData, *relationData;
-    RadixTree<int> ignore_key, ignoreKeyPrefixes;    //ignore key-value pairs that are irrelevant for most applications
+    void writeWay( OsmWay &way);
+    void flushPendingWays();
+
+protected:
+    bool resolveWayLocations;
+    mmap_t vertex_data, relation_index, way_index;
+    TaggedNodeIndex::Builder *nodeIndex;
+    ChunkedFile *nodeData, *relationData, *wayData;
+    TagSetTable *tagSets;   //tag sets of nodes and ways that are shared by several entities
+    CompactRadixTree<int> ignore_key, ignoreKeyPrefixes;    //ignore key-value pairs that are irrelevant for most applications
     uint64_t nNodes, nWays, nRelations;
-    uint64_t node_data_synced_pos, node_index_synced_pos;
+    uint64_t node_data_synced_pos;
     std::string     nodesDataFilename,     nodesIndexFilename, verticesDataFilename;
     std::string      waysDataFilename,      waysIndexFilename;
     std::string relationsDataFilename, relationsIndexFilename;
     std::string destinationDirectory;
     BucketFileSet<uint64_t> nodeRefBuckets;
     BucketFileSet<void*>     wayBuckets;
+    std::vector<OsmWay> pendingWays;    //consumed, but not yet written ways
 };
 
 #endif
@@ -15,22 +15,17 @@ OsmConsumerIdRemapper::OsmConsumerIdRemapper(std::string destinationDirectory, O
     if (destinationDirectory.back() != '/' && destinationDirectory.back() != '\\')
         destinationDirectory += "/";
 
-    nodeMap    = new SerializableMap<uint64_t, uint64_t, 10000000>((destinationDirectory + "mapNodes.idx").c_str()    );
-    wayMap     = new SerializableMap<uint64_t, uint64_t, 10000000>((destinationDirectory + "mapWays.idx").c_str()     ); 
-    relationMap= new SerializableMap<uint64_t, uint64_t, 10000000>((destinationDirectory + "mapRelations.idx").c_str());
-
-    nodeIdsRemapped = nodeMap->getHighestValue();
-    wayIdsRemapped = wayMap->getHighestValue();
-    relationIdsRemapped = relationMap->getHighestValue();
-           
+    nodeMap    = new IdRemapTable( destinationDirectory + "mapNodes.idx"    );
+    wayMap     = new IdRemapTable( destinationDirectory + "mapWays.idx"     ); 
+    relationMap= new IdRemapTable( destinationDirectory + "mapRelations.idx");
 }
 
 OsmConsumerIdRemapper::~OsmConsumerIdRemapper ()
 {
     cout << "relocation tables have " 
-         << nodeIdsRemapped     << "/" 
-         << wayIdsRemapped      << "/"
-         << relationIdsRemapped << " entries." << endl;
+         << nodeMap->getHighestValue()     << "/" 
+         << wayMap->getHighestValue()      << "/"
+         << relationMap->getHighestValue() << " entries." << endl;
          
      delete nodeMap;
      delete wayMap;
@@ -41,27 +36,25 @@ OsmConsumerIdRemapper::~OsmConsumerIdRemapper ()
 
 void OsmConsumerIdRemapper::consumeNode( OsmNode &node)
 {
-    if (!nodeMap->count(node.id))
-        nodeMap->insert( std::make_pair( node.id, ++nodeIdsRemapped));
-
-    node.id = (*nodeMap)[node.id];
+    node.id = nodeMap->getOrAssign(node.id);
 
     innerConsumer->consumeNode(node);
 }
 
+void OsmConsumerIdRemapper::consumeNodeBatch( OsmNodeBatch &batch)
+{
+    for (uint64_t &id : batch.ids)
+        id = nodeMap->getOrAssign(id);
+    
+    innerConsumer->consumeNodeBatch(batch);
+}
+
 void OsmConsumerIdRemapper::consumeWay( OsmWay  &way) 
 { 
-    if (!wayMap->count(way.id))
-        wayMap->insert( std::make_pair( way.id, ++wayIdsRemapped));
-        
-    way.id = (*wayMap)[way.id];
+    way.id = wayMap->getOrAssign(way.id);
     
     for (OsmGeoPosition &pos : way.refs)
-    {
-        if (!nodeMap->count(pos.id))
-            nodeMap->insert( std::make_pair(pos.id, ++nodeIdsRemapped));
-        pos.id = (*nodeMap)[pos.id];
-    }
+        pos.id = nodeMap->getOrAssign(pos.id);
 
     //cout << way << endl;
     innerConsumer->consumeWay(way);
@@ -70,32 +63,19 @@ void OsmConsumerIdRemapper::consumeWay( OsmWay  &way)
 void OsmConsumerIdRemapper::consumeRelation( OsmRelation &relation) 
 { 
 
-    if (!relationMap->count(relation.id))
-        relationMap->insert( std::make_pair( relation.id, ++relationIdsRemapped));
-    
-    relation.id = (*relationMap)[relation.id];
-
+    relation.id = relationMap->getOrAssign(relation.id);
 
     for (OsmRelationMember &mbr : relation.members)
         switch (mbr.type)
         {
             case OSM_ENTITY_TYPE::NODE: 
-                if (! nodeMap->count(mbr.ref))
-                    nodeMap->insert( std::make_pair(mbr.ref, ++nodeIdsRemapped));
-                    
-                mbr.ref = (*nodeMap)[mbr.ref];
+                mbr.ref = nodeMap->getOrAssign(mbr.ref);
                 break;
             case OSM_ENTITY_TYPE::WAY: 
-                if (!wayMap->count(mbr.ref))
-                    wayMap->insert( std::make_pair( mbr.ref, ++wayIdsRemapped));
-                
-                mbr.ref = (*wayMap)[mbr.ref];
+                mbr.ref = wayMap->getOrAssign(mbr.ref);
                 break;
             case OSM_ENTITY_TYPE::RELATION: 
-                if (!relationMap->count(mbr.ref))
-                    relationMap->insert( std::make_pair( mbr.ref, ++relationIdsRemapped));
-                
-                mbr.ref = (*relationMap)[mbr.ref];
+                mbr.ref = relationMap->getOrAssign(mbr.ref);
                 break;
             default: assert(false && "invalid member type"); break;
         }
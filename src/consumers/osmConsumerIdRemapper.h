@@ -3,7 +3,7 @@
 #define OSM_CONSUMER_ID_REMAPPER_H
 
 #include "consumers/osmConsumer.h"
-#include "containers/serializableMap.h"
+#include "containers/idRemapTable.h"
 //class Remap;
 
 class OsmConsumerIdRemapper : public OsmBaseConsumer
@@ -16,10 +16,10 @@ protected:
     virtual void consumeNode    ( OsmNode &);
     virtual void consumeWay     ( OsmWay  &);
     virtual void consumeRelation( OsmRelation &);
+    virtual void consumeNodeBatch( OsmNodeBatch &);
 private:
     OsmBaseConsumer *innerConsumer;
-    SerializableMap<uint64_t, uint64_t, 10000000> *nodeMap, *wayMap, *relationMap;
-    uint64_t nodeIdsRemapped, wayIdsRemapped, relationIdsRemapped;
+    IdRemapTable *nodeMap, *wayMap, *relationMap;
 //    Remap *nodeRemap, *wayRemap, *relationRemap; 
 };
 #endif
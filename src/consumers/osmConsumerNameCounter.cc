@@ -0,0 +1,74 @@
+
+#include "consumers/osmConsumerNameCounter.h"
+#include "osm/osm_tags.h"
+
+#include <algorithm>
+
+OsmConsumerNameCounter::OsmConsumerNameCounter()
+{
+    for (uint32_t i = 0; i < num_ignore_keys; i++)
+        ignoreKeys.insert(ignore_keys[i], 0);
+
+    for (uint32_t i = 0; i < num_ignore_key_prefixes; i++)
+        ignoreKeyPrefixes.insert(ignore_key_prefixes[i], 0);
+}
+
+void OsmConsumerNameCounter::consumeNode    ( OsmNode &node)         { countTags(node.tags);    }
+void OsmConsumerNameCounter::consumeWay     ( OsmWay  &way)          { countTags(way.tags);     }
+void OsmConsumerNameCounter::consumeRelation( OsmRelation &relation) { countTags(relation.tags);}
+
+// counts the tags in place, without materializing the nodes
+void OsmConsumerNameCounter::consumeNodeBatch( OsmNodeBatch &batch)
+{
+    for (const std::pair<OsmNodeBatch::StringRef, OsmNodeBatch::StringRef> &tag : batch.tagRefs)
+        countTag( batch.stringData + tag.first.offset,  tag.first.length,
+                  batch.stringData + tag.second.offset, tag.second.length);
+}
+
+void OsmConsumerNameCounter::countTags(const std::vector<OsmKeyValuePair> &tags)
+{
+    for (const OsmKeyValuePair &tag : tags)
+        countTag( tag.first.c_str(),  tag.first.length(), 
+                  tag.second.c_str(), tag.second.length());
+}
+
+void OsmConsumerNameCounter::countTag(const char* key, uint64_t keyLength, const char* value, uint64_t valueLength)
+{
+    std::string keyString(key, keyLength);
+    if (ignoreKeys.at(keyString.c_str()) || ignoreKeyPrefixes.containsPrefixOf(keyString.c_str()))
+        return;
+
+    counts[keyString] += 1;
+    counts[std::string(value, valueLength)] += 1;
+}
+
+std::vector<std::string> OsmConsumerNameCounter::getRankedNames(uint64_t maxNames, uint64_t minCount) const
+{
+    std::vector< std::pair<uint64_t, const std::string*> > candidates;
+    for (const std::pair<const std::string, uint64_t> &entry : counts)
+        if (entry.second >= minCount && entry.first.find('\0') == std::string::npos)  //stored zero-terminated
+            candidates.push_back( std::make_pair(entry.second, &entry.first));
+
+    /* a symbolic name saves about the size of its string each time it occurs. But among the
+     * names chosen that way, the one-byte ids (which save one more byte per occurrence than the
+     * two-byte ones) go to the most frequent names. Ties are broken by name, so that the
+     * ranking does not depend on the hash map's iteration order. */
+    std::sort( candidates.begin(), candidates.end(), 
+        [](const std::pair<uint64_t, const std::string*> &a, const std::pair<uint64_t, const std::string*> &b) {
+            uint64_t savingsA = a.first * (a.second->length() + 1);
+            uint64_t savingsB = b.first * (b.second->length() + 1);
+            return savingsA != savingsB ? savingsA > savingsB : *a.second < *b.second; });
+
+    if (candidates.size() > maxNames)
+        candidates.resize(maxNames);
+
+    std::sort( candidates.begin(), candidates.end(), 
+        [](const std::pair<uint64_t, const std::string*> &a, const std::pair<uint64_t, const std::string*> &b) {
+            return a.first != b.first ? a.first > b.first : *a.second < *b.second; });
+
+    std::vector<std::string> res;
+    for (const std::pair<uint64_t, const std::string*> &candidate : candidates)
+        res.push_back( *candidate.second);
+
+    return res;
+}
@@ -0,0 +1,36 @@
+#ifndef OSM_CONSUMER_NAME_COUNTER_H
+#define OSM_CONSUMER_NAME_COUNTER_H
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "consumers/osmConsumer.h"
+#include "containers/compactRadixTree.h"
+
+/* counts how often each tag key and value occurs in the consumed entities, skipping the
+ * tags that OsmConsumerDumper filters out. Used to rank the names of a dataset for its
+ * SymbolicNameTable. */
+class OsmConsumerNameCounter : public OsmBaseConsumer {
+public:
+    OsmConsumerNameCounter();
+
+    virtual void consumeNode    ( OsmNode &node);
+    virtual void consumeWay     ( OsmWay  &way);
+    virtual void consumeRelation( OsmRelation &relation);
+    virtual void consumeNodeBatch( OsmNodeBatch &batch);
+
+    /* the (at most 'maxNames') names that save the most bytes when being stored as symbolic
+     * names instead of as strings, most frequent first (so that these get the shortest ids) */
+    std::vector<std::string> getRankedNames(uint64_t maxNames, uint64_t minCount) const;
+
+private:
+    void countTags(const std::vector<OsmKeyValuePair> &tags);
+    void countTag(const char* key, uint64_t keyLength, const char* value, uint64_t valueLength);
+
+private:
+    CompactRadixTree<int> ignoreKeys, ignoreKeyPrefixes;
+    std::unordered_map<std::string, uint64_t> counts;
+};
+
+#endif
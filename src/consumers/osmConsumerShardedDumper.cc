@@ -0,0 +1,183 @@
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <utility>  //for std::move()
+
+#include "config.h"
+#include "consumers/osmConsumerShardedDumper.h"
+#include "containers/chunkedFile.h"
+#include "misc/tagSetTable.h"
+#include "misc/varInt.h"
+#include "osm/osmTypes.h"
+
+using namespace std;
+
+OsmConsumerShardedDumper::OsmConsumerShardedDumper(std::string destinationDirectory, uint32_t numShards,
+                                                   bool resolveWayLocations):
+    OsmConsumerDumper(destinationDirectory, resolveWayLocations), numShards(numShards), shards(numShards)
+{
+    MUST( numShards > 0, "invalid number of shards");
+    pendingWays.reserve(DUMPER_WAY_BATCH_SIZE);
+}
+
+OsmConsumerShardedDumper::~OsmConsumerShardedDumper()
+{
+    flushWays();
+}
+
+void OsmConsumerShardedDumper::consumeNode( OsmNode &node)
+{
+    flushWays();
+    OsmConsumerDumper::consumeNode(node);
+}
+
+void OsmConsumerShardedDumper::consumeRelation( OsmRelation &relation)
+{
+    flushWays();
+    OsmConsumerDumper::consumeRelation(relation);
+}
+
+void OsmConsumerShardedDumper::consumeNodeBatch( OsmNodeBatch &batch)
+{
+    if (batch.size() == 0)
+        return;
+
+    /* the buffered ways precede this batch in the input, so they have to be committed first
+     * (and with 'resolveWayLocations', they must not see the locations of the batch's nodes) */
+    flushWays();
+
+    nNodes += batch.size();
+
+    uint64_t maxId = 0;
+    for (Shard &shard : shards)
+        shard.items.clear();
+
+    for (uint64_t i = 0; i < batch.size(); i++)
+    {
+        uint64_t id = batch.ids[i];
+        MUST (id > 0, "Invalid non-positive node id in input file.");
+        maxId = max(maxId, id);
+        shards[getShard(id)].items.push_back(i);
+    }
+
+    // the maps must not be remapped while the shards write to them
+    ensure_mmap_size( &vertex_data, (maxId+1) * 2 * sizeof(int32_t));
+    int32_t  *vertex_ptr = (int32_t*)vertex_data.ptr;
+
+    staged.resize(batch.size());
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(numShards)
+    for (uint32_t shardId = 0; shardId < numShards; shardId++)
+    {
+        Shard &shard = shards[shardId];
+        shard.arena.clear();
+        for (uint64_t i : shard.items)
+        {
+            uint64_t id = batch.ids[i];
+            vertex_ptr[2*id]   = batch.lats[i];
+            vertex_ptr[2*id+1] = batch.lngs[i];
+
+            staged[i].size = 0;
+            if (!batch.hasTags(i))
+                continue;
+
+            OsmNode node = batch.getNode(i);
+            filterTags(node.tags);
+            // nodes whose tags have all been filtered out are not stored either
+            if (node.tags.size() == 0)
+                continue;
+
+            RawTags::SymbolicIds symbolicIds;
+            staged[i].offset = shard.arena.size();
+            staged[i].size   = node.getSerializedSize(&symbolicIds, &staged[i].tagsSize);
+            shard.arena.resize( staged[i].offset + staged[i].size);
+
+            Chunk chunk( shard.arena.data() + staged[i].offset, 0, staged[i].size);
+            node.serialize(chunk, &symbolicIds);
+        }
+    }
+
+    /* commit in input order, so that the chunk positions and the shared tag sets are the same
+     * as those of OsmConsumerDumper */
+    for (uint64_t i = 0; i < batch.size(); i++)
+    {
+        if (staged[i].size == 0)
+            continue;
+
+        uint8_t *bytes = shards[getShard(batch.ids[i])].arena.data() + staged[i].offset;
+        uint64_t size = tagSets->deduplicate( bytes, staged[i].size, staged[i].tagsSize);
+        Chunk chunk = nodeData->createChunk( size);
+        chunk.put( bytes, size);
+        nodeIndex->add( batch.ids[i], chunk.getPositionInFile());
+    }
+}
+
+void OsmConsumerShardedDumper::consumeWay ( OsmWay  &way)
+{
+    nWays++;
+    pendingWays.push_back( std::move(way));
+    if (pendingWays.size() >= DUMPER_WAY_BATCH_SIZE)
+        flushWays();
+}
+
+void OsmConsumerShardedDumper::flushWays()
+{
+    if (pendingWays.size() == 0)
+        return;
+
+    for (Shard &shard : shards)
+        shard.items.clear();
+
+    for (uint64_t i = 0; i < pendingWays.size(); i++)
+        shards[getShard(pendingWays[i].id)].items.push_back(i);
+
+    staged.resize(pendingWays.size());
+
+    #pragma omp parallel for schedule(dynamic, 1) num_threads(numShards)
+    for (uint32_t shardId = 0; shardId < numShards; shardId++)
+    {
+        Shard &shard = shards[shardId];
+        shard.arena.clear();
+        if (resolveWayLocations)
+        {
+            vector<OsmWay*> ways;
+            for (uint64_t i : shard.items)
+                ways.push_back( &pendingWays[i]);
+            resolveNodeLocations( ways.data(), ways.size());
+        }
+
+        for (uint64_t i : shard.items)
+        {
+            OsmWay &way = pendingWays[i];
+            filterTags(way.tags);
+
+            uint64_t nTagBytes;
+            RawTags::SymbolicIds symbolicIds;
+            staged[i].offset = shard.arena.size();
+            staged[i].size   = way.getSerializedSize(&nTagBytes, &symbolicIds);
+            shard.arena.resize( staged[i].offset + staged[i].size);
+            way.serialize( shard.arena.data() + staged[i].offset, staged[i].size, nTagBytes, &symbolicIds);
+            staged[i].tagsSize = nTagBytes + varUintNumBytes(nTagBytes);
+        }
+    }
+
+    /* commit in input order. BucketFileSet is not thread-safe, but appending to its write
+     * buffers is only a memcpy, and committing in order keeps the bucket contents (and the 
+     * chunk positions in ways.data) deterministic.
+     * See OsmConsumerDumper::consumeWay() for the purpose of the node ref buckets. */
+    for (uint64_t i = 0; i < pendingWays.size(); i++)
+    {
+        const OsmWay &way = pendingWays[i];
+        uint8_t *bytes = shards[getShard(way.id)].arena.data() + staged[i].offset;
+        storeWay( way.id, bytes, tagSets->deduplicate( bytes, staged[i].size, staged[i].tagsSize));
+
+        MUST( way.refs.size() <= MAX_WAY_NODES, "More node refs in way than specification allows");
+        MUST( way.id < (1ull << WAY_NODE_POSITION_SHIFT), "way id out of range");
+        for (uint64_t j = 0; j < way.refs.size(); j++)
+            nodeRefBuckets.write(way.refs[j].id, way.id | (j << WAY_NODE_POSITION_SHIFT) | IS_WAY_REFERENCE);
+    }
+
+    pendingWays.clear();
+}
+
@@ -0,0 +1,63 @@
+
+#ifndef OSM_CONSUMER_SHARDED_DUMPER_H
+#define OSM_CONSUMER_SHARDED_DUMPER_H
+
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "consumers/osmConsumerDumper.h"
+
+/* The class OsmConsumerShardedDumper creates the same storage as OsmConsumerDumper, but
+ * spreads the work over 'numShards' threads. Entities are assigned to shards by id range
+ * (runs of DUMPER_SHARD_ID_RANGE consecutive ids), and each shard filters the tags of its
+ * entities, writes their vertices, and serializes all tagged entities into a private staging
+ * arena.
+ * Only afterwards, the staged entities are committed - in input order - to the nodes.data
+ * chunks (and the node index) and to the way and node-ref buckets, and only then are their
+ * tags deduplicated. So chunk positions and bucket contents do not
+ * depend on the number of shards or on thread scheduling, and the output is byte-identical
+ * to that of OsmConsumerDumper.
+ *
+ * Node batches are processed as a whole. Ways are buffered until DUMPER_WAY_BATCH_SIZE ways
+ * have been collected (and with 'resolveWayLocations', each shard resolves the node locations
+ * of its ways of the batch in a single sorted pass). Relations are rare, and are passed on to
+ * OsmConsumerDumper directly. Buffered ways are always committed before any node or relation
+ * that follows them in the input, so the input order is kept even for unsorted input.
+ */
+class OsmConsumerShardedDumper: public OsmConsumerDumper
+{
+public:
+    OsmConsumerShardedDumper(std::string destinationDirectory, uint32_t numShards, 
+                             bool resolveWayLocations = false);
+    virtual ~OsmConsumerShardedDumper();
+protected:
+    virtual void consumeNode( OsmNode &node);
+    virtual void consumeWay ( OsmWay  &way);
+    virtual void consumeRelation( OsmRelation &relation);
+    virtual void consumeNodeBatch( OsmNodeBatch &batch);
+private:
+    uint32_t getShard(uint64_t id) const { return (id / DUMPER_SHARD_ID_RANGE) % numShards; }
+    void flushWays();
+
+    struct Shard {
+        std::vector<uint64_t> items;    //positions (in the current batch) of the shard's entities
+        std::vector<uint8_t>  arena;    //serialized entities not yet committed
+    };
+
+    /* for each entity of the current batch, the position of its serialization in the
+     * arena of its shard. 'size == 0' for entities that have nothing left to commit. 
+     * The last 'tagsSize' bytes of the serialization are the entity's tags */
+    struct StagedEntity {
+        uint64_t offset;
+        uint64_t size;
+        uint64_t tagsSize;
+    };
+
+private:
+    uint32_t numShards;
+    std::vector<Shard> shards;
+    std::vector<StagedEntity> staged;
+};
+
+#endif
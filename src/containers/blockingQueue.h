@@ -0,0 +1,73 @@
+#ifndef BLOCKING_QUEUE_H
+#define BLOCKING_QUEUE_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/* The template class BlockingQueue is a bounded FIFO queue to hand over work items
+ * between threads (e.g. from a reader thread to a pool of worker threads).
+ * push() blocks while the queue holds 'capacity' items, pop() blocks while the queue
+ * is empty. Once the producer side calls close(), pop() will still return all items
+ * that are already queued, and returns 'false' afterwards to signal the end of input
+ * to the consumer side.
+ */
+template <typename T>
+class BlockingQueue
+{
+public:
+    BlockingQueue(uint64_t capacity): capacity(capacity), isClosed(false) {}
+
+    void push(const T &item);
+    bool pop(T &itemOut);
+    void close();
+
+private:
+    std::deque<T>           items;
+    std::mutex              mutex;
+    std::condition_variable notFull, notEmpty;
+    uint64_t                capacity;
+    bool                    isClosed;
+};
+
+// ==========================================
+
+template <typename T>
+void BlockingQueue<T>::push(const T &item)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (items.size() >= capacity)
+        notFull.wait(lock);
+
+    items.push_back(item);
+    notEmpty.notify_one();
+}
+
+template <typename T>
+bool BlockingQueue<T>::pop(T &itemOut)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (items.empty() && !isClosed)
+        notEmpty.wait(lock);
+
+    if (items.empty())  //closed and drained
+        return false;
+
+    itemOut = items.front();
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+}
+
+template <typename T>
+void BlockingQueue<T>::close()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    isClosed = true;
+    notEmpty.notify_all();
+}
+
+#endif
+
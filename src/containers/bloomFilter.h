@@ -0,0 +1,57 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <stdint.h>
+
+#include <functional>   //for std::hash
+#include <vector>
+
+/* The class BloomFilter is a probabilistic set of hash values: mayContain() never returns
+ * false for a hash that has been added, but may return true for one that has not (with about
+ * 1% probability at the default 10 bits per item). It is used to skip searching data structures
+ * (e.g. sorted on-disk runs) that cannot contain a given key.
+ * The 'numHashes' bit positions of each item are derived from a single 64 bit hash via
+ * double hashing, so items only have to be hashed once (see hashOf()).
+ */
+class BloomFilter
+{
+public:
+    BloomFilter(uint64_t numItems = 0, uint32_t bitsPerItem = 10):
+        numBits( ((numItems * bitsPerItem + 63) / 64 + 1) * 64),
+        numHashes( bitsPerItem * 7 / 10 > 0 ? bitsPerItem * 7 / 10 : 1), //ln(2) * bitsPerItem is optimal
+        bits( numBits / 64, 0) {}
+
+    void add(uint64_t hash)
+    {
+        uint64_t h1 = hash, h2 = (hash >> 32) | (hash << 32) | 1;
+        for (uint32_t i = 0; i < numHashes; i++, h1 += h2)
+            bits[ (h1 % numBits) / 64] |= 1ull << (h1 % 64);
+    }
+
+    bool mayContain(uint64_t hash) const
+    {
+        uint64_t h1 = hash, h2 = (hash >> 32) | (hash << 32) | 1;
+        for (uint32_t i = 0; i < numHashes; i++, h1 += h2)
+            if (! (bits[ (h1 % numBits) / 64] & (1ull << (h1 % 64))))
+                return false;
+        return true;
+    }
+
+    /* std::hash is the identity function for integers in common implementations, so its
+     * result is mixed (with the splitmix64 finalizer) to spread the bits over all 64 bits */
+    template <typename T>
+    static uint64_t hashOf(const T &item)
+    {
+        uint64_t h = std::hash<T>()(item);
+        h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+        h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+        return h ^ (h >> 31);
+    }
+
+private:
+    uint64_t numBits;
+    uint32_t numHashes;
+    std::vector<uint64_t> bits;
+};
+
+#endif
@@ -2,6 +2,8 @@
 #ifndef BUCKETFILESET_H
 #define BUCKETFILESET_H
 
+#include <algorithm> //for std::min()
+#include <list>
 #include <string>
 #include <vector>
 
@@ -17,34 +19,76 @@
    A BucketFileSet is not intended for quick data retrieval (and in fact contains no
    methods to directly access any key-value pair. It is just a way of conveniently
    subdividing an unmanageably large data set into buckets of managable size.
- 
+   
+   Writes are collected in a per-bucket in-memory buffer, and are written to the bucket
+   file in blocks of the buffer size (a multiple of the page size). The total size of all
+   buffers is bounded by the 'writeBufferBudget' given to the constructor. Since the buffered
+   data is not yet part of the bucket files, all writes have to go through write() or
+   writeRaw(). getFile() and getContents() flush the buffer of the respective bucket before
+   returning its file or content.
+   
+   Only the MAX_OPEN_BUCKET_FILES most recently used bucket files are kept open, so a set
+   may consist of tens of thousands of buckets. In turn, a FILE* returned by getFile() only
+   remains valid until the next call to any other method of the BucketFileSet.
  */
 template<typename ValueType>
 class BucketFileSet
 {
 public:
-    BucketFileSet(std::string baseName, uint64_t bucketSize, bool appendToExistingFiles);    
+    BucketFileSet(std::string baseName, uint64_t bucketSize, bool appendToExistingFiles,
+                  uint64_t writeBufferBudget = BUCKET_WRITE_BUFFER_BUDGET);
     ~BucketFileSet();
 
-    //returns the bucket FILE* for item 'id' (not *bucket* 'id)    
+    /* returns the bucket FILE* for item 'id' (not *bucket* 'id), for reading. 
+     * Data must not be written to the FILE* directly, but only through write()/writeRaw().
+     * The FILE* must not be closed, and may be closed by the next call to this set. */
     FILE*    getFile(uint64_t id);
     // *truncates* a single bucket file to have size 0
     void     clearBucket(uint64_t bucketId);
     // *deletes* all bucket files
     void     clear();
     void     write(uint64_t id, const ValueType& data);
+    /* appends 'size' bytes to the bucket of item 'id' without storing the key 'id' itself. 
+     * Used for buckets of variable-size entries (e.g. serialized ways), or for buckets 
+     * whose entries already contain their key. */
+    void     writeRaw(uint64_t id, const void* data, uint64_t size);
+    // writes the buffered data of all buckets to their files
+    void     flush();
     uint64_t getNumBuckets() const;
     
     std::vector< std::pair<uint64_t, ValueType>> getContents(uint64_t bucketId);
+    /* the same as getContents(), but the bucket file is read through a FILE* of its own, and
+     * the set itself is not modified. So unlike all other methods, readContents() may be
+     * called concurrently (for different buckets, and while the set is used otherwise, except
+     * for the bucket being read). The bucket must not have any buffered writes. */
+    void readContents(uint64_t bucketId, std::vector< std::pair<uint64_t, ValueType>> &contentsOut) const;
+    /* the same as readContents(), but returns the raw bytes of the bucket file (for buckets
+     * written by writeRaw()). Both methods read a bucket file as a whole, and then drop it 
+     * from the page cache, as each bucket is usually read only once. */
+    void readRaw(uint64_t bucketId, std::vector<uint8_t> &bytesOut) const;
 
 private:
     static std::string toBucketString(std::string baseName, uint64_t bucketId);
-    void addBuckets(uint64_t newMaxBucketId);
+    void addBuckets(uint64_t newMaxBucketId, bool createFiles = true);
+    void append(uint64_t bucketId, const uint8_t* data, uint64_t size);
+    void flushBucket(uint64_t bucketId);
+    FILE* openBucketFile(uint64_t bucketId);
+    void closeBucketFile(uint64_t bucketId);
+    // the separate FILE* used by readContents() and readRaw()
+    FILE* openForReading(uint64_t bucketId, uint64_t &fileSizeOut) const;
+    void closeAfterReading(FILE* f) const;
 
 private:
-    std::vector<FILE*>  bucketFiles;
+    std::vector<FILE*>  bucketFiles;    //nullptr for buckets whose file is currently closed
+    std::vector< std::vector<uint8_t> > writeBuffers;
+    /* the ids of all buckets with an open file (least recently used first), and for each 
+     * such bucket its position in that list */
+    std::list<uint64_t> openBuckets;
+    std::vector< std::list<uint64_t>::iterator > openBucketsPos;
     std::string         baseName;
     uint64_t            bucketSize;
+    uint64_t            writeBufferBudget;
+    uint64_t            writeBufferSize;    //per bucket
 };
 
 
@@ -52,13 +96,15 @@ private:
 #define __STDC_FORMAT_MACROS
 #include <inttypes.h>   //for PRIu64
 #include <stdio.h> //for FILE*
+#include <string.h> //for memcpy()
+#include <fcntl.h>  //for posix_fadvise()
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>     //for ftruncate
 
 template<typename ValueType>
-BucketFileSet<ValueType>::BucketFileSet(std::string baseName, uint64_t bucketSize, bool appendToExistingFiles):
-        baseName(baseName), bucketSize(bucketSize)
+BucketFileSet<ValueType>::BucketFileSet(std::string baseName, uint64_t bucketSize, bool appendToExistingFiles, uint64_t writeBufferBudget):
+        baseName(baseName), bucketSize(bucketSize), writeBufferBudget(writeBufferBudget), writeBufferSize(0)
 {
     if (!appendToExistingFiles)
     {
@@ -67,25 +113,20 @@ BucketFileSet<ValueType>::BucketFileSet(std::string baseName, uint64_t bucketSiz
     }
 
     struct stat dummy;
-    std::string fileName;
+    uint64_t numBuckets = 0;
+    while (stat(toBucketString(baseName, numBuckets).c_str(), &dummy) == 0)
+        numBuckets++;
     
-    for (uint64_t id = 0 ; 
-         stat((fileName = toBucketString(baseName, id)).c_str(), &dummy) == 0; 
-         id++)
-    {
-        FILE* f = fopen(fileName.c_str(), "a+b");
-        if (!f)
-            perror("fopen");
-        MUST(f, "cannot open bucket file");
-        bucketFiles.push_back(f);
-    }
+    if (numBuckets > 0)
+        addBuckets( numBuckets - 1, false);
 }
 
 template<typename ValueType>
 BucketFileSet<ValueType>::~BucketFileSet() 
 {
-    for (FILE* f : bucketFiles)
-        fclose(f);
+    flush();
+    while (openBuckets.size())
+        closeBucketFile( openBuckets.front());
 }
 
 
@@ -93,11 +134,45 @@ template<typename ValueType>
 FILE* BucketFileSet<ValueType>::getFile(uint64_t id)
 {
     uint64_t bucketId = id / this->bucketSize;
-    assert( bucketId < 800 && "getting too close to OS ulimit for open files");
     if (bucketId >= bucketFiles.size() )
         addBuckets(bucketId);
 
-    return bucketFiles[bucketId];
+    flushBucket(bucketId);
+    return openBucketFile(bucketId);
+}
+
+template<typename ValueType>
+FILE* BucketFileSet<ValueType>::openBucketFile(uint64_t bucketId)
+{
+    if (bucketFiles[bucketId])
+    {
+        //mark as most recently used
+        openBuckets.splice( openBuckets.end(), openBuckets, openBucketsPos[bucketId]);
+        return bucketFiles[bucketId];
+    }
+    
+    if (openBuckets.size() >= MAX_OPEN_BUCKET_FILES)
+        closeBucketFile( openBuckets.front());
+        
+    FILE* f = fopen( toBucketString(baseName, bucketId).c_str(), "a+b");
+    if (!f)
+        perror("fopen");
+    MUST(f, "cannot open bucket file");
+    
+    bucketFiles[bucketId] = f;
+    openBucketsPos[bucketId] = openBuckets.insert( openBuckets.end(), bucketId);
+    return f;
+}
+
+template<typename ValueType>
+void BucketFileSet<ValueType>::closeBucketFile(uint64_t bucketId)
+{
+    if (!bucketFiles[bucketId])
+        return;
+        
+    MUST( fclose(bucketFiles[bucketId]) == 0, "cannot close bucket file");
+    bucketFiles[bucketId] = nullptr;
+    openBuckets.erase( openBucketsPos[bucketId]);
 }
 
 template<typename ValueType>
@@ -106,7 +181,11 @@ void BucketFileSet<ValueType>::clearBucket(uint64_t bucketId)
     if (bucketId >= bucketFiles.size())
         return; //nothing to clear
         
-    MUST(ftruncate( fileno(bucketFiles[bucketId]), 0) == 0, "could not truncate bucket file");
+    writeBuffers[bucketId].clear();
+    writeBuffers[bucketId].shrink_to_fit();
+    int res = bucketFiles[bucketId] ? ftruncate( fileno(bucketFiles[bucketId]), 0) :
+                                      truncate( toBucketString(baseName, bucketId).c_str(), 0);
+    MUST(res == 0, "could not truncate bucket file");
 }
 
 template<typename ValueType>
@@ -114,23 +193,78 @@ void BucketFileSet<ValueType>::clear()
 {
     for (uint64_t i = 0; i < bucketFiles.size(); i++)
     {
-        fclose(bucketFiles[i]);
+        closeBucketFile(i);
         unlink( toBucketString(baseName, i).c_str());
     }
     
     bucketFiles.clear();
+    writeBuffers.clear();
+    openBucketsPos.clear();
 }
 
 template<typename ValueType>
 void BucketFileSet<ValueType>::write(uint64_t id, const ValueType& data)
 {
     uint64_t bucketId = id / bucketSize;
-    assert( bucketId < 800 && "getting too close to OS ulimit for open files");
     if (bucketId >= bucketFiles.size() )
         addBuckets(bucketId);
 
-    MUST( fwrite( &id, sizeof(id), 1, bucketFiles[bucketId]) == 1, "bucket write failed");
-    MUST( fwrite( &data, sizeof(data),  1, bucketFiles[bucketId]) == 1, "bucket write failed");
+    uint8_t record[sizeof(id) + sizeof(data)];
+    memcpy( record, &id, sizeof(id));
+    memcpy( record + sizeof(id), &data, sizeof(data));
+    append( bucketId, record, sizeof(record));
+}
+
+template<typename ValueType>
+void BucketFileSet<ValueType>::writeRaw(uint64_t id, const void* data, uint64_t size)
+{
+    uint64_t bucketId = id / bucketSize;
+    if (bucketId >= bucketFiles.size() )
+        addBuckets(bucketId);
+
+    append( bucketId, (const uint8_t*)data, size);
+}
+
+/* appends to the write buffer of the bucket, and writes out the buffer each time it is
+ * full. So except for the last one (and after the buffer size has been reduced), all 
+ * writes to the bucket file have exactly the buffer size, and start at a multiple of it. */
+template<typename ValueType>
+void BucketFileSet<ValueType>::append(uint64_t bucketId, const uint8_t* data, uint64_t size)
+{
+    std::vector<uint8_t> &buffer = writeBuffers[bucketId];
+    while (size > 0)
+    {
+        if (buffer.size() >= writeBufferSize)
+            flushBucket(bucketId);
+            
+        if (buffer.capacity() < writeBufferSize)
+            buffer.reserve(writeBufferSize);
+        
+        uint64_t numBytes = std::min(size, writeBufferSize - buffer.size());
+        buffer.insert( buffer.end(), data, data + numBytes);
+        data += numBytes;
+        size -= numBytes;
+    }
+}
+
+template<typename ValueType>
+void BucketFileSet<ValueType>::flushBucket(uint64_t bucketId)
+{
+    std::vector<uint8_t> &buffer = writeBuffers[bucketId];
+    if (buffer.size() > 0)
+        MUST( fwrite( buffer.data(), buffer.size(), 1, openBucketFile(bucketId)) == 1, "bucket write failed");
+    
+    buffer.clear();
+    //the buffer size may have been reduced since this buffer was allocated
+    if (buffer.capacity() > writeBufferSize)
+        buffer.shrink_to_fit();
+}
+
+template<typename ValueType>
+void BucketFileSet<ValueType>::flush()
+{
+    for (uint64_t i = 0; i < bucketFiles.size(); i++)
+        flushBucket(i);
 }
 
 template<typename ValueType>
@@ -143,7 +277,8 @@ template<typename ValueType>
 std::vector< std::pair<uint64_t, ValueType>> BucketFileSet<ValueType>::getContents(uint64_t bucketId)
 {
     MUST(bucketId < bucketFiles.size(), "Bucket index out of bounds.");
-    FILE* &f = bucketFiles[bucketId];
+    flushBucket(bucketId);
+    FILE* f = openBucketFile(bucketId);
 
     fseek(f, 0, SEEK_END);
     uint64_t fileSize = ftell(f);
@@ -157,7 +292,7 @@ std::vector< std::pair<uint64_t, ValueType>> BucketFileSet<ValueType>::getConten
     fseek(f, 0, SEEK_SET); //seek to beginning for reading
     // this fread() also re-positions the file pointer to the end of the file.
     // This is necessary for later write() calls to no corrupt the data.
-    MUST( fread( rawData, fileSize, 1, f) == 1, "error reading bucket file");
+    MUST( fileSize == 0 || fread( rawData, fileSize, 1, f) == 1, "error reading bucket file");
     
     uint8_t *rawDataPos = rawData;
     while (numItems--)
@@ -174,6 +309,63 @@ std::vector< std::pair<uint64_t, ValueType>> BucketFileSet<ValueType>::getConten
     
 }
 
+template<typename ValueType>
+FILE* BucketFileSet<ValueType>::openForReading(uint64_t bucketId, uint64_t &fileSizeOut) const
+{
+    MUST(bucketId < bucketFiles.size(), "Bucket index out of bounds.");
+    MUST(writeBuffers[bucketId].empty(), "reading a bucket with buffered writes");
+    FILE* f = fopen( toBucketString(baseName, bucketId).c_str(), "rb");
+    MUST(f, "cannot open bucket file");
+
+    fseek(f, 0, SEEK_END);
+    fileSizeOut = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    posix_fadvise( fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
+    return f;
+}
+
+template<typename ValueType>
+void BucketFileSet<ValueType>::closeAfterReading(FILE* f) const
+{
+    posix_fadvise( fileno(f), 0, 0, POSIX_FADV_DONTNEED);
+    MUST( fclose(f) == 0, "cannot close bucket file");
+}
+
+template<typename ValueType>
+void BucketFileSet<ValueType>::readContents(uint64_t bucketId, 
+                                            std::vector< std::pair<uint64_t, ValueType>> &contentsOut) const
+{
+    uint64_t fileSize;
+    FILE* f = openForReading(bucketId, fileSize);
+    uint64_t kvSize = sizeof(uint64_t) + sizeof(ValueType);
+    MUST(fileSize % kvSize == 0, "bucket file corruption");
+    uint64_t numItems = fileSize / kvSize;
+    contentsOut.resize(numItems);
+
+    if (sizeof(std::pair<uint64_t, ValueType>) == kvSize) //no padding --> same layout as the file
+    {
+        MUST( fileSize == 0 || fread( contentsOut.data(), fileSize, 1, f) == 1, "error reading bucket file");
+    }
+    else
+    {
+        for (std::pair<uint64_t, ValueType> &kv : contentsOut)
+            MUST( fread( &kv.first,  sizeof(uint64_t),  1, f) == 1 &&
+                  fread( &kv.second, sizeof(ValueType), 1, f) == 1, "error reading bucket file");
+    }
+
+    closeAfterReading(f);
+}
+
+template<typename ValueType>
+void BucketFileSet<ValueType>::readRaw(uint64_t bucketId, std::vector<uint8_t> &bytesOut) const
+{
+    uint64_t fileSize;
+    FILE* f = openForReading(bucketId, fileSize);
+    bytesOut.resize(fileSize);
+    MUST( fileSize == 0 || fread( bytesOut.data(), fileSize, 1, f) == 1, "error reading bucket file");
+    closeAfterReading(f);
+}
+
 template<typename ValueType>
 std::string BucketFileSet<ValueType>::toBucketString(std::string baseName, uint64_t bucketId)
 {
@@ -187,11 +379,23 @@ std::string BucketFileSet<ValueType>::toBucketString(std::string baseName, uint6
 }
 
 template<typename ValueType>
-void BucketFileSet<ValueType>::addBuckets(uint64_t newMaxBucketId)
+void BucketFileSet<ValueType>::addBuckets(uint64_t newMaxBucketId, bool createFiles)
 {
     uint64_t oldNumBuckets = bucketFiles.size();
     bucketFiles.resize( newMaxBucketId + 1, nullptr);
+    writeBuffers.resize( newMaxBucketId + 1);
+    openBucketsPos.resize( newMaxBucketId + 1);
+    
+    /* split the budget evenly between all buckets. Existing buffers are shrunk to the new
+     * size lazily (on their next flush) */
+    static const uint64_t PAGE_SIZE = 4096;
+    writeBufferSize = (writeBufferBudget / bucketFiles.size()) / PAGE_SIZE * PAGE_SIZE;
+    if (writeBufferSize < PAGE_SIZE)
+        writeBufferSize = PAGE_SIZE;
     
+    if (!createFiles)   //adding the existing bucket files in append mode
+        return;
+        
     for (uint64_t i = oldNumBuckets; i < bucketFiles.size(); i++)
     {
         /* always truncate the new bucket file ("wb"), even if we are appending
@@ -203,7 +407,7 @@ void BucketFileSet<ValueType>::addBuckets(uint64_t newMaxBucketId)
         std::string filename = toBucketString(baseName, i);
         FILE* f = fopen( filename.c_str(), "wb");
         MUST(f, "cannot create bucket file");
-        bucketFiles[i] = f;
+        MUST( fclose(f) == 0, "cannot create bucket file");
     }
         
     /* try to delete the bucket file *after* the last one. 
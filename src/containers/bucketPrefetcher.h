@@ -0,0 +1,106 @@
+#ifndef BUCKETPREFETCHER_H
+#define BUCKETPREFETCHER_H
+
+#include <stdint.h>
+
+#include <thread>
+#include <utility>  //for std::pair
+#include <vector>
+
+#include "containers/bucketFileSet.h"
+
+/* The BucketPrefetcher reads the buckets of a BucketFileSet in order, one after another, so
+ * that a loop over all buckets can process bucket i while bucket i+1 is already being read
+ * by a background thread (double buffering). So reading the next bucket from disk overlaps
+ * with the processing of the current one.
+ *
+ * 'ContentsType' is either std::vector<uint8_t> (the raw bucket contents, see
+ * BucketFileSet::readRaw()), or std::vector<std::pair<uint64_t, ValueType>> (the key-value
+ * pairs, see BucketFileSet::readContents()).
+ *
+ * While the prefetcher exists, the set must not be written to. But buckets that have been
+ * returned by next() already may be cleared (BucketFileSet::clearBucket()).
+ *
+ * Usage:
+ *     BucketPrefetcher<uint64_t, std::vector<uint8_t>> prefetcher(buckets);
+ *     uint64_t bucketId;
+ *     std::vector<uint8_t> contents;
+ *     while (prefetcher.next(bucketId, contents))
+ *         process(contents);
+ */
+template <typename ValueType, typename ContentsType>
+class BucketPrefetcher
+{
+public:
+    BucketPrefetcher(const BucketFileSet<ValueType> &buckets);
+    ~BucketPrefetcher();
+
+    /* waits until the next bucket has been read, swaps its contents into 'contentsOut' and
+     * starts reading the bucket after it. Returns false if all buckets have been returned. */
+    bool next(uint64_t &bucketIdOut, ContentsType &contentsOut);
+
+private:
+    void startReading();
+    static void read(const BucketFileSet<ValueType> &buckets, uint64_t bucketId,
+                     std::vector<uint8_t> &bytesOut)
+    {
+        buckets.readRaw(bucketId, bytesOut);
+    }
+
+    static void read(const BucketFileSet<ValueType> &buckets, uint64_t bucketId,
+                     std::vector< std::pair<uint64_t, ValueType>> &contentsOut)
+    {
+        buckets.readContents(bucketId, contentsOut);
+    }
+
+private:
+    const BucketFileSet<ValueType> &buckets;
+    std::thread  reader;
+    ContentsType buffer;        //is filled by 'reader' with the contents of bucket 'nextBucketId'
+    uint64_t     nextBucketId;
+};
+
+
+//===================================================
+
+template <typename ValueType, typename ContentsType>
+BucketPrefetcher<ValueType, ContentsType>::BucketPrefetcher(const BucketFileSet<ValueType> &buckets):
+    buckets(buckets), nextBucketId(0)
+{
+    startReading();
+}
+
+template <typename ValueType, typename ContentsType>
+BucketPrefetcher<ValueType, ContentsType>::~BucketPrefetcher()
+{
+    if (reader.joinable())
+        reader.join();
+}
+
+template <typename ValueType, typename ContentsType>
+void BucketPrefetcher<ValueType, ContentsType>::startReading()
+{
+    if (nextBucketId >= buckets.getNumBuckets())
+        return;
+
+    uint64_t bucketId = nextBucketId;
+    reader = std::thread( [this, bucketId]() { read(buckets, bucketId, buffer); });
+}
+
+template <typename ValueType, typename ContentsType>
+bool BucketPrefetcher<ValueType, ContentsType>::next(uint64_t &bucketIdOut, ContentsType &contentsOut)
+{
+    if (nextBucketId >= buckets.getNumBuckets())
+        return false;
+
+    reader.join();
+    /* swapping (instead of copying) hands the buffer of the previous bucket back to the
+     * reader, so that both buffers are reused for all buckets */
+    contentsOut.swap(buffer);
+    bucketIdOut = nextBucketId++;
+    startReading();
+    return true;
+}
+
+#endif
+
@@ -1,6 +1,8 @@
 
 #include "containers/chunkedFile.h"
 #include <assert.h>
+
+#include <atomic>
 #include <iostream>
 
 using std::string;
@@ -23,8 +25,11 @@ ChunkedFile::ChunkedFile(string filename): filename(filename)
      * mark the chunk as valid. This leaves 6 bits for the chunk size,
      * meaning we can have at most 2^6 = 64 different chunk sizes. */
     MUST(numChunkSizes <= 64, "invalid number of different chunk sizes");
-    fileMap = init_mmap(filename.c_str(), true, true);
-    freeLists = new std::vector<uint64_t>[ChunkedFile::numChunkSizes];
+    fileMap = init_mmap(filename.c_str(), true, true, false, 0, CHUNKED_FILE_ADDRESS_SPACE);
+    freeLists = new FreeList[ChunkedFile::numChunkSizes];
+    arenas = new Arena[CHUNKED_FILE_NUM_ARENAS];
+    for (uint64_t i = 0; i < CHUNKED_FILE_NUM_ARENAS; i++)
+        arenas[i].pos = arenas[i].end = 0;
 
     if (fileMap.size == 0) 
     //newly created --> needs to be initialized, ignore free-list (if it exists)
@@ -73,7 +78,7 @@ void ChunkedFile::loadFreeLists()
             continue;
         }
         
-        freeLists[chunkSize].push_back(chunkPos);
+        freeLists[chunkSize].positions.push_back(chunkPos);
 
     }
     fclose(f);
@@ -81,11 +86,13 @@ void ChunkedFile::loadFreeLists()
 
 ChunkedFile::~ChunkedFile()
 {
+    releaseArenas();
+    
     MUST(numChunkSizes <= CHUNK_SIZE_MASK+1, "number of chunk sizes bigger than 64");
     FILE *f = fopen( (filename+".free").c_str(), "wb");
     for (uint64_t i = 0; i < numChunkSizes; i++)
     {
-        for (uint64_t freeChunk : freeLists[i])
+        for (uint64_t freeChunk : freeLists[i].positions)
         {
             MUST( !(freeChunk & 0xFF00000000000000ull), "invalid chunk address (<= 2^56)");
             uint64_t entry = (i << 56) | freeChunk;
@@ -95,12 +102,12 @@ ChunkedFile::~ChunkedFile()
     fclose(f);
     
     delete [] freeLists;
+    delete [] arenas;
 
     free_mmap(&fileMap);
 
 }
 
-
 uint64_t ChunkedFile::getFreeSpaceAtEnd() const
 {
     uint64_t res = *((uint64_t*)fileMap.ptr);
@@ -118,12 +125,143 @@ void ChunkedFile::increaseSize(uint64_t additionalSpace)
     uint64_t oldFreeSpace = this->getFreeSpaceAtEnd();
     uint64_t oldFileSize  = this->fileMap.size;
     
+    /* moving the map would invalidate the chunk pointers of other threads, so the file
+     * must stay within its reserved address space */
+    MUST( fileMap.size + additionalSpace <= fileMap.reservedSize, "chunked file exceeds its reserved address space");
     ensure_mmap_size(&fileMap, fileMap.size + additionalSpace);
     int64_t sizeDifference = fileMap.size - oldFileSize;
     assert(sizeDifference >= 0);
     setFreeSpaceAtEnd( oldFreeSpace + sizeDifference);
 }
 
+// returns the position of 'size' bytes that have been taken from the free space at the end of the file
+uint64_t ChunkedFile::claimFromEnd(uint64_t size)
+{
+    if (this->getFreeSpaceAtEnd() <= size)
+        this->increaseSize( size - this->getFreeSpaceAtEnd() );
+    
+    assert( this->getFreeSpaceAtEnd() >= size );
+
+    uint64_t pos = this->getStartPosOfFreeSpace();
+    this->setFreeSpaceAtEnd( getFreeSpaceAtEnd() - size);
+    return pos;
+}
+
+/* Unused space in the middle of the file has to consist of (free) chunks, because iterating
+ * over the chunks would fail otherwise. Not every size can be split into chunks (there are
+ * no chunks smaller than 17 bytes, and e.g. 20 or 30 bytes are no sum of chunk sizes), so
+ * this table stores for every size below FILL_TABLE_SIZE the index of a chunk size that
+ * leaves a splittable rest (or 0, if there is none) */
+static const uint64_t FILL_TABLE_SIZE = 8192;
+
+static const std::vector<uint8_t>& getFillTable()
+{
+    static std::vector<uint8_t> table;
+    static std::once_flag initialized;
+    std::call_once(initialized, []()
+    {
+        table.resize(FILL_TABLE_SIZE, 0);
+        for (uint64_t size = 1; size < FILL_TABLE_SIZE; size++)
+            for (uint64_t i = 1; i < ChunkedFile::numChunkSizes && ChunkedFile::chunkSizes[i] <= size; i++)
+            {
+                uint64_t rest = size - ChunkedFile::chunkSizes[i];
+                if (rest == 0 || table[rest])
+                    table[size] = i;
+            }
+    });
+    return table;
+}
+
+/* the smallest size from which on all sizes can be split into chunks. An arena never keeps
+ * an unused rest that is smaller than this (but not empty) */
+static uint64_t getMinSplittableSize()
+{
+    static uint64_t minSize = 0;
+    static std::once_flag initialized;
+    std::call_once(initialized, []()
+    {
+        const std::vector<uint8_t> &table = getFillTable();
+        minSize = FILL_TABLE_SIZE;
+        while (minSize > 1 && table[minSize - 1])
+            minSize--;
+        MUST( minSize < FILL_TABLE_SIZE / 2, "chunk sizes cannot fill all gaps");
+    });
+    return minSize;
+}
+
+// turns the unused space [pos, pos+size[ into free chunks
+void ChunkedFile::addFreeChunks(uint64_t pos, uint64_t size)
+{
+    const std::vector<uint8_t> &table = getFillTable();
+    while (size > 0)
+    {
+        uint64_t idx;
+        if (size < FILL_TABLE_SIZE)
+            idx = table[size];
+        else    //the biggest chunk that leaves a rest that is still covered by the table
+            for (idx = numChunkSizes - 1; chunkSizes[idx] > size - FILL_TABLE_SIZE / 2; idx--);
+
+        MUST( idx > 0, "cannot split space into chunks");
+        ((uint8_t*)fileMap.ptr)[pos] = idx | UNUSED_CHUNK;
+        {
+            std::unique_lock<std::mutex> lock(freeLists[idx].mutex);
+            freeLists[idx].positions.push_back(pos);
+        }
+        pos  += chunkSizes[idx];
+        size -= chunkSizes[idx];
+    }
+}
+
+// the arena of the calling thread
+static uint64_t getArenaIndex()
+{
+    static std::atomic<uint64_t> numThreads(0);
+    static thread_local uint64_t threadIndex = numThreads++;
+    return threadIndex % CHUNKED_FILE_NUM_ARENAS;
+}
+
+// 'arena.mutex' has to be held by the caller. Returns the position of the new chunk
+uint64_t ChunkedFile::createInArena(Arena &arena, uint64_t chunkSize)
+{
+    uint64_t unused = arena.end - arena.pos;
+    if (chunkSize != unused && chunkSize + getMinSplittableSize() > unused)
+    {
+        /* the chunk does not fit (without leaving a rest that cannot be split into chunks).
+         * If the arena is at the end of the file, it is simply extended. Otherwise its rest
+         * is freed, and it gets a new extent */
+        uint64_t claimSize = chunkSize + CHUNKED_FILE_ARENA_SIZE;
+        std::unique_lock<std::mutex> lock(tailMutex);
+        if (arena.end == getStartPosOfFreeSpace())
+            arena.end = claimFromEnd(claimSize) + claimSize;
+        else
+        {
+            addFreeChunks(arena.pos, unused);
+            arena.pos = claimFromEnd(claimSize);
+            arena.end = arena.pos + claimSize;
+        }
+    }
+
+    uint64_t pos = arena.pos;
+    arena.pos += chunkSize;
+    return pos;
+}
+
+// returns the unused parts of all arenas to the file. Must not be called concurrently with createChunk()
+void ChunkedFile::releaseArenas()
+{
+    std::unique_lock<std::mutex> lock(tailMutex);
+    for (uint64_t i = 0; i < CHUNKED_FILE_NUM_ARENAS; i++)
+    {
+        Arena &arena = arenas[i];
+        if (arena.end == getStartPosOfFreeSpace())
+            setFreeSpaceAtEnd( getFreeSpaceAtEnd() + (arena.end - arena.pos));
+        else
+            addFreeChunks(arena.pos, arena.end - arena.pos);
+
+        arena.pos = arena.end = 0;
+    }
+}
+
 Chunk ChunkedFile::createChunk(uint64_t chunkSize)
 {
     uint64_t contentSize = chunkSize;
@@ -149,22 +287,23 @@ Chunk ChunkedFile::createChunk(uint64_t chunkSize)
     uint64_t chunkPos = 0;
     MUST( (uint64_t)chunkSizeIdx < numChunkSizes, "chunk size > 1.6GB requested. This is unsupported");
 
-    if (freeLists[chunkSizeIdx].size() > 0)
     {
         //if an unused chunk of the given size exists, recycle it
-        chunkPos = freeLists[chunkSizeIdx].back();
-        freeLists[chunkSizeIdx].pop_back();
-    } else
+        FreeList &freeList = freeLists[chunkSizeIdx];
+        std::unique_lock<std::mutex> lock(freeList.mutex);
+        if (freeList.positions.size() > 0)
+        {
+            chunkPos = freeList.positions.back();
+            freeList.positions.pop_back();
+        }
+    }
+    
+    if (chunkPos == 0)
     {
-        /* Otherwise create a new chunk at the end of the data area
-         * (increasing the file size if necessary) */
-        if (this->getFreeSpaceAtEnd() <= (uint64_t)chunkSize)
-            this->increaseSize( chunkSize - this->getFreeSpaceAtEnd() );
-        
-        assert( this->getFreeSpaceAtEnd() >= (uint64_t)chunkSize );
-
-        chunkPos = this->getStartPosOfFreeSpace();
-        this->setFreeSpaceAtEnd( getFreeSpaceAtEnd() - chunkSize);
+        //Otherwise create a new chunk in the arena of this thread
+        Arena &arena = arenas[getArenaIndex()];
+        std::unique_lock<std::mutex> lock(arena.mutex);
+        chunkPos = createInArena(arena, chunkSize);
     }
     uint8_t* chunk = (uint8_t*)fileMap.ptr + chunkPos;
     //initialize chunk by setting its size marker
@@ -188,7 +327,8 @@ void ChunkedFile::freeChunk(Chunk &chunk)
       but is still part of the file chunk and needs to be accounted for. */
     uint64_t chunkPos = chunk.getPositionInFile() - 1;
 
-    MUST(chunkPos < fileMap.size, "invalid chunk");
+    //'fileMap.size' may be changed concurrently, but the reserved size never changes
+    MUST(chunkPos < fileMap.reservedSize, "invalid chunk");
 
     // 8 bytes freeSpaceCounter | 1 byte size marker of chunk '1' | chunk 1 | ...
     MUST(chunkPos >= 8, "invalid chunk position");
@@ -208,9 +348,21 @@ void ChunkedFile::freeChunk(Chunk &chunk)
     }
     
     ((uint8_t*)fileMap.ptr)[chunkPos] |=  UNUSED_CHUNK;
-    freeLists[chunkSize].push_back(chunkPos);
+    std::unique_lock<std::mutex> lock(freeLists[chunkSize].mutex);
+    freeLists[chunkSize].positions.push_back(chunkPos);
     
 }
+void ChunkedFile::startWriteback(uint64_t pos, uint64_t size)
+{
+    std::unique_lock<std::mutex> lock(tailMutex);   //'fileMap.size' may change otherwise
+    writeback_mmap(&fileMap, pos, size);
+}
+
+void ChunkedFile::release(uint64_t pos, uint64_t size)
+{
+    std::unique_lock<std::mutex> lock(tailMutex);
+    release_mmap(&fileMap, pos, size);
+}
 
 /*
 uint8_t* ChunkedFile::getChunkDataPtr(uint64_t filePos)
@@ -294,12 +446,14 @@ void ChunkedFile::Iterator::moveToNextValidChunk()
 
 ChunkedFile::Iterator ChunkedFile::begin()
 {
+    releaseArenas();
     //first chunk starts right after the uint64_t free space counter
     return Iterator(*this, ((uint8_t*)this->fileMap.ptr)+sizeof(uint64_t));
 }
 
 ChunkedFile::Iterator ChunkedFile::end()
 {
+    releaseArenas();
     return Iterator(*this, ((uint8_t*)this->fileMap.ptr)+this->getStartPosOfFreeSpace(), true);
 }
 
@@ -6,6 +6,7 @@
 
 #include <vector>
 #include <map>
+#include <mutex>
 #include <string>
 
 #include <assert.h>
@@ -30,6 +31,16 @@
    to a maximum chunk size of about 1,9GB), the free list simply consists of a list of 
    free chunks for each of the 63 different possible sizes. So free space management is
    simplified. 
+   
+   Chunks may be created and freed by several threads at once. Each thread creates its chunks
+   in an 'arena', i.e. in an extent that it has claimed from the end of the file (or from the
+   free list of its size class), so that the threads only rarely compete for the end of the
+   file. The unused rest of an extent that is not at the end of the file is split into
+   free chunks. And the file is mapped into a range of address space that has been reserved
+   in advance. So its mapping never moves, and pointers to chunks stay valid while other
+   threads create new chunks.
+   Iterating over the chunks (begin(), end()) returns the unused parts of all arenas to the
+   file, and thus must not happen concurrently with createChunk().
 */
 class Chunk;
 
@@ -39,8 +50,15 @@ public:
     ChunkedFile(std::string filename);
     ~ChunkedFile();
     //uint64_t createChunk(uint64_t size);
+    // thread-safe
     Chunk createChunk(uint64_t size);
+    // thread-safe
     void freeChunk(Chunk &chunk);
+    /* thread-safe. Page cache control for chunks that have been written and are not accessed
+     * again soon (see writeback_mmap() and release_mmap()): starts writing back the byte
+     * range [pos, pos+size) of the file, and evicts it from memory, respectively. */
+    void startWriteback(uint64_t pos, uint64_t size);
+    void release(uint64_t pos, uint64_t size);
 
         
     class Iterator 
@@ -63,9 +81,7 @@ public:
     //uint8_t* getChunkDataPtr(uint64_t filePos);
 //private:
 public: //'public' for debugging
-    void increaseSize(uint64_t newSize);
     uint64_t getFreeSpaceAtEnd() const;
-    void setFreeSpaceAtEnd(uint64_t freeSpace);
     uint64_t getStartPosOfFreeSpace() const;
     bool isValidChunk(uint64_t pos) const;
 
@@ -73,11 +89,31 @@ public: //'public' for debugging
     static const uint64_t numChunkSizes;
 
 private:
+    struct Arena {
+        std::mutex mutex;
+        uint64_t pos, end;  //the part of the arena's extent that is still unused
+    };
+
+    struct FreeList {
+        std::mutex mutex;
+        std::vector<uint64_t> positions;
+    };
+
     void loadFreeLists();
+    // the following three methods must only be called while holding 'tailMutex'
+    void increaseSize(uint64_t additionalSpace);
+    void setFreeSpaceAtEnd(uint64_t freeSpace);
+    uint64_t claimFromEnd(uint64_t size);
+
+    uint64_t createInArena(Arena &arena, uint64_t chunkSize);
+    void addFreeChunks(uint64_t pos, uint64_t size);
+    void releaseArenas();
     enum CHUNK_BITS {INVALID_CHUNK = 0x40, UNUSED_CHUNK = 0x80, CHUNK_SIZE_MASK= 0x3F};
 
     std::string filename;
-    std::vector<uint64_t> *freeLists;
+    FreeList *freeLists;
+    Arena *arenas;
+    std::mutex tailMutex;   //protects the free space at the end of the file, and the file size
     mmap_t fileMap;
 };
 
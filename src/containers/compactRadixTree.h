@@ -0,0 +1,182 @@
+#ifndef COMPACT_RADIX_TREE_H
+#define COMPACT_RADIX_TREE_H
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "config.h"
+
+/*  The template class CompactRadixTree has the same interface and semantics as RadixTree
+    (at(), containsPrefixOf() and insert()), but stores the whole tree in a single contiguous
+    array of 12 byte cells (a 'double-array trie') instead of in nodes with 256 child pointers
+    each (i.e. 2kB per node).
+
+    Each tree node is a cell. The child of the node in cell 's' for the character 'c' is in
+    the cell 'cells[s].base + c', which only belongs to that node if its 'parent' field is
+    's + 1' (0 marks unused cells). So following an edge takes a single memory access and
+    comparison, just as for RadixTree, but the cells of all nodes are interleaved in a
+    few kB of memory. The bases are chosen first-fit, so that the children of different
+    nodes do not collide.
+
+    The tree is optimized for lookups. Every insert() rebuilds the whole array, so
+    building a tree of n keys takes O(n^2) time. But at() and containsPrefixOf() do
+    not modify the tree, and thus may be called from several threads at once.
+*/
+
+template<typename t>
+class CompactRadixTree {
+
+public:
+    CompactRadixTree() { rebuild(); }
+
+    bool containsPrefixOf(const char* keyName) const;
+    void insert(const char* keyName, const t& value);
+    const t* at(const char* keyName) const;
+
+    uint64_t getNumBytes() const { return cells.size() * sizeof(Cell); }
+
+private:
+    struct Cell {
+        uint32_t base;      //the children of this node are in the cells 'base + c'
+        uint32_t parent;    //index of the parent's cell + 1; 0 for unused cells
+        uint32_t value;     //index into 'values' + 1; 0 for nodes without a value
+    };
+    typedef typename std::map<std::string, t>::const_iterator EntryIterator;
+
+    void rebuild();
+    void build(uint32_t cell, EntryIterator begin, EntryIterator end, uint64_t depth);
+
+private:
+    std::map<std::string, t> entries;  //only used to rebuild the tree
+    std::vector<Cell> cells;
+    std::vector<t> values;
+    uint32_t firstFreeCell;            //only used by build(): no cell before it is unused
+};
+
+
+template<typename t>
+bool CompactRadixTree<t>::containsPrefixOf(const char* keyName) const
+{
+    const unsigned char* key = (const unsigned char*)keyName;
+    uint32_t pos = 0;
+
+    for (; *key; key++)
+    {
+        if (cells[pos].value)
+            return true;
+
+        uint32_t child = cells[pos].base + *key;
+        if (cells[child].parent != pos + 1)
+            return false;
+
+        pos = child;
+    }
+
+    return cells[pos].value;
+}
+
+template<typename t>
+const t* CompactRadixTree<t>::at(const char* keyName) const
+{
+    const unsigned char* key = (const unsigned char*)keyName;
+    uint32_t pos = 0;
+
+    for (; *key; key++)
+    {
+        uint32_t child = cells[pos].base + *key;
+        if (cells[child].parent != pos + 1)
+            return nullptr;
+
+        pos = child;
+    }
+
+    return cells[pos].value ? &values[cells[pos].value - 1] : nullptr;
+}
+
+template<typename t>
+void CompactRadixTree<t>::insert(const char* keyName, const t& value)
+{
+    entries[keyName] = value;
+    rebuild();
+}
+
+template<typename t>
+void CompactRadixTree<t>::rebuild()
+{
+    MUST( entries.size() < 0xFFFFFFFF, "too many radix tree entries");
+    values.clear();
+    cells.clear();
+    cells.resize(256, Cell());  //so that 'base + c' is a valid index for nodes without children (base 0)
+    cells[0].parent = 0xFFFFFFFF;   //the root's cell is never unused
+    firstFreeCell = 1;
+    build( 0, entries.begin(), entries.end(), 0);
+
+    /* every base is followed by 256 cells, so that lookups need no bounds checks */
+    uint32_t maxBase = 0;
+    for (const Cell &cell : cells)
+        maxBase = std::max(maxBase, cell.base);
+
+    if (cells.size() < (uint64_t)maxBase + 256)
+        cells.resize( maxBase + 256, Cell());
+}
+
+/* creates the subtree of the node in 'cell' for all entries in [begin, end[,
+ * which share their first 'depth' characters */
+template<typename t>
+void CompactRadixTree<t>::build(uint32_t cell, EntryIterator begin, EntryIterator end, uint64_t depth)
+{
+    if (begin != end && begin->first.length() == depth)   //the entry whose key ends here sorts first
+    {
+        values.push_back(begin->second);
+        cells[cell].value = values.size();
+        ++begin;
+    }
+
+    if (begin == end)
+        return;
+
+    std::vector<unsigned char> labels;
+    std::vector<EntryIterator> childBegins;
+    for (EntryIterator it = begin; it != end; ++it)
+        if (labels.empty() || (unsigned char)it->first[depth] != labels.back())
+        {
+            labels.push_back( it->first[depth]);
+            childBegins.push_back(it);
+        }
+    childBegins.push_back(end);
+
+    // first fit: the smallest base for which the cells of all children are unused
+    while (firstFreeCell < cells.size() && cells[firstFreeCell].parent)
+        firstFreeCell++;
+
+    uint32_t base = firstFreeCell > labels[0] ? firstFreeCell - labels[0] : 1;
+    for (;; base++)
+    {
+        if (cells.size() < (uint64_t)base + 256)
+            cells.resize( base + 256, Cell());
+
+        bool fits = true;
+        for (unsigned char label : labels)
+            if (cells[base + label].parent)
+            {
+                fits = false;
+                break;
+            }
+
+        if (fits)
+            break;
+    }
+
+    cells[cell].base = base;
+    for (unsigned char label : labels)
+        cells[base + label].parent = cell + 1;
+
+    for (uint64_t i = 0; i < labels.size(); i++)
+        build( base + labels[i], childBegins[i], childBegins[i+1], depth + 1);
+}
+
+#endif
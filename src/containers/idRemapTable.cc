@@ -0,0 +1,131 @@
+
+#include "containers/idRemapTable.h"
+
+#include <algorithm>
+
+IdRemapTable::IdRemapTable(std::string filename, uint64_t maxOutOfOrderItems):
+    highestValue(0), maxOutOfOrderItems(maxOutOfOrderItems)
+{
+    MUST( maxOutOfOrderItems > 0, "invalid out-of-order item limit");
+    sortedMap = init_mmap( filename.c_str(), true, true, false);
+    if (sortedMap.size < sizeof(uint64_t))  //not yet initialized
+    {
+        ensure_mmap_size( &sortedMap, sizeof(uint64_t));
+        *(uint64_t*)sortedMap.ptr = 0;
+    }
+
+    MUST( sortedMap.size >= sizeof(uint64_t) + getNumSortedEntries() * sizeof(Entry),
+          "truncated id remap table");
+
+    const Entry *entries = getSortedEntries();
+    for (uint64_t i = 0; i < getNumSortedEntries(); i++)
+        highestValue = std::max(highestValue, entries[i].second);
+}
+
+IdRemapTable::~IdRemapTable()
+{
+    merge();    //to bring all entries to disk
+    free_mmap( &sortedMap);
+}
+
+uint64_t IdRemapTable::getOrAssign(uint64_t id)
+{
+    uint64_t numSorted = getNumSortedEntries();
+
+    // fast path: the id is bigger than all sorted ids, so it either is a known out-of-order id, or new
+    if (numSorted == 0 || id > getSortedEntries()[numSorted-1].first)
+    {
+        if (outOfOrderEntries.size() && id <= outOfOrderEntries.rbegin()->first)
+        {
+            std::map<uint64_t, uint64_t>::const_iterator it = outOfOrderEntries.find(id);
+            if (it != outOfOrderEntries.end())
+                return it->second;
+        }
+
+        appendSorted( id, ++highestValue);
+        return highestValue;
+    }
+
+    if (const Entry *entry = findSorted(id))
+        return entry->second;
+
+    std::map<uint64_t, uint64_t>::const_iterator it = outOfOrderEntries.find(id);
+    if (it != outOfOrderEntries.end())
+        return it->second;
+
+    outOfOrderEntries.insert( std::make_pair(id, ++highestValue));
+    uint64_t denseId = highestValue;
+
+    if (outOfOrderEntries.size() >= maxOutOfOrderItems)
+        merge();
+
+    return denseId;
+}
+
+bool IdRemapTable::lookup(uint64_t id, uint64_t &denseIdOut) const
+{
+    if (const Entry *entry = findSorted(id))
+    {
+        denseIdOut = entry->second;
+        return true;
+    }
+
+    std::map<uint64_t, uint64_t>::const_iterator it = outOfOrderEntries.find(id);
+    if (it == outOfOrderEntries.end())
+        return false;
+
+    denseIdOut = it->second;
+    return true;
+}
+
+/* merges the out-of-order entries into the sorted entries. This is done in-place and
+ * back-to-front, so each sorted entry is moved at most once, and only those entries
+ * bigger than the smallest out-of-order id are moved at all. */
+void IdRemapTable::merge()
+{
+    if (outOfOrderEntries.size() == 0)
+        return;
+
+    uint64_t numSorted = getNumSortedEntries();
+    uint64_t numTotal  = numSorted + outOfOrderEntries.size();
+    ensure_mmap_size( &sortedMap, sizeof(uint64_t) + numTotal * sizeof(Entry));
+
+    Entry *entries = getSortedEntries();
+    uint64_t src  = numSorted;  //one past the next entry to move
+    uint64_t dest = numTotal;
+    for (std::map<uint64_t, uint64_t>::const_reverse_iterator it = outOfOrderEntries.rbegin();
+         it != outOfOrderEntries.rend(); ++it)
+    {
+        for (; src > 0 && entries[src-1].first > it->first; src--)
+            entries[--dest] = entries[src-1];
+
+        entries[--dest] = *it;
+    }
+    MUST( src == dest, "id remap table merge error");
+
+    *(uint64_t*)sortedMap.ptr = numTotal;
+    outOfOrderEntries.clear();
+}
+
+const IdRemapTable::Entry* IdRemapTable::findSorted(uint64_t id) const
+{
+    const Entry *begin = getSortedEntries();
+    const Entry *end   = begin + getNumSortedEntries();
+
+    const Entry *pos = std::lower_bound( begin, end, id,
+        [](const Entry &entry, uint64_t id) { return entry.first < id;});
+
+    return (pos != end && pos->first == id) ? pos : nullptr;
+}
+
+void IdRemapTable::appendSorted(uint64_t id, uint64_t denseId)
+{
+    uint64_t numSorted = getNumSortedEntries();
+    uint64_t necessarySize = sizeof(uint64_t) + (numSorted + 1) * sizeof(Entry);
+    if (sortedMap.size < necessarySize)
+        ensure_mmap_size( &sortedMap, necessarySize);   //grows by 10% at once, so appends are amortized O(1)
+
+    getSortedEntries()[numSorted] = std::make_pair(id, denseId);
+    *(uint64_t*)sortedMap.ptr = numSorted + 1;
+}
+
@@ -0,0 +1,59 @@
+#ifndef ID_REMAP_TABLE_H
+#define ID_REMAP_TABLE_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <utility>
+
+#include "misc/mem_map.h"
+#include "config.h"
+
+/* The class IdRemapTable maps the sparse ids of OSM entities to dense ids (1, 2, 3, ...),
+ * assigning the next unused dense id to each id when it is seen for the first time.
+ *
+ * The table is stored in a memory-mapped file of sorted (id, denseId) pairs (in the same
+ * layout as a PersistentVector< std::pair<uint64_t, uint64_t> >, i.e. preceded by a
+ * uint64_t item count). Since PBF files are sorted by id, nearly all new ids are bigger
+ * than all ids already in the table. These are simply appended to the file, which takes
+ * amortized O(1) time and requires no search at all.
+ * Only ids that arrive out of order (mostly references from ways and relations to entities
+ * that are not contained in the input file, or that come later in it) are kept in an
+ * in-memory std::map. Once that map holds 'maxOutOfOrderItems' entries (and on destruction),
+ * it is merged into the sorted file in place.
+ *
+ * lookup() does not modify the table, so it may be called from several threads at once,
+ * as long as no other thread calls getOrAssign() or merge() at the same time.
+ */
+class IdRemapTable
+{
+public:
+    IdRemapTable(std::string filename, uint64_t maxOutOfOrderItems = ID_REMAP_MAX_OUT_OF_ORDER_ITEMS);
+    ~IdRemapTable();
+
+    // returns the dense id of 'id', and assigns it the next unused dense id if it had none yet
+    uint64_t getOrAssign(uint64_t id);
+    // returns false if no dense id has been assigned to 'id'
+    bool     lookup(uint64_t id, uint64_t &denseIdOut) const;
+
+    void     merge();
+    uint64_t size() const { return getNumSortedEntries() + outOfOrderEntries.size(); }
+    uint64_t getHighestValue() const { return highestValue; }
+
+private:
+    typedef std::pair<uint64_t, uint64_t> Entry;
+
+    uint64_t getNumSortedEntries() const { return *(uint64_t*)sortedMap.ptr; }
+    Entry*   getSortedEntries() const { return (Entry*)((uint8_t*)sortedMap.ptr + sizeof(uint64_t)); }
+    const Entry* findSorted(uint64_t id) const;
+    void     appendSorted(uint64_t id, uint64_t denseId);
+
+private:
+    mmap_t sortedMap;
+    std::map<uint64_t, uint64_t> outOfOrderEntries;
+    uint64_t highestValue;
+    uint64_t maxOutOfOrderItems;
+};
+
+#endif
@@ -3,14 +3,11 @@
 #include <sys/mman.h>
 
 OsmNodeStore::OsmNodeStore(const char* indexFileName, const char* dataFileName, bool optimizeForStreaming) {
-    mapNodeIndex = init_mmap(indexFileName, true, false);
+    nodeIndex    = new TaggedNodeIndex(indexFileName);
     mapNodeData  = init_mmap(dataFileName, true, false);
 
     if (optimizeForStreaming)
-    {
         madvise( mapNodeData.ptr,  mapNodeData.size,  MADV_SEQUENTIAL);
-        madvise( mapNodeIndex.ptr, mapNodeIndex.size, MADV_SEQUENTIAL);
-    }
 
 }
 
@@ -18,22 +15,24 @@ OsmNodeStore::OsmNodeStore(const std::string &baseName, bool optimizeForStreamin
     OsmNodeStore((baseName + ".idx").c_str(), (baseName +".data").c_str(), optimizeForStreaming)
 {}
 
+OsmNodeStore::~OsmNodeStore()
+{
+    delete nodeIndex;
+    free_mmap(&mapNodeData);
+}
+
 
 OsmNode OsmNodeStore::operator[](uint64_t nodeId)
 {
-    uint64_t *nodeIndex = (uint64_t*)mapNodeIndex.ptr;
-    assert(nodeIndex[nodeId] != 0 && "trying to access non-existent node");
-    uint64_t nodePos = nodeIndex[nodeId];
+    uint64_t nodePos = 0;
+    MUST( nodeIndex->find(nodeId, nodePos), "trying to access non-existent node");
     return OsmNode((uint8_t*)mapNodeData.ptr + nodePos);
 }
 
 bool OsmNodeStore::exists(uint64_t nodeId) const
 {
-    uint64_t *nodeIndex = (uint64_t*)mapNodeIndex.ptr;
-    if (nodeId >= getMaxNumNodes())
-        return false;
-        
-    return nodeIndex[nodeId] != 0;
+    uint64_t nodePos;
+    return nodeIndex->find(nodeId, nodePos);
 }
 
 
@@ -41,34 +40,32 @@ bool OsmNodeStore::exists(uint64_t nodeId) const
 
 OsmNodeStore::NodeIterator OsmNodeStore::begin() 
 { 
-    return NodeIterator(*this, 0);
+    return NodeIterator(*this, nodeIndex->begin());
 }
 
 OsmNodeStore::NodeIterator OsmNodeStore::end()   
 { 
-    return NodeIterator(*this, getMaxNumNodes());
+    return NodeIterator(*this, nodeIndex->end());
 }
 
 uint64_t OsmNodeStore::getMaxNumNodes() const 
 { 
-    return mapNodeIndex.size / sizeof(uint64_t); 
+    return nodeIndex->getMaxNumNodes(); 
 }
 
 
-OsmNodeStore::NodeIterator::NodeIterator( OsmNodeStore &host, uint64_t pos):
+OsmNodeStore::NodeIterator::NodeIterator( OsmNodeStore &host, const TaggedNodeIndex::Iterator &pos):
     host(host), pos(pos) 
 {
-    advanceToNextNode();
 }
 
 OsmNodeStore::NodeIterator& OsmNodeStore::NodeIterator::operator++() {
-    pos++;
-    advanceToNextNode();
+    ++pos;
     return *this;
 }
 
 OsmNode OsmNodeStore::NodeIterator::operator *() {
-    return host[pos];
+    return OsmNode((uint8_t*)host.mapNodeData.ptr + pos.getChunkPosition());
 }
 
 bool OsmNodeStore::NodeIterator::operator !=( NodeIterator &other) const
@@ -76,12 +73,3 @@ bool OsmNodeStore::NodeIterator::operator !=( NodeIterator &other) const
     return pos != other.pos;
 } 
 
-void OsmNodeStore::NodeIterator::advanceToNextNode() {
-    uint64_t endPos = host.getMaxNumNodes();
-    if (pos >= endPos)
-        return;
-    uint64_t *nodeIndex = (uint64_t*)host.mapNodeIndex.ptr;
-    while ( (nodeIndex[pos] == 0 || (nodeIndex[pos] & 0x8000000000000000ull)) && pos < endPos)
-        pos+=1;            
-}        
-
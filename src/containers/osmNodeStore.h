@@ -1,17 +1,21 @@
-
 #ifndef OSM_NODE_STORE_H
 #define OSM_NODE_STORE_H
 
 #include <stdint.h>
 #include <string>
 #include "osm/osmTypes.h"
+#include "containers/taggedNodeIndex.h"
 #include "misc/mem_map.h"
 
+/* The class OsmNodeStore provides access to the nodes stored in nodes.data. Only tagged nodes
+ * are stored there (the locations of all nodes are in the VertexStore), so exists() and the
+ * iteration only cover tagged nodes. */
 class OsmNodeStore {
 
 public:
     OsmNodeStore(const char* indexFileName, const char* dataFileName, bool optimizeForStreaming = false);
     OsmNodeStore(const std::string &baseName, bool optimizeForStreaming = false);
+    ~OsmNodeStore();
     OsmNode operator[](uint64_t nodeId);
     bool exists(uint64_t nodeId) const;
     //void syncRange(uint64_t lowWayId, uint64_t highWayId) const ;
@@ -34,18 +38,17 @@ private:
     class NodeIterator {
 
     public:
-        NodeIterator( OsmNodeStore &host, uint64_t pos);
+        NodeIterator( OsmNodeStore &host, const TaggedNodeIndex::Iterator &pos);
         NodeIterator& operator++();
         OsmNode operator *();
         bool operator !=( NodeIterator &other) const;
     
     private:
-        void advanceToNextNode();
         OsmNodeStore &host;
-        uint64_t pos;
+        TaggedNodeIndex::Iterator pos;
     };
 
-    mmap_t mapNodeIndex;
+    TaggedNodeIndex *nodeIndex;
     mmap_t mapNodeData;
 };
 
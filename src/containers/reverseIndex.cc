@@ -1,23 +1,43 @@
 
 #include "containers/reverseIndex.h"
 #include "config.h"
+#include "misc/varInt.h"
 
+#include <stdio.h>  //for rename()
 #include <string.h> //for memcpy()
 #include <assert.h>
-#include <unistd.h>  //for unlink()
+#include <unistd.h>  //for unlink(), truncate()
+#include <algorithm>
 #include <iostream>
 
 
 using namespace std;
 
-/* on-disk and in-memory layout for RefList:
+/* layout of the auxiliary file:
+    - 1x uint64_t: the size of the used part of the file (in uint64_t's, including this 
+      header). The file itself is usually bigger, as its memory map grows in steps
+    - 1x uint64_t: the number of bytes within that part that are no longer used (see 
+      ReverseIndex::getUnusedSize())
+    - RefLists and packed lists, in no particular order (in target order after compact())
+
+   on-disk and in-memory layout for RefList:
     - 1x uint32_t numEntries: number of actually present entries
     - 1x uint32_t maxNumEntries: number of entries that can be present without requiring a resize;
     - 'numEntries' x uint32_t entries: the actual references. References from 
       ways have their IS_WAY_REFERENCE bit set; references without that bit
       set are relation references 
+
+   layout of a packed list (as written by a BulkBuilder; it cannot grow):
+    - varUint number of entries
+    - the entries in ascending order, each as a varUint difference to its predecessor (the 
+      first one as is). The entry for a reference from a way is (wayId << 1) | 1, the one for
+      a reference from a relation is (relationId << 1).
 */
 
+// flag of index entries that are (byte) offsets of packed lists, see reverseIndex.h
+static const uint64_t IS_PACKED_REF_LIST = 0x4000000000000000ull;
+static const uint64_t AUX_HEADER_SIZE    = 2;   //in uint64_t's
+
 class RefList {
 
 public:
@@ -100,7 +120,8 @@ ReverseIndex::ReverseIndex(string baseFileName, bool removeOldContent) :
 {}
 
 
-ReverseIndex::ReverseIndex(string indexFileName, string auxFileName, bool removeOldContent) 
+ReverseIndex::ReverseIndex(string indexFileName, string auxFileName, bool removeOldContent):
+    indexFileName(indexFileName), auxFileName(auxFileName)
 { 
     if (removeOldContent)
     {
@@ -110,19 +131,28 @@ ReverseIndex::ReverseIndex(string indexFileName, string auxFileName, bool remove
         MUST( res == 0 || errno == ENOENT, "cannot delete old reverse index");
     }
 
+    mapFiles();
+}
+
+void ReverseIndex::mapFiles()
+{
     index = init_mmap(indexFileName.c_str(), true, true);
     auxIndex= init_mmap( auxFileName.c_str(), true, true);
     
-    /* conservative guess: without a dedicated way of determining where 
-       the last auxIndex entry ends, assume that it ends at the end of the
-       underlying file.
-       This assumption errs on the side of caution: The true ending of 
-       the data may be well before that (since the file size is a multiple
-       of the page size irrespective of the actual data it contains), but 
-       never after.
-        */
     MUST( auxIndex.size % sizeof(uint64_t) == 0, "page size not multiple of uint64_t");
-    nextRefListOffset =  (auxIndex.size / sizeof(uint64_t));
+    /* the header of the auxiliary file also ensures that no ref list starts at offset zero,
+     * which would be indistinguishable from an empty index entry */
+    if (auxIndex.size == 0)
+    {
+        setNextRefListOffset(AUX_HEADER_SIZE);
+        ((uint64_t*)auxIndex.ptr)[1] = 0;
+    }
+    else
+        nextRefListOffset = ((uint64_t*)auxIndex.ptr)[0];
+
+    MUST( nextRefListOffset >= AUX_HEADER_SIZE && nextRefListOffset * sizeof(uint64_t) <= auxIndex.size, 
+          "reverse index corruption");
+    packedRefListsEnd = nextRefListOffset * sizeof(uint64_t);
 }
     
 ReverseIndex::~ReverseIndex() {
@@ -148,6 +178,9 @@ bool ReverseIndex::isReferenced( uint64_t id) {
         return true;
     }
     
+    if (val & IS_PACKED_REF_LIST)  //packed lists are never empty
+        return true;
+
     return ( RefList ( &auxIndex, val).getNumEntries() > 0);
     /*bool isReferenced = false;
     RefList refList( &auxIndex, val);
@@ -166,13 +199,28 @@ bool ReverseIndex::isReferenced( uint64_t id) {
     return isReferenced;*/
 }
     
+void ReverseIndex::setNextRefListOffset(uint64_t offset)
+{
+    ensure_mmap_size( &auxIndex, offset * sizeof(uint64_t) );
+    nextRefListOffset = offset;
+    ((uint64_t*)auxIndex.ptr)[0] = offset;
+}
+
+void ReverseIndex::addUnusedSpace(uint64_t numBytes)
+{
+    ((uint64_t*)auxIndex.ptr)[1] += numBytes;
+}
+
+uint64_t ReverseIndex::getUnusedSize() const
+{
+    return ((const uint64_t*)auxIndex.ptr)[1];
+}
+
 uint64_t ReverseIndex::reserveSpaceForRefList(uint64_t numEntries) {
     //cout << "creating new ref list of size " << numEntries << endl;
     uint64_t numUints = (numEntries + 2);  //see on-disk layout above
     uint64_t refListOffset = nextRefListOffset;
-    nextRefListOffset += numUints;
-
-    ensure_mmap_size( &auxIndex, nextRefListOffset * sizeof(uint64_t) );
+    setNextRefListOffset( nextRefListOffset + numUints);
     return refListOffset;
 }
     
@@ -182,6 +230,7 @@ void ReverseIndex::growRefList(RefList *refList, uint64_t minNumEntries)
     /* add 50% spare space to allow for adding more entries without having 
        to allocate new space yet again */
     uint64_t nEntries = minNumEntries *3 / 2;
+    addUnusedSpace( (refList->getMaxNumEntries() + 2) * sizeof(uint64_t));
     refList->resize( reserveSpaceForRefList(nEntries), nEntries);
 } 
 
@@ -216,6 +265,9 @@ void ReverseIndex::addReferenceFromWay(uint64_t targetId, uint64_t wayId)
 //            cout << "creating ref list to hold additional (wayId=" << wayId << ") for entry " << targetId << endl;
     }
     
+    if (pos[targetId] & IS_PACKED_REF_LIST)
+        unpackRefList(targetId);
+
     //cout << "adding ref (wayId=" << wayId << ") to entry " << targetId << endl;
     RefList refList( &auxIndex, pos[targetId]);
     uint64_t res = refList.add( wayId | IS_WAY_REFERENCE);
@@ -257,6 +309,8 @@ void ReverseIndex::addReferenceFromRelation(uint64_t targetId, uint64_t relation
     }
     
     assert ((pos[targetId]) != 0 && !(pos[targetId] & IS_WAY_REFERENCE));
+    if (pos[targetId] & IS_PACKED_REF_LIST)
+        unpackRefList(targetId);
     
     RefList refList( &auxIndex, pos[targetId]);
     uint64_t res = refList.add( relationId);
@@ -295,14 +349,195 @@ std::vector<uint64_t> ReverseIndex::getReferencingRelations(uint64_t id)
 
     /* index entry is an offset into the auxiliary file, where a list of
        references to this entity is stored.*/
-    RefList refList( &auxIndex, indexEntry);
-    for (uint64_t reverseRef : refList)
+    std::vector<uint64_t> refs;
+    getReferences( indexEntry, refs);
+    for (uint64_t reverseRef : refs)
     {
-        if (! (indexEntry & IS_WAY_REFERENCE))
+        if (! (reverseRef & IS_WAY_REFERENCE))
             res.push_back(reverseRef);
     }
     
     return res;
 }
 
+/* appends the references stored in the RefList or packed list that 'indexEntry' points to
+ * to 'refsOut' (references from ways with their IS_WAY_REFERENCE bit set). Returns the size
+ * of that list (in bytes) */
+uint64_t ReverseIndex::getReferences(uint64_t indexEntry, std::vector<uint64_t> &refsOut) const
+{
+    assert( indexEntry != 0 && !(indexEntry & IS_WAY_REFERENCE));
+    if (! (indexEntry & IS_PACKED_REF_LIST))
+    {
+        RefList refList( const_cast<mmap_t*>(&auxIndex), indexEntry);
+        refsOut.insert( refsOut.end(), refList.begin(), refList.end());
+        return (refList.getMaxNumEntries() + 2) * sizeof(uint64_t);
+    }
+
+    const uint8_t *begin = (const uint8_t*)auxIndex.ptr + (indexEntry & ~IS_PACKED_REF_LIST);
+    const uint8_t *pos = begin;
+    int numBytes;
+    uint64_t numEntries = varUintFromBytes(pos, &numBytes);
+    pos += numBytes;
+
+    uint64_t entry = 0;
+    for (uint64_t i = 0; i < numEntries; i++)
+    {
+        entry += varUintFromBytes(pos, &numBytes);
+        pos += numBytes;
+        refsOut.push_back( (entry & 1) ? (entry >> 1) | IS_WAY_REFERENCE : (entry >> 1));
+    }
+    return pos - begin;
+}
+
+/* writes 'refs' (which is sorted in the process) as a packed list, and returns the index 
+ * entry pointing to it. Consecutive packed lists are stored back to back */
+uint64_t ReverseIndex::writePackedRefList( std::vector<uint64_t> &refs)
+{
+    for (uint64_t &ref : refs)
+        ref = (ref & IS_WAY_REFERENCE) ? ((ref & ~IS_WAY_REFERENCE) << 1) | 1 : (ref << 1);
+    std::sort( refs.begin(), refs.end());
+    refs.erase( std::unique( refs.begin(), refs.end()), refs.end());
+
+    // only continue right behind the previous packed list if nothing else was stored since
+    uint64_t offset = packedRefListsEnd;
+    if ( (offset + sizeof(uint64_t) - 1) / sizeof(uint64_t) != nextRefListOffset)
+        offset = nextRefListOffset * sizeof(uint64_t);
+
+    uint64_t maxNumBytes = (refs.size() + 1) * 10;  //varUints have at most 10 bytes
+    ensure_mmap_size( &auxIndex, offset + maxNumBytes);
+    uint8_t *pos = (uint8_t*)auxIndex.ptr + offset;
+    pos += varUintToBytes( refs.size(), pos);
+    uint64_t prevEntry = 0;
+    for (uint64_t entry : refs)
+    {
+        pos += varUintToBytes( entry - prevEntry, pos);
+        prevEntry = entry;
+    }
+
+    packedRefListsEnd = pos - (uint8_t*)auxIndex.ptr;
+    setNextRefListOffset( (packedRefListsEnd + sizeof(uint64_t) - 1) / sizeof(uint64_t));
+    return offset | IS_PACKED_REF_LIST;
+}
+
+/* replaces the packed list of 'targetId' by an equivalent RefList (with some spare space), 
+ * so that references can be added to it. The packed list is left behind as unused space. */
+void ReverseIndex::unpackRefList(uint64_t targetId)
+{
+    uint64_t *pos = (uint64_t*)index.ptr;
+    std::vector<uint64_t> refs;
+    addUnusedSpace( getReferences( pos[targetId], refs));
+
+    uint64_t nEntries = (refs.size() + 1) * 3 / 2;
+    RefList refList = RefList::initialize(&auxIndex, reserveSpaceForRefList(nEntries), nEntries);
+    for (uint64_t ref : refs)
+        MUST( 0 == refList.add(ref), "RefList data corruption");
+    pos[targetId] = refList.getOffset();
+}
+
+void ReverseIndex::compact()
+{
+    string compactedIndexFileName = indexFileName + ".tmp";
+    string compactedAuxFileName   = auxFileName   + ".tmp";
+    uint64_t compactedAuxSize;
+    {
+        ReverseIndex compacted( compactedIndexFileName, compactedAuxFileName, true);
+        uint64_t numEntries = index.size / sizeof(uint64_t);
+        ensure_mmap_size( &compacted.index, numEntries * sizeof(uint64_t));
+        
+        const uint64_t *src  = (const uint64_t*)index.ptr;
+        uint64_t       *dest = (uint64_t*)compacted.index.ptr;
+        std::vector<uint64_t> refs;
+        for (uint64_t id = 0; id < numEntries; id++)
+        {
+            if (src[id] == 0)   //not writing zeros keeps the index file sparse
+                continue;
+            
+            if (src[id] & IS_WAY_REFERENCE)
+            {
+                dest[id] = src[id];
+                continue;
+            }
+            
+            refs.clear();
+            getReferences( src[id], refs);
+            if (refs.size() == 1 && (refs[0] & IS_WAY_REFERENCE))
+                dest[id] = refs[0];
+            else if (refs.size() > 0)
+                dest[id] = compacted.writePackedRefList( refs);
+        }
+        compactedAuxSize = compacted.nextRefListOffset * sizeof(uint64_t);
+    }
+
+    // memory maps grow in steps, so cut off the unused rest of both files
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    MUST( truncate( compactedIndexFileName.c_str(), index.size) == 0, "cannot resize reverse index");
+    MUST( truncate( compactedAuxFileName.c_str(), 
+                    (compactedAuxSize + pageSize - 1) / pageSize * pageSize) == 0, "cannot resize reverse index");
+
+    free_mmap(&index);
+    free_mmap(&auxIndex);
+    MUST( rename( compactedIndexFileName.c_str(), indexFileName.c_str()) == 0, "cannot replace reverse index");
+    MUST( rename( compactedAuxFileName.c_str(),   auxFileName.c_str())   == 0, "cannot replace reverse index");
+    mapFiles();
+}
+
+// ==========================================
+
+ReverseIndex::BulkBuilder::BulkBuilder(ReverseIndex &host): 
+    host(host), targetId(0), hasTarget(false) 
+{}
+
+ReverseIndex::BulkBuilder::~BulkBuilder()
+{
+    finish();
+}
+
+void ReverseIndex::BulkBuilder::addReferenceFromWay(uint64_t targetId, uint64_t wayId)
+{
+    MUST(wayId < (((uint64_t)1) << 31), "way IDs bigger than or equal 2^63 are currently unsupported");
+    add( targetId, wayId | IS_WAY_REFERENCE);
+}
+
+void ReverseIndex::BulkBuilder::addReferenceFromRelation(uint64_t targetId, uint64_t relationId)
+{
+    MUST(relationId < (((uint64_t)1) << 31), "relation IDs bigger than or equal 2^63 are currently unsupported");
+    add( targetId, relationId);
+}
+
+void ReverseIndex::BulkBuilder::add(uint64_t targetId, uint64_t ref)
+{
+    if (hasTarget && targetId != this->targetId)
+    {
+        MUST( targetId > this->targetId, "references have to be added in ascending order of their target ids");
+        finish();
+    }
+    
+    this->targetId = targetId;
+    hasTarget = true;
+    refs.push_back(ref);
+}
+
+void ReverseIndex::BulkBuilder::finish()
+{
+    if (refs.empty())
+        return;
+
+    ensure_mmap_size( &host.index, (targetId+1) * sizeof(uint64_t));
+    uint64_t *pos = (uint64_t*)host.index.ptr;
+    if (pos[targetId] & IS_WAY_REFERENCE)
+        refs.push_back( pos[targetId]);
+    else if (pos[targetId] != 0)
+        host.addUnusedSpace( host.getReferences( pos[targetId], refs));
+
+    std::sort( refs.begin(), refs.end());
+    refs.erase( std::unique( refs.begin(), refs.end()), refs.end());
+    
+    // the most common case: the target is referenced by a single way only
+    if (refs.size() == 1 && (refs[0] & IS_WAY_REFERENCE))
+        pos[targetId] = refs[0];
+    else
+        pos[targetId] = host.writePackedRefList( refs);
+
+    refs.clear();
+}
 
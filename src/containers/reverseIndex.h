@@ -27,13 +27,22 @@
  * - if Y is 0, there are no reverse dependencies for X
  * - if the most significant bit of Y is set, then X is referenced by exactly one way (and by 
  *   no relation), and that way has the ID given by the lower 63 bits of Y
- * - if the most significant bit of Y is not set, then X is referenced by at least one relation
- *   or by multiple way (or a combination thereof). In this case, the value of Y is an offset
- *   into the auxiliary files, where the full list of reverse dependencies is recorded.
+ * - otherwise, X is referenced by at least one relation or by multiple ways (or a combination
+ *   thereof), and Y is the offset of the full list of reverse dependencies in the auxiliary 
+ *   file. If the second most significant bit of Y is set, that list is a packed list (the 
+ *   lower bits of Y are its offset in bytes), otherwise it is a growable RefList (and Y is its
+ *   offset in uint64_t's). See reverseIndex.cc for the layout of both.
  * As most entities are referred to either not at all, or only by a single way, this storage
  * scheme is fast and reduces memory consumption over alternative approaches: the reverse
  * references to most entities consume only a single uint64_t of memory.
  *
+ * When the references are known in advance and sorted by target id (like when a storage is
+ * created), a BulkBuilder writes them in a single sequential pass. The result is essentially
+ * a compressed sparse row layout: the index array holds the offsets, and the packed lists of
+ * all targets are stored back to back in target order. Adding references one by one 
+ * (addReferenceFromWay/Relation()) still works on top of such an index: a packed list that
+ * receives another reference is converted to a RefList first.
+ *
  * A ReverseIndex assumes that all reference IDs (way and relation IDs) and all offsets into 
  * the auxiliary file are at most 63 bits (not 64 bits!) wide, as the MSB of the stored
  * uint64_t's is used as an independent flag. Violating this assumpion will corrupt the
@@ -54,14 +63,52 @@ public:
     
     std::vector<uint64_t> getReferencingRelations(uint64_t id);
 
+    /* the number of bytes of the auxiliary file that are no longer in use (left behind by ref
+     * lists that have been moved to make room for more references) */
+    uint64_t getUnusedSize() const;
+    /* rewrites the index and the auxiliary file without unused space, with all ref lists as 
+     * packed lists that are stored in the order of their targets. The ReverseIndex remains
+     * usable (and modifiable) afterwards. */
+    void compact();
+
+    /* Adds references in ascending order of their target ids (references to the same target
+     * may be added in any order), and writes the references to each target as soon as all of
+     * them are known. References to targets that already had references are merged with 
+     * those. The index must not be modified otherwise while a BulkBuilder is in use.
+     */
+    class BulkBuilder {
+    public:
+        BulkBuilder(ReverseIndex &host);
+        ~BulkBuilder(); //calls finish()
+        void addReferenceFromWay(uint64_t targetId, uint64_t wayId);
+        void addReferenceFromRelation(uint64_t targetId, uint64_t relationId);
+        // writes the references to the last target
+        void finish();
+    private:
+        void add(uint64_t targetId, uint64_t ref);
+
+        ReverseIndex &host;
+        uint64_t targetId;
+        bool hasTarget;
+        std::vector<uint64_t> refs; //references to 'targetId' that have not been written yet
+    };
+
 private:
+    void mapFiles();
     uint64_t reserveSpaceForRefList(uint64_t numEntries);
     void growRefList(RefList *refList, uint64_t minNumEntries);
+    void setNextRefListOffset(uint64_t offset);
+    void addUnusedSpace(uint64_t numBytes);
+    uint64_t getReferences(uint64_t indexEntry, std::vector<uint64_t> &refsOut) const;
+    uint64_t writePackedRefList( std::vector<uint64_t> &refs);
+    void unpackRefList(uint64_t targetId);
 
 private:
+     std::string indexFileName, auxFileName;
      mmap_t index;
      mmap_t auxIndex;
-     uint64_t nextRefListOffset;
+     uint64_t nextRefListOffset;    //in uint64_t's, see setNextRefListOffset()
+     uint64_t packedRefListsEnd;    //in bytes, the end of the last packed list
 };
 
 #endif
@@ -1,37 +1,55 @@
-
 #ifndef SERIALIZABLE_MAP_H
 #define SERIALIZABLE_MAP_H
 
+#include <stdio.h>  //for rename()
+#include <unistd.h> //for unlink()
+#include <assert.h>
+
+#include <algorithm>
+#include <atomic>
 #include <map>
-#include "persistentVector.h"
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "misc/mem_map.h"
+#include "containers/bloomFilter.h"
+#include "config.h"
 
 /* The template class SerializableMap represents a dictionary (key-value store) that
  * is partially backed by on-disk storage, and can manually (via merge() or through
  * the destructor) be forced to be completely written to disk and thus made persistent.
  *
- * The indented use for SerializableMap are huge dictionaries (gigabytes or data) 
- * that at the same time should be persistent, stored compactly and fast. 
+ * The indented use for SerializableMap are huge dictionaries (gigabytes or data)
+ * that at the same time should be persistent, stored compactly and fast.
  * Here, storing the dictionary as a std::map would waste memory: a std::map entry
  * requires about 16 bytes of memory for book-keeping in addition to storing the
  * actual data, which can prohibatively increase memory consumption for huge dictionaries
  * where keys and values themselves require little memory.
- * Instead, a PersistentVector keeps newly created entries in memory, and - once 
- * a threshold is reached - write them to disk in bulk. As the on-disk part is memory-mapped,
- * it will be kept in memory as long as there is enough memory available (as decided by
- * the OS). And when not enough memory is available, the PersistentVector with transparently
- * degrade gracefully: the OS will remove some parts of the memory-mapped file from memory,
- * but these will transparently be loaded again when used.
+ * As the on-disk parts are memory-mapped, they will be kept in memory as long as there is
+ * enough memory available (as decided by the OS). And when not enough memory is available,
+ * the SerializableMap will transparently degrade gracefully: the OS will remove some parts
+ * of the memory-mapped files from memory, but these will transparently be loaded again when used.
  *
- * Internally, a SerializableMap consists of a std::map and a memory-mapped array of 
- * key-value pairs that is kept sorted by key. Newly added key-value pairs are stored
- * in the std::map. Whenever this std::map would contain more than MAX_ITEMS_IN_MEMORY,
- * its contents are written to disk using a merge step identical to that used in MergeSort.
- * This merge step creates a separate on-disk file containing the merged contents. After
- * the merge has completed, the new file atomically overwrites the old one. At this point,
- * the on-disk storage contains all key-value pairs, and the in-memory storage is cleared.
+ * Internally, a SerializableMap is a log-structured merge tree: a std::map for newly added
+ * key-value pairs, and a number of 'runs', i.e. memory-mapped arrays of key-value pairs that
+ * are each sorted by key. The oldest run is the persistent file 'filename' itself, all
+ * others are temporary files 'filename.run<n>'.
+ * - Whenever the std::map would contain more than MAX_ITEMS_IN_MEMORY entries, it is written
+ *   out as a new run (which is a simple sequential write, since the std::map is sorted).
+ * - Whenever a run is about as big as the run before it, a background thread merges both into
+ *   a single run, while insertions and lookups continue. So the temporary runs roughly double
+ *   in size from newest to oldest, there are only O(log n) of them, and each entry is
+ *   rewritten only O(log n) times. Runs whose key ranges do not overlap (the common case for
+ *   OSM ids, which are usually processed in ascending order) are simply concatenated.
+ * - Each run has a key range and a Bloom filter, so that a lookup of a key that is not in
+ *   the map (the common case for OSM id remapping) usually does not touch any run at all.
+ * - merge() merges all runs (and the std::map) into the persistent file, which then has
+ *   the same layout as a PersistentVector< std::pair<KEY_T, VALUE_T> >.
  *
  * Limitations:
  * - currently, there is no way to remove an entry from a serializable map.
+ * - references returned by operator[] are only valid until the next call to insert() or merge()
  * - merges are not currently fsynced for performance reasons, so OS crashes or power outages can lead to data corruption
 */
 
@@ -39,25 +57,56 @@ template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
 class SerializableMap
 {
 public:
-    SerializableMap(const char* filename, bool clearContents = false);    
+    SerializableMap(const char* filename, bool clearContents = false);
     ~SerializableMap();
-    
+
     void merge();
     void insert(const std::pair<KEY_T, VALUE_T> &kv);
-    
+
     int      count(KEY_T key);
     uint64_t size() const;
-    
+
     VALUE_T  getHighestValue() const;
     VALUE_T& operator[](const KEY_T &key);
-    
+
 private:
-    VALUE_T* onDiskPosition(KEY_T key);
+    typedef std::pair<KEY_T, VALUE_T> Entry;
+
+    // a sorted array of key-value pairs, in a memory-mapped file of PersistentVector layout
+    struct Run {
+        Run(const std::string &filename, bool clearContents);
+        ~Run() { free_mmap(&map); }
+
+        uint64_t size()  const { return *(uint64_t*)map.ptr; }
+        Entry*   begin() const { return (Entry*)((uint8_t*)map.ptr + sizeof(uint64_t)); }
+        Entry*   end()   const { return begin() + size(); }
+        void     resize(uint64_t numEntries);
+        void     buildFilter();
+        Entry*   find(const KEY_T &key, uint64_t keyHash) const;
+
+        std::string filename;
+        mmap_t map;
+        BloomFilter filter;
+        bool isCompacting;  //is currently being merged by the background thread
+    };
+
+    VALUE_T* onDiskPosition(KEY_T key, Run **runOut = nullptr);
+    void flushInMemoryMap();
+    void startCompaction();
+    void finishCompaction(bool wait);
+    void deleteRun(Run *run);
+    static void mergeRuns(const std::vector<Run*> &sources, Run *dest);
 
 private:
     std::string filename;
     std::map<KEY_T, VALUE_T> inMemoryMap;
-    PersistentVector< std::pair<KEY_T, VALUE_T> > *onDiskMap;
+    std::vector<Run*> runs;     //oldest first; runs[0] is the persistent file
+    uint64_t nextRunId;
+
+    std::thread compactionThread;
+    std::atomic<bool> compactionDone;
+    Run *compactionResult;
+    uint64_t compactionPos;     //position in 'runs' of the first of the two runs being merged
 };
 
 
@@ -66,15 +115,66 @@ private:
 // ==========================================
 
 template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
-SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::SerializableMap(const char* filename, bool clearContents): filename(filename) {
-    onDiskMap = new PersistentVector< std::pair<KEY_T, VALUE_T> >(filename, clearContents);
+SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::Run::Run(const std::string &filename, bool clearContents):
+    filename(filename), isCompacting(false)
+{
+    map = init_mmap(filename.c_str(), true, true, clearContents);
+    if (map.size < sizeof(uint64_t))    //not yet initialized
+    {
+        ensure_mmap_size(&map, sizeof(uint64_t));
+        *(uint64_t*)map.ptr = 0;
+    }
+}
+
+template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
+void SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::Run::resize(uint64_t numEntries)
+{
+    ensure_mmap_size(&map, sizeof(uint64_t) + numEntries * sizeof(Entry));
+    *(uint64_t*)map.ptr = numEntries;
+}
+
+template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
+void SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::Run::buildFilter()
+{
+    filter = BloomFilter(size());
+    for (const Entry *pos = begin(); pos != end(); pos++)
+        filter.add( BloomFilter::hashOf(pos->first));
 }
 
 template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
-SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::~SerializableMap() 
+typename SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::Entry*
+SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::Run::find(const KEY_T &key, uint64_t keyHash) const
+{
+    if (size() == 0 || key < begin()->first || (end()-1)->first < key || !filter.mayContain(keyHash))
+        return NULL;
+
+    uint64_t lo = 0;
+    uint64_t hi = size();   //exclusive
+    while (lo < hi)
+    {
+        uint64_t mid = (lo + hi)/2;
+        if (begin()[mid].first < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return (lo < size() && begin()[lo].first == key) ? begin() + lo : NULL;
+}
+
+template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
+SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::SerializableMap(const char* filename, bool clearContents):
+    filename(filename), nextRunId(0), compactionDone(false), compactionResult(NULL), compactionPos(0)
+{
+    runs.push_back( new Run(filename, clearContents));
+    runs.front()->buildFilter();
+}
+
+template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
+SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::~SerializableMap()
 {
     merge(); //to bring all map contents to disk
-    delete onDiskMap;
+    delete runs.front();
 }
 
 template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
@@ -84,45 +184,143 @@ VALUE_T SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::getHighestValue()
     for ( const std::pair<KEY_T, VALUE_T> &kv: inMemoryMap)
         if (kv.second > val)
             val = kv.second;
-            
-    for ( const std::pair<KEY_T, VALUE_T> &kv: *onDiskMap)
-        if (kv.second > val)
-            val = kv.second;
-    
-    return val;    
+
+    for (const Run *run : runs)
+        for ( const Entry *kv = run->begin(); kv != run->end(); kv++)
+            if (kv->second > val)
+                val = kv->second;
+
+    return val;
+}
+
+/* merges two or more sorted runs with disjoint key sets into 'dest'. Called from the
+ * background thread, so it must not touch any of the SerializableMap's members. */
+template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
+void SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::mergeRuns(const std::vector<Run*> &sources, Run *dest)
+{
+    uint64_t numEntries = 0;
+    for (const Run *run : sources)
+        numEntries += run->size();
+    dest->resize(numEntries);
+
+    std::vector<const Entry*> pos;
+    for (const Run *run : sources)
+        pos.push_back(run->begin());
+
+    Entry *out = dest->begin();
+    while (out != dest->end())
+    {
+        int minIdx = -1;
+        for (uint64_t j = 0; j < sources.size(); j++)
+            if (pos[j] != sources[j]->end() && (minIdx < 0 || pos[j]->first < pos[minIdx]->first))
+                minIdx = j;
+        assert(minIdx >= 0);
+
+        /* all entries of source 'minIdx' that are smaller than the next entry of every other
+         * source can be copied at once. For non-overlapping runs, this copies each run as a whole */
+        const Entry *bound = NULL;
+        for (uint64_t j = 0; j < sources.size(); j++)
+            if ((int)j != minIdx && pos[j] != sources[j]->end() && (!bound || pos[j]->first < bound->first))
+                bound = pos[j];
+
+        const Entry *rangeEnd = !bound ? sources[minIdx]->end() :
+            std::lower_bound( pos[minIdx], (const Entry*)sources[minIdx]->end(), *bound,
+                              [](const Entry &a, const Entry &b) { return a.first < b.first;});
+
+        out = std::copy( pos[minIdx], rangeEnd, out);
+        pos[minIdx] = rangeEnd;
+    }
+    MUST( out == dest->end(), "run merge error");
+    dest->buildFilter();
+}
+
+template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
+void SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::deleteRun(Run *run)
+{
+    std::string runFilename = run->filename;
+    delete run;
+    if (runFilename != filename)
+        unlink(runFilename.c_str());
 }
 
+/* starts merging the newest two temporary runs of similar size in a background thread. The
+ * persistent file is only merged in merge(), so it stays intact until then. */
 template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
-void SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::merge() 
+void SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::startCompaction()
 {
-    /*TODO:  add separate code path for when the biggest key in the on-disk map
-     *       is smaller than the smallest key in the in-memory map. In that case
-     *       the in-memory map can simply be appended to the on-disk map instead
-     *       of requiring a merger. This situation should be the norm for OSM ID
-     *       remapping, where the entities are usually processed in ID order */
-    PersistentVector< std::pair<KEY_T, VALUE_T> > *dest = 
-        new PersistentVector< std::pair<KEY_T, VALUE_T> >( (std::string(filename)+".tmp").c_str(), true);
-    
-    std::pair<KEY_T, VALUE_T> *pos2 = onDiskMap->begin();
-    
-    for (const std::pair<KEY_T, VALUE_T> &val1 : inMemoryMap)
+    if (compactionThread.joinable())
+        return;
+
+    for (uint64_t i = runs.size() - 1; i >= 2; i--)
     {
-        for ( ; pos2 != onDiskMap->end() && *pos2 < val1; pos2 ++)
-            dest->push_back( *pos2);
-            
-        dest->push_back(val1);
+        if (runs[i-1]->size() > 2 * runs[i]->size())
+            continue;
+
+        compactionPos = i - 1;
+        runs[i-1]->isCompacting = runs[i]->isCompacting = true;
+        std::vector<Run*> sources = {runs[i-1], runs[i]};
+        compactionResult = new Run( filename + ".run" + std::to_string(nextRunId++), true);
+        compactionDone = false;
+
+        Run *dest = compactionResult;
+        std::atomic<bool> *done = &compactionDone;
+        compactionThread = std::thread( [sources, dest, done]() {
+            mergeRuns(sources, dest);
+            *done = true;
+        });
+        return;
     }
-    
-    for (; pos2 != onDiskMap->end(); pos2 ++)
-        dest->push_back(*pos2);
+}
+
+template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
+void SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::finishCompaction(bool wait)
+{
+    if (!compactionThread.joinable() || (!wait && !compactionDone))
+        return;
 
-    /* replace old file by new file (file descriptors to the previous file 
-       name stay valid, so 'dest' is unaffected by the renaming of its 
+    compactionThread.join();
+    deleteRun( runs[compactionPos]);
+    deleteRun( runs[compactionPos+1]);
+    runs[compactionPos] = compactionResult;
+    runs.erase( runs.begin() + compactionPos + 1);
+    compactionResult = NULL;
+}
+
+template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
+void SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::flushInMemoryMap()
+{
+    if (inMemoryMap.size() == 0)
+        return;
+
+    Run *run = new Run( filename + ".run" + std::to_string(nextRunId++), true);
+    run->resize( inMemoryMap.size());
+    std::copy( inMemoryMap.begin(), inMemoryMap.end(), run->begin());
+    run->buildFilter();
+    runs.push_back(run);
+    inMemoryMap.clear();
+}
+
+template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
+void SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::merge()
+{
+    finishCompaction(true);
+    flushInMemoryMap();
+    if (runs.size() == 1)
+        return;
+
+    Run *dest = new Run( filename + ".tmp", true);
+    mergeRuns(runs, dest);
+
+    /* replace old file by new file (file descriptors to the previous file
+       name stay valid, so 'dest' is unaffected by the renaming of its
        underlying file */
     rename( (filename+".tmp").c_str(), filename.c_str());
-    delete onDiskMap;
-    onDiskMap = dest;
-    inMemoryMap.clear();
+    dest->filename = filename;
+
+    for (Run *run : runs)
+        deleteRun(run);
+    runs.clear();
+    runs.push_back(dest);
 }
 
 template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
@@ -131,7 +329,11 @@ void SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::insert(const std::pai
     assert( this->count(kv.first) == 0);
     inMemoryMap.insert(kv);
     if (inMemoryMap.size() >= MAX_ITEMS_IN_MEMORY)
-        this->merge();
+    {
+        finishCompaction(false);
+        flushInMemoryMap();
+        startCompaction();
+    }
 }
 
 template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
@@ -140,49 +342,49 @@ int SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::count(KEY_T key) {
 }
 
 template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
-uint64_t SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::size() const 
-{ 
-    return inMemoryMap.size() + onDiskMap->size();
+uint64_t SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::size() const
+{
+    uint64_t numEntries = inMemoryMap.size();
+    for (const Run *run : runs)
+        numEntries += run->size();
+    return numEntries;
 }
 
 template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
-VALUE_T& SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::operator[](const KEY_T &key) 
+VALUE_T& SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::operator[](const KEY_T &key)
 {
     assert( count(key) );
-    return inMemoryMap.count(key) ?
-        inMemoryMap[key] :
-        *onDiskPosition(key);
+    typename std::map<KEY_T, VALUE_T>::iterator it = inMemoryMap.find(key);
+    if (it != inMemoryMap.end())
+        return it->second;
+
+    Run *run = NULL;
+    VALUE_T *value = onDiskPosition(key, &run);
+    /* the caller may modify the value through the returned reference. So if the background
+     * thread is currently copying that value to a new run, wait for it and use the new run */
+    if (run && run->isCompacting)
+    {
+        finishCompaction(true);
+        value = onDiskPosition(key);
+    }
+    return *value;
 }
 
 
 template <typename KEY_T, typename VALUE_T, int MAX_ITEMS_IN_MEMORY>
-VALUE_T* SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::onDiskPosition(KEY_T key)
+VALUE_T* SerializableMap<KEY_T, VALUE_T, MAX_ITEMS_IN_MEMORY>::onDiskPosition(KEY_T key, Run **runOut)
 {
-    if (onDiskMap->size() == 0) //empty --> cannot contain 'key'
-        return NULL;
-        
-    uint64_t lo = 0;
-    uint64_t hi = onDiskMap->size()-1;
-    
-    if (key < (*onDiskMap)[lo].first || key > (*onDiskMap)[hi].first)
-        return NULL;
-        
-    while (lo + 1 < hi)
-    {
-        assert(lo <= hi);
-        uint64_t mid = (lo + hi)/2;
-        if ( (*onDiskMap)[mid].first == key)
-            return &(*onDiskMap)[mid].second;
-        else if ( (*onDiskMap)[mid].first < key)
-            lo = mid;
-        else 
-            hi = mid;
-    }
-    
-    return ((*onDiskMap)[lo].first == key ) ? &(*onDiskMap)[lo].second :
-           ((*onDiskMap)[hi].first == key ) ? &(*onDiskMap)[hi].second :
-             NULL;
-}    
+    uint64_t keyHash = BloomFilter::hashOf(key);
+    for (uint64_t i = runs.size(); i > 0; i--)  //newest runs first
+        if (Entry *entry = runs[i-1]->find(key, keyHash))
+        {
+            if (runOut)
+                *runOut = runs[i-1];
+            return &entry->second;
+        }
+
+    return NULL;
+}
 
 
 #endif
@@ -0,0 +1,294 @@
+
+#include <stdio.h>
+#include <string.h> //for memcmp()
+#include <unistd.h> //for unlink()
+
+#include <algorithm>
+
+#include "containers/taggedNodeIndex.h"
+
+static const char     NODE_INDEX_MAGIC[8] = {'C', 'O', 'O', 'R', 'D', 'S', 'N', 'I'};
+static const uint32_t NODE_INDEX_VERSION  = 1;
+
+/* File layout: this header, followed by the sections it points to (all of them arrays of
+ * uint64_t): the low bits, the upper bit vector, the zero samples, the group headers (two
+ * entries per group: smallest position, and bit offset | (bit width << 56)) and the bit-packed
+ * position differences. The file is padded to a multiple of the page size. */
+struct TaggedNodeIndexHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t lowBits;
+    uint64_t numEntries;
+    uint64_t universe;
+    uint64_t lowerOffset, upperOffset, zeroSamplesOffset, groupsOffset, packedPositionsOffset;
+};
+
+static inline uint64_t getBits(const uint64_t *words, uint64_t pos, uint32_t width)
+{
+    if (width == 0)
+        return 0;
+
+    uint64_t shift = pos % 64;
+    uint64_t value = words[pos / 64] >> shift;
+    if (shift + width > 64)
+        value |= words[pos / 64 + 1] << (64 - shift);
+    return width == 64 ? value : value & ((1ull << width) - 1);
+}
+
+static void appendBits(std::vector<uint64_t> &words, uint64_t &numBits, uint64_t value, uint32_t width)
+{
+    if (width == 0)
+        return;
+
+    while (words.size() < (numBits + width) / 64 + 2)   //one word of padding for getBits()
+        words.push_back(0);
+
+    uint64_t shift = numBits % 64;
+    words[numBits / 64] |= value << shift;
+    if (shift + width > 64)
+        words[numBits / 64 + 1] |= value >> (64 - shift);
+    numBits += width;
+}
+
+static uint32_t getBitWidth(uint64_t value)
+{
+    return value ? 64 - __builtin_clzll(value) : 0;
+}
+
+// ==========================================
+
+TaggedNodeIndex::Builder::Builder(const std::string &fileName): 
+    fileName(fileName), isSorted(true), lastNodeId(0)
+{
+    entries = new PersistentVector<Entry>( (fileName + ".tmp").c_str(), true);
+}
+
+TaggedNodeIndex::Builder::~Builder()
+{
+    finish();
+}
+
+void TaggedNodeIndex::Builder::add(uint64_t nodeId, uint64_t chunkPos)
+{
+    if (entries->size() > 0 && nodeId <= lastNodeId)
+        isSorted = false;
+
+    Entry entry = { nodeId, chunkPos};
+    entries->push_back( entry);
+    lastNodeId = nodeId;
+}
+
+void TaggedNodeIndex::Builder::finish()
+{
+    if (!entries)
+        return;
+
+    // input files are usually sorted by id, so this is rarely necessary
+    if (!isSorted)
+        std::stable_sort( entries->begin(), entries->end(), 
+            [](const Entry &a, const Entry &b) { return a.nodeId < b.nodeId; });
+
+    // remove duplicates (keeping the last entry of each id)
+    Entry *data = entries->begin();
+    uint64_t numEntries = 0;
+    for (uint64_t i = 0; i < entries->size(); i++)
+        if (i + 1 == entries->size() || data[i].nodeId != data[i + 1].nodeId)
+            data[numEntries++] = data[i];
+
+    TaggedNodeIndexHeader header;
+    memset( &header, 0, sizeof(header));
+    memcpy( header.magic, NODE_INDEX_MAGIC, sizeof(NODE_INDEX_MAGIC));
+    header.version    = NODE_INDEX_VERSION;
+    header.numEntries = numEntries;
+    header.universe   = numEntries ? data[numEntries - 1].nodeId + 1 : 0;
+    header.lowBits    = (numEntries && header.universe / numEntries > 1) ? 
+                        getBitWidth( header.universe / numEntries) - 1 : 0;
+
+    std::vector<uint64_t> lower, upper, zeroSamples, groups, packedPositions;
+    uint64_t numLowerBits = 0, numPackedBits = 0;
+    uint64_t upperLength = numEntries + (header.universe >> header.lowBits) + 1;
+    upper.resize( upperLength / 64 + 2, 0);
+    for (uint64_t i = 0; i < numEntries; i++)
+    {
+        uint64_t id = data[i].nodeId;
+        appendBits( lower, numLowerBits, id & ((1ull << header.lowBits) - 1), header.lowBits);
+        uint64_t pos = (id >> header.lowBits) + i;
+        upper[pos / 64] |= 1ull << (pos % 64);
+    }
+
+    for (uint64_t pos = 0, numZeros = 0; pos < upperLength; pos++)
+        if (! (upper[pos / 64] & (1ull << (pos % 64))))
+        {
+            if (numZeros % NODE_INDEX_SELECT_SAMPLE == 0)
+                zeroSamples.push_back(pos);
+            numZeros++;
+        }
+
+    for (uint64_t first = 0; first < numEntries; first += NODE_INDEX_GROUP_SIZE)
+    {
+        uint64_t last = std::min(first + NODE_INDEX_GROUP_SIZE, numEntries);
+        uint64_t minPos = data[first].chunkPos, maxPos = data[first].chunkPos;
+        for (uint64_t i = first; i < last; i++)
+        {
+            minPos = std::min(minPos, data[i].chunkPos);
+            maxPos = std::max(maxPos, data[i].chunkPos);
+        }
+
+        uint64_t width = getBitWidth(maxPos - minPos);
+        MUST( numPackedBits < (1ull << 56), "node index too big");
+        groups.push_back( minPos);
+        groups.push_back( numPackedBits | (width << 56));
+        for (uint64_t i = first; i < last; i++)
+            appendBits( packedPositions, numPackedBits, data[i].chunkPos - minPos, width);
+    }
+
+    // so that there is always a word to read (even for empty indices)
+    for (std::vector<uint64_t> *section : {&lower, &packedPositions})
+        section->push_back(0);
+
+    FILE* f = fopen( fileName.c_str(), "wb");
+    MUST( f, "cannot create node index");
+    MUST( fwrite( &header, sizeof(header), 1, f) == 1, "write error");  //placeholder
+    uint64_t offset = sizeof(header);
+    uint64_t* offsets[] = { &header.lowerOffset, &header.upperOffset, &header.zeroSamplesOffset, 
+                            &header.groupsOffset, &header.packedPositionsOffset};
+    std::vector<uint64_t>* sections[] = {&lower, &upper, &zeroSamples, &groups, &packedPositions};
+    for (uint64_t i = 0; i < 5; i++)
+    {
+        *offsets[i] = offset;
+        MUST( sections[i]->empty() || 
+              fwrite( sections[i]->data(), sections[i]->size() * sizeof(uint64_t), 1, f) == 1, "write error");
+        offset += sections[i]->size() * sizeof(uint64_t);
+    }
+
+    // memory maps need a multiple of the page size
+    static const uint8_t padding[4096] = {0};
+    if (offset % sizeof(padding))
+        MUST( fwrite( padding, sizeof(padding) - offset % sizeof(padding), 1, f) == 1, "write error");
+
+    rewind(f);
+    MUST( fwrite( &header, sizeof(header), 1, f) == 1, "write error");
+    fclose(f);
+
+    delete entries;
+    entries = nullptr;
+    MUST( unlink( (fileName + ".tmp").c_str()) == 0, "cannot delete temporary node index");
+}
+
+// ==========================================
+
+TaggedNodeIndex::TaggedNodeIndex(const std::string &fileName)
+{
+    map = init_mmap( fileName.c_str(), true, false);
+    MUST( map.size >= sizeof(TaggedNodeIndexHeader), "truncated node index");
+    const TaggedNodeIndexHeader *header = (const TaggedNodeIndexHeader*)map.ptr;
+    MUST( memcmp( header->magic, NODE_INDEX_MAGIC, sizeof(NODE_INDEX_MAGIC)) == 0 && 
+          header->version == NODE_INDEX_VERSION, "invalid node index");
+    MUST( header->packedPositionsOffset < map.size, "truncated node index");
+
+    const uint8_t *base = (const uint8_t*)map.ptr;
+    numEntries      = header->numEntries;
+    universe        = header->universe;
+    lowBits         = header->lowBits;
+    lower           = (const uint64_t*)(base + header->lowerOffset);
+    upper           = (const uint64_t*)(base + header->upperOffset);
+    zeroSamples     = (const uint64_t*)(base + header->zeroSamplesOffset);
+    groups          = (const uint64_t*)(base + header->groupsOffset);
+    packedPositions = (const uint64_t*)(base + header->packedPositionsOffset);
+}
+
+TaggedNodeIndex::~TaggedNodeIndex()
+{
+    free_mmap(&map);
+}
+
+bool TaggedNodeIndex::find(uint64_t nodeId, uint64_t &chunkPosOut) const
+{
+    if (nodeId >= universe)
+        return false;
+
+    /* the ids whose upper bits are 'high' are the ones between the (high-1)th and the
+     * (high)th zero of the upper bit vector, and sorted by their lower bits */
+    uint64_t high = nodeId >> lowBits;
+    uint64_t low  = nodeId & ((1ull << lowBits) - 1);
+    uint64_t pos  = (high == 0) ? 0 : selectZero(high - 1) + 1;
+    for (uint64_t index = pos - high; upper[pos / 64] & (1ull << (pos % 64)); pos++, index++)
+    {
+        uint64_t entryLow = getLowBits(index);
+        if (entryLow == low)
+        {
+            chunkPosOut = getChunkPosition(index);
+            return true;
+        }
+
+        if (entryLow > low)
+            break;
+    }
+
+    return false;
+}
+
+uint64_t TaggedNodeIndex::getLowBits(uint64_t index) const
+{
+    return getBits( lower, index * lowBits, lowBits);
+}
+
+uint64_t TaggedNodeIndex::getChunkPosition(uint64_t index) const
+{
+    const uint64_t *group = groups + 2 * (index / NODE_INDEX_GROUP_SIZE);
+    uint32_t width  = group[1] >> 56;
+    uint64_t bitPos = (group[1] & 0x00FFFFFFFFFFFFFFull) + (index % NODE_INDEX_GROUP_SIZE) * width;
+    return group[0] + getBits( packedPositions, bitPos, width);
+}
+
+// returns the position of the k-th (counting from zero) zero of the upper bit vector
+uint64_t TaggedNodeIndex::selectZero(uint64_t k) const
+{
+    uint64_t pos = zeroSamples[ k / NODE_INDEX_SELECT_SAMPLE];
+    uint64_t remaining = k % NODE_INDEX_SELECT_SAMPLE;  //zeros to skip after 'pos'
+    uint64_t word = pos / 64;
+    uint64_t zeros = ~upper[word] & (~0ull << (pos % 64));
+    for (uint64_t numZeros; (numZeros = __builtin_popcountll(zeros)) <= remaining; )
+    {
+        remaining -= numZeros;
+        zeros = ~upper[++word];
+    }
+
+    for (; remaining; remaining--)
+        zeros &= zeros - 1; //clear lowest set bit
+
+    return word * 64 + __builtin_ctzll(zeros);
+}
+
+// returns the position of the first one at or after 'pos' in the upper bit vector
+uint64_t TaggedNodeIndex::nextOne(uint64_t pos) const
+{
+    uint64_t word = pos / 64;
+    uint64_t ones = upper[word] & (~0ull << (pos % 64));
+    while (!ones)
+        ones = upper[++word];
+
+    return word * 64 + __builtin_ctzll(ones);
+}
+
+// ==========================================
+
+// 'index' has to be either 0 or host.size()
+TaggedNodeIndex::Iterator::Iterator(const TaggedNodeIndex &host, uint64_t index):
+    host(host), index(index), upperPos(0)
+{
+    if (index < host.numEntries)
+        upperPos = host.nextOne(0);
+}
+
+TaggedNodeIndex::Iterator& TaggedNodeIndex::Iterator::operator++()
+{
+    if (++index < host.numEntries)
+        upperPos = host.nextOne(upperPos + 1);
+    return *this;
+}
+
+uint64_t TaggedNodeIndex::Iterator::getNodeId() const
+{
+    return ((upperPos - index) << host.lowBits) | host.getLowBits(index);
+}
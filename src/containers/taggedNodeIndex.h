@@ -0,0 +1,90 @@
+#ifndef TAGGED_NODE_INDEX_H
+#define TAGGED_NODE_INDEX_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "containers/persistentVector.h"
+#include "misc/mem_map.h"
+
+/* The class TaggedNodeIndex ('nodes.idx') maps the ids of the nodes stored in nodes.data (i.e.
+ * of the tagged nodes; the vertices of all nodes are in the VertexStore) to the positions of 
+ * their chunks. Most nodes are untagged, so instead of an array indexed by node id, it stores
+ *   - the sorted ids of the tagged nodes as an Elias-Fano sequence: the lowest 'lowBits' bits of
+ *     each id are bit-packed, and the rest is stored in unary (the 'upper' bit vector has a one 
+ *     for each id, and a zero wherever that rest increases by one). The position of every
+ *     NODE_INDEX_SELECT_SAMPLE-th zero is sampled, so that a lookup only has to scan a few 
+ *     words of the upper bit vector.
+ *   - the chunk positions, in groups of NODE_INDEX_GROUP_SIZE, each group as the smallest 
+ *     position of the group and the bit-packed differences to it.
+ * For the planet, this takes about 10 bits per tagged node instead of 8 bytes per node id.
+ *
+ * The index is created by a TaggedNodeIndex::Builder, which collects the entries (in any id
+ * order) in a temporary file while the nodes are imported, and writes the index at the end.
+ */
+class TaggedNodeIndex
+{
+public:
+    class Builder
+    {
+    public:
+        Builder(const std::string &fileName);
+        ~Builder();  //calls finish()
+        // if the same id is added more than once, the last entry wins
+        void add(uint64_t nodeId, uint64_t chunkPos);
+        // sorts the entries, and writes the index
+        void finish();
+
+    private:
+        struct Entry { uint64_t nodeId; uint64_t chunkPos; };
+
+        std::string fileName;
+        PersistentVector<Entry> *entries;
+        bool isSorted;
+        uint64_t lastNodeId;
+    };
+
+    class Iterator 
+    {
+    public:
+        Iterator(const TaggedNodeIndex &host, uint64_t index);
+        Iterator& operator++();
+        bool operator!=(const Iterator &other) const { return index != other.index; }
+        uint64_t getNodeId() const;
+        uint64_t getChunkPosition() const { return host.getChunkPosition(index); }
+    private:
+        const TaggedNodeIndex &host;
+        uint64_t index;     //number of the entry in the index
+        uint64_t upperPos;  //position of the entry's one in the upper bit vector
+    };
+
+    TaggedNodeIndex(const std::string &fileName);
+    TaggedNodeIndex(const TaggedNodeIndex &other) = delete;
+    ~TaggedNodeIndex();
+
+    // returns false if the node is not in the index
+    bool find(uint64_t nodeId, uint64_t &chunkPosOut) const;
+    uint64_t size() const { return numEntries; }
+    // an upper bound for all node ids in the index
+    uint64_t getMaxNumNodes() const { return universe; }
+
+    Iterator begin() const { return Iterator(*this, 0); }
+    Iterator end()   const { return Iterator(*this, numEntries); }
+
+private:
+    uint64_t getChunkPosition(uint64_t index) const;
+    uint64_t getLowBits(uint64_t index) const;
+    uint64_t selectZero(uint64_t k) const;
+    uint64_t nextOne(uint64_t pos) const;
+
+private:
+    mmap_t   map;
+    uint64_t numEntries, universe;
+    uint32_t lowBits;
+    const uint64_t *lower, *upper, *zeroSamples, *groups, *packedPositions;
+};
+
+#endif
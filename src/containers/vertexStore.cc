@@ -0,0 +1,244 @@
+
+#include <fcntl.h>
+#include <string.h> //for memcmp()
+#include <unistd.h> //for lseek(), unlink()
+
+#include <algorithm>
+#include <iostream>
+
+#include "containers/vertexStore.h"
+#include "misc/varInt.h"
+
+static const char     VERTEX_BLOCKS_MAGIC[8] = {'C', 'O', 'O', 'R', 'D', 'S', 'V', 'B'};
+static const uint32_t VERTEX_BLOCKS_VERSION  = 1;
+static const uint64_t BITMAP_SIZE            = VERTEX_BLOCK_SIZE / 8;
+
+struct VertexBlocksHeader {
+    char     magic[8];
+    uint32_t version;
+    uint32_t format;
+    uint64_t numVertices;
+    uint64_t blockSize;
+    uint64_t tableOffset;
+    uint64_t numTableEntries;
+};
+
+static std::string getPath(const std::string &storageDirectory, const char* fileName)
+{
+    std::string path = storageDirectory;
+    if (path.length() && path.back() != '/' && path.back() != '\\')
+        path += "/";
+    return path + fileName;
+}
+
+VertexStore::VertexStore(const std::string &storageDirectory): 
+    table(nullptr), numTableEntries(0)
+{
+    std::string blocksPath = getPath(storageDirectory, VERTEX_BLOCKS_FILE_NAME);
+    if (access( blocksPath.c_str(), F_OK) != 0)
+    {
+        // read at random (within the id range of a bucket), so huge pages save TLB misses
+        format = DENSE;
+        map = init_mmap( getPath(storageDirectory, VERTICES_FILE_NAME).c_str(), true, false, false, MMAP_HUGE_PAGES);
+        MUST(map.size % (2*sizeof(int32_t)) == 0, "vertex storage corruption");
+        numVertices = map.size / (2*sizeof(int32_t));
+        return;
+    }
+
+    map = init_mmap( blocksPath.c_str(), true, false);
+    MUST( map.size >= sizeof(VertexBlocksHeader), "truncated vertex block file");
+    const VertexBlocksHeader *header = (const VertexBlocksHeader*)map.ptr;
+    MUST( memcmp( header->magic, VERTEX_BLOCKS_MAGIC, sizeof(VERTEX_BLOCKS_MAGIC)) == 0 &&
+          header->version == VERTEX_BLOCKS_VERSION && header->blockSize == VERTEX_BLOCK_SIZE &&
+          (header->format == BLOCKS || header->format == SPARSE_BLOCKS), "invalid vertex block file");
+
+    uint64_t entrySize = (header->format == BLOCKS ? 1 : 2) * sizeof(uint64_t);
+    MUST( header->tableOffset + header->numTableEntries * entrySize <= map.size, "truncated vertex block file");
+    format          = (Format)header->format;
+    numVertices     = header->numVertices;
+    table           = (const uint64_t*)((const uint8_t*)map.ptr + header->tableOffset);
+    numTableEntries = header->numTableEntries;
+
+    CachedBlock unused;
+    unused.blockId = UINT64_MAX;
+    cache.resize( VERTEX_BLOCK_CACHE_SIZE, unused);
+}
+
+VertexStore::~VertexStore()
+{
+    free_mmap(&map);
+}
+
+const int32_t* VertexStore::getBlock(uint64_t blockId)
+{
+    CachedBlock &entry = cache[ blockId % VERTEX_BLOCK_CACHE_SIZE];
+    if (entry.blockId != blockId)
+    {
+        decodeBlock( blockId, entry.vertices);
+        entry.blockId = blockId;
+    }
+    return entry.vertices;
+}
+
+void VertexStore::decodeBlock(uint64_t blockId, int32_t *verticesOut) const
+{
+    memset( verticesOut, 0, 2 * VERTEX_BLOCK_SIZE * sizeof(int32_t));
+
+    uint64_t begin, end;
+    if (format == BLOCKS)
+    {
+        MUST( blockId + 1 < numTableEntries, "vertex block out of range");
+        begin = table[blockId];
+        end   = table[blockId + 1];
+    } else
+    {
+        // binary search over the (block number, offset) pairs, without the final entry
+        uint64_t lo = 0;
+        uint64_t hi = numTableEntries - 1;
+        while (lo < hi)
+        {
+            uint64_t mid = (lo + hi) / 2;
+            if (table[2 * mid] < blockId)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == numTableEntries - 1 || table[2 * lo] != blockId)
+            return; //empty block
+
+        begin = table[2 * lo + 1];
+        end   = table[2 * lo + 3];
+    }
+
+    if (begin == end)
+        return;
+
+    const uint8_t *bitmap = (const uint8_t*)map.ptr + begin;
+    const uint8_t *pos = bitmap + BITMAP_SIZE;
+    int32_t lat = 0, lng = 0;
+    for (uint64_t i = 0; i < VERTEX_BLOCK_SIZE; i++)
+    {
+        if (! (bitmap[i / 8] & (1 << (i % 8))))
+            continue;
+
+        int nRead;
+        lat += varIntFromBytes(pos, &nRead);
+        pos += nRead;
+        lng += varIntFromBytes(pos, &nRead);
+        pos += nRead;
+        verticesOut[2 * i]     = lat;
+        verticesOut[2 * i + 1] = lng;
+    }
+    MUST( pos == (const uint8_t*)map.ptr + end, "vertex block corruption");
+}
+
+/* encodes the 'numVertices' vertices starting at 'vertices' (at most VERTEX_BLOCK_SIZE) into 
+ * 'out'. Returns the size of the encoded block, which is 0 if all vertices are at (0, 0) */
+uint64_t VertexStore::encodeBlock(const int32_t *vertices, uint64_t numVertices, uint8_t *out)
+{
+    memset( out, 0, BITMAP_SIZE);
+    uint8_t *pos = out + BITMAP_SIZE;
+    int32_t lat = 0, lng = 0;
+    for (uint64_t i = 0; i < numVertices; i++)
+    {
+        if (vertices[2 * i] == 0 && vertices[2 * i + 1] == 0)
+            continue;
+
+        out[i / 8] |= (1 << (i % 8));
+        pos += varIntToBytes( (int64_t)vertices[2 * i]     - lat, pos);
+        pos += varIntToBytes( (int64_t)vertices[2 * i + 1] - lng, pos);
+        lat = vertices[2 * i];
+        lng = vertices[2 * i + 1];
+    }
+
+    return (pos == out + BITMAP_SIZE) ? 0 : pos - out;
+}
+
+void VertexStore::compress(const std::string &storageDirectory, Format format)
+{
+    MUST( format == BLOCKS || format == SPARSE_BLOCKS, "invalid vertex format");
+    std::string densePath = getPath(storageDirectory, VERTICES_FILE_NAME);
+    mmap_t dense = init_mmap( densePath.c_str(), true, false);
+    MUST(dense.size % (2*sizeof(int32_t)) == 0, "vertex storage corruption");
+    const int32_t *vertices = (const int32_t*)dense.ptr;
+    
+    VertexBlocksHeader header;
+    memcpy( header.magic, VERTEX_BLOCKS_MAGIC, sizeof(VERTEX_BLOCKS_MAGIC));
+    header.version     = VERTEX_BLOCKS_VERSION;
+    header.format      = format;
+    header.numVertices = dense.size / (2*sizeof(int32_t));
+    header.blockSize   = VERTEX_BLOCK_SIZE;
+
+    FILE* f = fopen( getPath(storageDirectory, VERTEX_BLOCKS_FILE_NAME).c_str(), "wb");
+    MUST( f, "cannot create vertex block file");
+    MUST( fwrite( &header, sizeof(header), 1, f) == 1, "write error");  //placeholder
+
+    std::vector<uint64_t> table;
+    uint8_t block[BITMAP_SIZE + 2 * 10 * VERTEX_BLOCK_SIZE];
+    uint64_t offset = sizeof(header);
+    uint64_t numBlocks = (header.numVertices + VERTEX_BLOCK_SIZE - 1) / VERTEX_BLOCK_SIZE;
+    for (uint64_t blockId = 0; blockId < numBlocks; blockId++)
+    {
+        uint64_t firstId = blockId * VERTEX_BLOCK_SIZE;
+        uint64_t size = encodeBlock( vertices + 2 * firstId, 
+            std::min(VERTEX_BLOCK_SIZE, header.numVertices - firstId), block);
+
+        if (format == BLOCKS)
+            table.push_back(offset);
+        else if (size > 0)
+        {
+            table.push_back(blockId);
+            table.push_back(offset);
+        }
+
+        if (size > 0)
+        {
+            MUST( fwrite( block, size, 1, f) == 1, "write error");
+            offset += size;
+            continue;
+        }
+
+        /* Empty blocks are usually part of a hole in the (sparse) file. So skip to the next
+         * part of the file that contains data, without reading the hole. */
+        off_t nextData = lseek( dense.fd, (firstId + VERTEX_BLOCK_SIZE) * 2 * sizeof(int32_t), SEEK_DATA);
+        uint64_t nextBlockId = (nextData < 0) ? numBlocks : 
+                               nextData / (2 * sizeof(int32_t) * VERTEX_BLOCK_SIZE);
+        for (; format == BLOCKS && blockId + 1 < nextBlockId; blockId++)
+            table.push_back(offset);
+
+        blockId = std::max(blockId, nextBlockId - 1);
+    }
+
+    // the final entry, which marks the end of the last block
+    if (format == SPARSE_BLOCKS)
+        table.push_back(UINT64_MAX);
+    table.push_back(offset);
+
+    static const uint8_t padding[4096] = {0};
+    uint64_t tableOffset = (offset + 7) / 8 * 8;
+    MUST( tableOffset == offset || fwrite( padding, tableOffset - offset, 1, f) == 1, "write error");
+    MUST( fwrite( table.data(), table.size() * sizeof(uint64_t), 1, f) == 1, "write error");
+    // memory maps need a multiple of the page size
+    uint64_t fileSize = tableOffset + table.size() * sizeof(uint64_t);
+    if (fileSize % sizeof(padding))
+        MUST( fwrite( padding, sizeof(padding) - fileSize % sizeof(padding), 1, f) == 1, "write error");
+
+    header.tableOffset     = tableOffset;
+    header.numTableEntries = (format == BLOCKS) ? table.size() : table.size() / 2;
+    rewind(f);
+    MUST( fwrite( &header, sizeof(header), 1, f) == 1, "write error");
+    fclose(f);
+
+    free_mmap(&dense);
+    MUST( unlink( densePath.c_str()) == 0, "cannot delete dense vertex file");
+}
+
+bool VertexStore::parseFormat(const std::string &name, Format &formatOut)
+{
+    if      (name == "dense")  formatOut = DENSE;
+    else if (name == "blocks") formatOut = BLOCKS;
+    else if (name == "sparse") formatOut = SPARSE_BLOCKS;
+    else return false;
+
+    return true;
+}
@@ -0,0 +1,90 @@
+#ifndef VERTEX_STORE_H
+#define VERTEX_STORE_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "misc/mem_map.h"
+
+/* The class VertexStore gives read access to the vertices (lat/lng) of all nodes by node id,
+ * in each of the formats that coordsCreateStorage can store them in:
+ * - DENSE ('vertices.data'): an int32_t[2] array indexed by node id. This is what the
+ *   import itself writes (since nodes may come in any order, and from several threads).
+ * - BLOCKS ('vertices.blocks'): the ids are split into blocks of VERTEX_BLOCK_SIZE
+ *   consecutive ids. Each block consists of a bitmap of the ids stored in it, followed by the
+ *   coordinates of these ids, each as the (varInt) difference to the previous vertex of the 
+ *   block. A table of the file offsets of all blocks allows decoding single blocks.
+ * - SPARSE_BLOCKS ('vertices.blocks'): the same, but the table only holds the non-empty blocks
+ *   (with their block numbers), and is binary-searched. Meant for regional extracts, whose node
+ *   ids are scattered over the whole id range, so that most blocks are empty.
+ *
+ * In all formats, nodes that do not exist (but whose ids are smaller than getNumVertices())
+ * are at (0, 0). The compressed formats simply do not store vertices at (0, 0), so compressing
+ * the vertices does not change the result of any lookup.
+ * get() caches the most recently decoded blocks. So a VertexStore must not be shared between
+ * threads (but each thread may open its own one).
+ *
+ * File layout of 'vertices.blocks': the header (see vertexStore.cc), the blocks, and the block
+ * table (uint64_t offsets for BLOCKS, (block number, offset) pairs for SPARSE_BLOCKS). The table
+ * ends with an additional entry for the end of the last block.
+ */
+class VertexStore
+{
+public:
+    enum Format { DENSE, BLOCKS, SPARSE_BLOCKS };
+
+    // opens the vertices in 'storageDirectory', in whichever format they are stored
+    VertexStore(const std::string &storageDirectory);
+    VertexStore(const VertexStore &other) = delete;
+    ~VertexStore();
+
+    // returns false if 'nodeId' is beyond the range of stored ids
+    bool get(uint64_t nodeId, int32_t &latOut, int32_t &lngOut);
+    uint64_t getNumVertices() const { return numVertices; }
+    Format getFormat() const { return format; }
+
+    // replaces the DENSE vertices in 'storageDirectory' by vertices in 'format'
+    static void compress(const std::string &storageDirectory, Format format);
+    // parses a format name ("dense", "blocks", "sparse"). Returns false for invalid names
+    static bool parseFormat(const std::string &name, Format &formatOut);
+
+private:
+    const int32_t* getBlock(uint64_t blockId);
+    void decodeBlock(uint64_t blockId, int32_t *verticesOut) const;
+    static uint64_t encodeBlock(const int32_t *vertices, uint64_t numVertices, uint8_t *out);
+
+    struct CachedBlock {
+        uint64_t blockId;   //UINT64_MAX for unused cache entries
+        int32_t  vertices[2 * VERTEX_BLOCK_SIZE];
+    };
+
+private:
+    Format   format;
+    mmap_t   map;
+    uint64_t numVertices;
+    const uint64_t *table;      //block table (compressed formats only)
+    uint64_t numTableEntries;   //including the final entry
+    std::vector<CachedBlock> cache;
+};
+
+static const char* const VERTICES_FILE_NAME      = "vertices.data";
+static const char* const VERTEX_BLOCKS_FILE_NAME = "vertices.blocks";
+
+inline bool VertexStore::get(uint64_t nodeId, int32_t &latOut, int32_t &lngOut)
+{
+    if (nodeId >= numVertices)
+        return false;
+
+    const int32_t *vertex = (format == DENSE) ? 
+        (const int32_t*)map.ptr + 2 * nodeId :
+        getBlock(nodeId / VERTEX_BLOCK_SIZE) + 2 * (nodeId % VERTEX_BLOCK_SIZE);
+
+    latOut = vertex[0];
+    lngOut = vertex[1];
+    return true;
+}
+
+#endif
@@ -5,17 +5,32 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <google/protobuf/stubs/common.h>   //for ShutdownProtobufLibrary()
+#include <algorithm>
 #include <iostream>
 
 #include "consumers/osmConsumerCounter.h"
 #include "consumers/osmConsumerDumper.h"
 #include "consumers/osmConsumerIdRemapper.h"
+#include "consumers/osmConsumerNameCounter.h"
+#include "consumers/osmConsumerShardedDumper.h"
+#include "containers/vertexStore.h"
 #include "misc/cleanup.h"
+#include "misc/symbolicNames.h"
+#include "misc/tagSetTable.h"
 #include "osm/osmParserPbf.h"
 //#include "osm/osmParserXml.h"
 
 bool remapIds = 0;
+/* resolve the node locations of ways during the import, and write the final ways.data (instead
+ * of leaving that to coordsResolveStorage) */
+bool resolveWayLocations = false;
 std::string destinationDirectory;
+/* number of threads that inflate and decode PBF blobs, and that serialize the decoded entities.
+ * '1' parses and serializes on the main thread only */
+uint32_t numParserThreads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+/* the format of the stored vertices (see VertexStore). The import always writes them DENSE,
+ * and compresses them afterwards if requested */
+VertexStore::Format vertexFormat = VertexStore::DENSE;
 
 int parseArguments(int argc, char** argv)
 {
@@ -23,17 +38,36 @@ int parseArguments(int argc, char** argv)
     {
         {"remap", no_argument,       NULL, 'r'},
         {"dest",  required_argument, NULL, 'd'},
+        {"resolve-locations", no_argument, NULL, 'l'},
+        {"threads", required_argument, NULL, 't'},
+        {"vertices", required_argument, NULL, 'v'},
         {0,0,0,0}
     };
 
     int opt_idx = 0;
     int opt;
-    while (-1 != (opt = getopt_long(argc, argv, "rd:", long_options, &opt_idx)))
+    while (-1 != (opt = getopt_long(argc, argv, "rd:lt:v:", long_options, &opt_idx)))
     {
         switch(opt) {
             case '?': exit(EXIT_FAILURE); break; //unknown option; getopt_long() already printed an error message
             case 'r': remapIds = true; break;
             case 'd': destinationDirectory = optarg; break;
+            case 'l': resolveWayLocations = true; break;
+            case 't': 
+                numParserThreads = atoi(optarg);
+                if (numParserThreads < 1)
+                {
+                    std::cerr << "error: invalid number of threads '" << optarg << "'" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'v':
+                if (!VertexStore::parseFormat(optarg, vertexFormat))
+                {
+                    std::cerr << "error: invalid vertex format '" << optarg << "' (valid: dense, blocks, sparse)" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
             default: abort(); break;
         }
     }
@@ -64,15 +98,22 @@ void cleanupDestination(const std::string &storageDirectory)
     deleteIfExists(storageDirectory, "nodes.data");
     deleteIfExists(storageDirectory, "nodes.data.free");
     deleteIfExists(storageDirectory, "nodes.idx");
+    deleteIfExists(storageDirectory, "nodes.idx.tmp");
     deleteIfExists(storageDirectory, "ways.data");
     deleteIfExists(storageDirectory, "ways.data.free");
     deleteIfExists(storageDirectory, "ways.idx");
+    deleteIfExists(storageDirectory, WAYS_RESOLVED_FILE_NAME);
     deleteIfExists(storageDirectory, "relations.data");
     deleteIfExists(storageDirectory, "relations.data.free");
     deleteIfExists(storageDirectory, "relations.idx");
 
-    // raw vertex data
-    deleteIfExists(storageDirectory, "vertices.data");
+    // raw and compressed vertex data
+    deleteIfExists(storageDirectory, VERTICES_FILE_NAME);
+    deleteIfExists(storageDirectory, VERTEX_BLOCKS_FILE_NAME);
+
+    // symbolic names of all tags, and tag sets shared by several entities
+    deleteIfExists(storageDirectory, SYMBOLIC_NAMES_FILE_NAME);
+    deleteIfExists(storageDirectory, TAG_SETS_FILE_NAME);
  
     // bucket files
     deleteNumberedFiles(storageDirectory, "nodeRefs", ".raw");
@@ -82,10 +123,40 @@ void cleanupDestination(const std::string &storageDirectory)
 }
 
 
+/* ranks the tag names found in a sample of the blobs of 'f' (evenly spread over the file, 
+ * so that it contains nodes, ways and relations alike), stores the most frequent ones as the
+ * dataset's SymbolicNameTable, and makes RawTags use that table */
+void createSymbolicNames(FILE* f, const std::string &storageDirectory)
+{
+    OsmConsumerNameCounter counter;
+    OsmParserPbf parser(f, &counter, numParserThreads);
+
+    std::vector<PbfBlobInfo> dataBlobs;
+    for (const PbfBlobInfo &blob : parser.listBlobs())
+        if (! (blob.flags & PbfBlobInfo::IS_HEADER_BLOB))
+            dataBlobs.push_back(blob);
+
+    uint64_t stride = std::max<uint64_t>(1, dataBlobs.size() / SYMBOLIC_NAME_SAMPLE_BLOBS);
+    std::vector<PbfBlobInfo> sample;
+    for (uint64_t i = 0; i < dataBlobs.size(); i += stride)
+        sample.push_back( dataBlobs[i]);
+
+    std::cout << "ranking tag names in " << sample.size() << " of " << dataBlobs.size() 
+              << " blobs" << std::endl;
+    parser.restrictTo(sample);
+    parser.parse();
+
+    SymbolicNameTable *table = new SymbolicNameTable( 
+        counter.getRankedNames(MAX_SYMBOLIC_NAMES, SYMBOLIC_NAME_MIN_COUNT));
+    table->store(storageDirectory + SYMBOLIC_NAMES_FILE_NAME);
+    useSymbolicNames(table);
+    std::cout << "using " << table->size() << " symbolic names" << std::endl;
+}
+
 int main(int argc, char** argv)
 {
     int nextArgumentIndex = parseArguments(argc, argv);
-    std::string usageLine = std::string("usage: ") + argv[0] + " [-r|--remap] --dest <destination directory> <inputfile.pbf>";
+    std::string usageLine = std::string("usage: ") + argv[0] + " [-r|--remap] [-l|--resolve-locations] [-t|--threads <n>] [-v|--vertices dense|blocks|sparse] --dest <destination directory> <inputfile.pbf>";
     if (nextArgumentIndex == argc)
     {
         std::cerr << "error: missing input file argument" << std::endl;
@@ -135,11 +206,14 @@ int main(int argc, char** argv)
         std::cerr << "error: cannot open file '" << argv[nextArgumentIndex] << "'" << std::endl;
         exit(EXIT_FAILURE);
     }
+    createSymbolicNames(f, destinationDirectory);
     posix_fadvise( fileno(f), 0, 0, POSIX_FADV_SEQUENTIAL);
-    OsmBaseConsumer *dumper = new OsmConsumerDumper(destinationDirectory);
+    OsmBaseConsumer *dumper = numParserThreads > 1 ? 
+        new OsmConsumerShardedDumper(destinationDirectory, numParserThreads, resolveWayLocations) :
+        new OsmConsumerDumper(destinationDirectory, resolveWayLocations);
     OsmBaseConsumer* firstConsumer = remapIds ? 
         new OsmConsumerIdRemapper(destinationDirectory, dumper) : dumper;
-    OsmParserPbf parser(f, firstConsumer);
+    OsmParserPbf parser(f, firstConsumer, numParserThreads);
     parser.parse();
     
     fclose(f);
@@ -148,5 +222,20 @@ int main(int argc, char** argv)
     if (firstConsumer != dumper)
         delete firstConsumer;
 
+    if (resolveWayLocations)
+    {
+        /* only created after the import completed, so that an aborted import is never
+         * mistaken for a resolved one */
+        FILE* marker = fopen( (destinationDirectory + WAYS_RESOLVED_FILE_NAME).c_str(), "wb");
+        MUST( marker, "cannot create marker file for resolved ways");
+        fclose(marker);
+    }
+
+    if (vertexFormat != VertexStore::DENSE)
+    {
+        std::cout << "compressing vertices" << std::endl;
+        VertexStore::compress(destinationDirectory, vertexFormat);
+    }
+
     google::protobuf::ShutdownProtobufLibrary();
 }
@@ -18,6 +18,7 @@
 
 #include "config.h"
 #include "containers/bucketFileSet.h"
+#include "containers/bucketPrefetcher.h"
 #include "containers/osmRelationStore.h"
 
 #include "geom/ringSegment.h"
@@ -463,19 +464,15 @@ std::vector<uint64_t> buildMultipolygonGeometry(const std::string &storageDirect
     const RelationStore relStore(storageDirectory + "relations");
     BucketFileSet<int> relationWaysBuckets(storageDirectory + "referencedWays",  WAYS_OF_RELATIONS_BUCKET_SIZE, true);
 
-    //for (uint64_t bucketId = 0; bucketId == 0; bucketId++)
-    for (uint64_t bucketId = 0; bucketId < relationWaysBuckets.getNumBuckets(); bucketId++)
+    //the next bucket is read while the relations of the current one are processed
+    BucketPrefetcher<int, std::vector<uint8_t> > prefetcher(relationWaysBuckets);
+    std::vector<uint8_t> waysBytes;
+    uint64_t bucketId;
+    while (prefetcher.next(bucketId, waysBytes))
     {
         std::cout << "reading way bucket " << (bucketId+1) << "/" << relationWaysBuckets.getNumBuckets() << std::endl;
-        FILE* f = relationWaysBuckets.getFile(bucketId* WAYS_OF_RELATIONS_BUCKET_SIZE);
-        MUST(f != nullptr, "cannot open bucket file");
-        fseek(f, 0, SEEK_END);
-        uint64_t numBytes = ftell(f);
-        uint8_t *waysBytes = new uint8_t[numBytes];
-        rewind(f);
-        MUST( fread( waysBytes, numBytes, 1, f) == 1, "read error");
-        const uint8_t *waysPos = waysBytes;
-        const uint8_t *waysBeyond = waysBytes + numBytes;
+        const uint8_t *waysPos = waysBytes.data();
+        const uint8_t *waysBeyond = waysBytes.data() + waysBytes.size();
         
         map<uint64_t, OsmWay> ways;
         
@@ -485,8 +482,6 @@ std::vector<uint64_t> buildMultipolygonGeometry(const std::string &storageDirect
             ways.insert( make_pair(way.id, way));
         }
         MUST( waysPos == waysBeyond, "way bucket read overflow")
-        
-        delete [] waysBytes;
 
         //for( uint64_t relId = 37436; relId == 37436; relId++)
 
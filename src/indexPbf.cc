@@ -0,0 +1,172 @@
+
+/* coordsIndexPbf: creates (or refreshes) the cached blob index of a PBF file (see PbfBlobIndex),
+ * and prints which parts of the file contain which kinds of entities. With '--nodes', '--ways'
+ * and/or '--relations', and/or with '--part', it then parses only the selected blobs (skipping
+ * the rest of the file), counts their entities, and checks the counts against the index.
+ * '--part <i>/<n>' selects the i-th of n equal byte ranges of the file, so that n processes
+ * can each parse a different part.
+ */
+
+#include <getopt.h>     //for getopt_long()
+#include <stdio.h>
+#include <stdlib.h>     //for strtoul()
+
+#include <google/protobuf/stubs/common.h>   //for ShutdownProtobufLibrary()
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "consumers/osmConsumerCounter.h"
+#include "osm/osmParserPbf.h"
+#include "osm/pbfBlobIndex.h"
+
+uint32_t numThreads = 1;
+uint8_t  entityFilter = 0;   //combination of OsmParserPbf::ENTITY_FILTER flags, '0' for all
+uint32_t partIndex = 0;
+uint32_t numParts = 0;      //'0': no '--part' given
+
+int parseArguments(int argc, char** argv)
+{
+    static const struct option long_options[] =
+    {
+        {"threads",   required_argument, NULL, 't'},
+        {"nodes",     no_argument,       NULL, 'n'},
+        {"ways",      no_argument,       NULL, 'w'},
+        {"relations", no_argument,       NULL, 'r'},
+        {"part",      required_argument, NULL, 'p'},
+        {0,0,0,0}
+    };
+
+    int opt_idx = 0;
+    int opt;
+    while (-1 != (opt = getopt_long(argc, argv, "t:nwrp:", long_options, &opt_idx)))
+    {
+        switch(opt) {
+            case '?': exit(EXIT_FAILURE); break; //unknown option; getopt_long() already printed an error message
+            case 't':
+                numThreads = strtoul(optarg, nullptr, 10);
+                if (numThreads == 0)
+                {
+                    std::cerr << "error: invalid number of threads '" << optarg << "'" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'n': entityFilter |= OsmParserPbf::PARSE_NODES;     break;
+            case 'w': entityFilter |= OsmParserPbf::PARSE_WAYS;      break;
+            case 'r': entityFilter |= OsmParserPbf::PARSE_RELATIONS; break;
+            case 'p':
+                if (sscanf(optarg, "%u/%u", &partIndex, &numParts) != 2 || partIndex >= numParts)
+                {
+                    std::cerr << "error: invalid part '" << optarg << "' (expected <i>/<n> with i < n)" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            default: abort(); break;
+        }
+    }
+    return optind;
+}
+
+// the sum of the entity counts of 'blobs', as {nodes, ways, relations}
+std::vector<uint64_t> countEntities(const std::vector<PbfBlobInfo> &blobs)
+{
+    std::vector<uint64_t> res(3, 0);
+    for (const PbfBlobInfo &blob : blobs)
+    {
+        res[0] += blob.numNodes;
+        res[1] += blob.numWays;
+        res[2] += blob.numRelations;
+    }
+    return res;
+}
+
+/* prints the byte range from the first to the last blob that contains 'what', as
+ * well as how much of the file the blobs in that range add up to */
+void printSection(const std::vector<PbfBlobInfo> &blobs, const char* what, uint64_t numEntities)
+{
+    if (blobs.empty())
+    {
+        std::cout << "  no " << what << std::endl;
+        return;
+    }
+
+    uint64_t numBytes = 0;
+    for (const PbfBlobInfo &blob : blobs)
+        numBytes += blob.size;
+
+    std::cout << "  " << numEntities << " " << what << " in " << blobs.size() << " blobs ("
+              << (numBytes / 1000000) << "MB), at file offsets " << blobs.front().offset
+              << " to " << (blobs.back().offset + blobs.back().size) << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    int nextArgumentIndex = parseArguments(argc, argv);
+    std::string usageLine = std::string("usage: ") + argv[0] + " [-t|--threads <n>] [-n|--nodes] [-w|--ways] [-r|--relations] [-p|--part <i>/<n>] <input.pbf>";
+    if (nextArgumentIndex + 1 != argc)
+    {
+        std::cerr << "error: expected an input file argument" << std::endl;
+        std::cerr << usageLine << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::string fileName = argv[nextArgumentIndex];
+
+    PbfBlobIndex index(fileName, numThreads);
+    std::vector<uint64_t> total = countEntities(index.getBlobs());
+    std::cout << "blob index of '" << fileName << "' (" << index.getBlobs().size() << " blobs):" << std::endl;
+    printSection( index.selectByEntityType(true, false, false), "nodes",     total[0]);
+    printSection( index.selectByEntityType(false, true, false), "ways",      total[1]);
+    printSection( index.selectByEntityType(false, false, true), "relations", total[2]);
+
+    if (entityFilter == 0 && numParts == 0)
+    {
+        google::protobuf::ShutdownProtobufLibrary();
+        return EXIT_SUCCESS;
+    }
+
+    if (entityFilter == 0)
+        entityFilter = OsmParserPbf::PARSE_ALL;
+
+    /* the intersection of both selections. Both are sorted by file offset, and so is the result */
+    std::vector<PbfBlobInfo> selection;
+    uint64_t fileSize = index.getBlobs().empty() ? 0 :
+                        index.getBlobs().back().offset + index.getBlobs().back().size;
+    uint64_t begin = numParts ? fileSize *  partIndex      / numParts : 0;
+    uint64_t end   = numParts ? fileSize * (partIndex + 1) / numParts : fileSize;
+    for (const PbfBlobInfo &blob : index.selectByByteRange(begin, end))
+        if ( ((entityFilter & OsmParserPbf::PARSE_NODES)     && blob.numNodes) ||
+             ((entityFilter & OsmParserPbf::PARSE_WAYS)      && blob.numWays)  ||
+             ((entityFilter & OsmParserPbf::PARSE_RELATIONS) && blob.numRelations))
+            selection.push_back(blob);
+
+    std::vector<uint64_t> expected = countEntities(selection);
+    if ( !(entityFilter & OsmParserPbf::PARSE_NODES))     expected[0] = 0;
+    if ( !(entityFilter & OsmParserPbf::PARSE_WAYS))      expected[1] = 0;
+    if ( !(entityFilter & OsmParserPbf::PARSE_RELATIONS)) expected[2] = 0;
+
+    FILE* f = fopen( fileName.c_str(), "rb");
+    if (!f)
+    {
+        std::cerr << "error: cannot open file '" << fileName << "'" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::cout << "parsing " << selection.size() << " selected blobs (file offsets " << begin
+              << " to " << end << ")" << std::endl;
+    OsmConsumerCounter counter;
+    {
+        OsmParserPbf parser(f, &counter, numThreads);
+        parser.restrictTo(selection, entityFilter);
+        parser.parse();
+    }
+    fclose(f);
+
+    std::cout << "parsed " << counter.getNumNodes() << " nodes, " << counter.getNumWays()
+              << " ways, " << counter.getNumRelations() << " relations" << std::endl;
+    MUST( counter.getNumNodes()     == expected[0] &&
+          counter.getNumWays()      == expected[1] &&
+          counter.getNumRelations() == expected[2], "entity counts do not match the blob index");
+
+    google::protobuf::ShutdownProtobufLibrary();
+}
@@ -9,12 +9,37 @@
 #include <stdlib.h>
 #include <assert.h>
 
+#include <algorithm>
 #include <iostream>
 
 #include "mem_map.h"
 #include "config.h"
 
-mmap_t init_mmap ( const char* file_name, bool readable, bool writeable, bool clearContents)
+// maps the part [from, to[ of the file into the reserved range of 'map' (at the same offsets)
+static void map_file_range( mmap_t *map, uint64_t from, uint64_t to)
+{
+    if (from == to)
+        return;
+
+    uint8_t* dest = (uint8_t*)map->ptr + from;
+    int flags = MAP_SHARED | MAP_FIXED | ((map->options & MMAP_POPULATE) ? MAP_POPULATE : 0);
+    void* ptr = mmap(dest, to - from, map->prot, flags, map->fd, from);
+    if (ptr != dest) { perror("mmap"); exit(0);}
+
+    // only a hint. File-backed maps get huge pages only on some file systems
+    if (map->options & MMAP_HUGE_PAGES)
+        madvise(dest, to - from, MADV_HUGEPAGE);
+}
+
+static void* reserve_address_space( uint64_t size)
+{
+    void* ptr = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) { perror("mmap"); exit(0);}
+    return ptr;
+}
+
+mmap_t init_mmap ( const char* file_name, bool readable, bool writeable, bool clearContents,
+                   uint32_t options, uint64_t addressSpace)
 {
     assert(readable || writeable);  //no use otherwise
     
@@ -35,23 +60,27 @@ mmap_t init_mmap ( const char* file_name, bool readable, bool writeable, bool cl
     if (0 != fstat(res.fd, &stats)) { perror ("fstat"); exit(0); }
 
     assert( stats.st_size % 4096 == 0);
-    if (stats.st_size == 0)
+    res.size = stats.st_size;
+    res.prot = (writeable? PROT_WRITE:0) | (readable?PROT_READ:0);
+    res.options = options;
+    res.reservedSize = 0;
+    
+    if (writeable)
+    {
+        res.reservedSize = std::max<uint64_t>( addressSpace, 2 * res.size);
+        res.ptr = reserve_address_space( res.reservedSize);
+        map_file_range( &res, 0, res.size);
+    }
+    else if (stats.st_size == 0)
         res.ptr = NULL;
     else
     {
-        res.ptr = mmap(NULL, stats.st_size, (writeable? PROT_WRITE:0) | (readable?PROT_READ:0), MAP_SHARED, res.fd, 0);
+        res.ptr = mmap(NULL, stats.st_size, res.prot, MAP_SHARED | ((options & MMAP_POPULATE) ? MAP_POPULATE : 0), res.fd, 0);
         if (res.ptr == MAP_FAILED) { perror("mmap"); exit(0);}
+        if (options & MMAP_HUGE_PAGES)
+            madvise(res.ptr, res.size, MADV_HUGEPAGE);
     }
     
-/*    if (stats.st_size == 0)
-    {
-        size_t ps = sysconf (_SC_PAGESIZE);
-        if (0 !=ftruncate(fd, ps))
-            {perror("ftruncate"); exit(0); }
-        if (0 != fstat(fd, &stats)) { perror ("fstat"); exit(0); }
-    }
-  */  
-    res.size = stats.st_size;
     return res;
 }
 
@@ -59,42 +88,100 @@ void free_mmap ( mmap_t *map)
 {
     if (map->ptr)
     {
-        if (0 != munmap(map->ptr, map->size)) { perror("munmap"); exit(0);}
+        // for reserved maps, this also releases the rest of the reservation
+        uint64_t size = map->reservedSize ? map->reservedSize : map->size;
+        if (0 != munmap(map->ptr, size)) { perror("munmap"); exit(0);}
     }
     map->ptr = 0;
     assert( map->fd > 2);
     close(map->fd);
     map->fd = -1;
     map->size = 0;
+    map->reservedSize = 0;
 }
 
 void ensure_mmap_size( mmap_t *map, uint64_t size)
 {
     if (map->size >= size) return;
 
-    //std::cout << "File can hold at most " << file_no_nodes << " nodes, but " << node_id << " nodes need to be stored" << std::endl;
-
-    /*if (map->ptr)
-    {
-        if (0 != munmap(map->ptr, map->size)) { perror("munmap"); exit(0);}
-    }*/
     size_t ps = sysconf (_SC_PAGESIZE);
     
     //increase map file by 10% to reduce the number of times that a resize is necessary;
     size_t new_file_size = ( ( size * 11 / 10) / ps +1) * ps;
-    //size_t new_file_size = (size+ps-1)/ps*ps;
+    // ... but do not leave the reservation just for that
+    if (size <= map->reservedSize && new_file_size > map->reservedSize)
+        new_file_size = map->reservedSize;
     assert(new_file_size % ps == 0); //needs to be a multiple of page size for mmap
     if (new_file_size < size) { printf("error resizing memory map\n"); exit(0);}
     if (0 != ftruncate(map->fd, new_file_size)) { perror("[ERR]"); exit(0);}
    
+    if (map->reservedSize)
+    {
+        if (new_file_size > map->reservedSize)
+        {
+            /* the file has outgrown its reservation --> move the mapping to a new, bigger one
+             * (and release the old one) */
+            uint64_t newReservedSize = std::max<uint64_t>( 2 * map->reservedSize, 2 * new_file_size);
+            void* newPtr = reserve_address_space( newReservedSize);
+            if (map->size > 0 &&
+                mremap(map->ptr, map->size, map->size, MREMAP_MAYMOVE | MREMAP_FIXED, newPtr) != newPtr)
+                { perror("[ERR]"); exit(0);}
+
+            if (map->size < map->reservedSize &&
+                0 != munmap( (uint8_t*)map->ptr + map->size, map->reservedSize - map->size))
+                { perror("munmap"); exit(0);}
+
+            map->ptr = newPtr;
+            map->reservedSize = newReservedSize;
+        }
+
+        //the existing part of the mapping stays where it is, the new part is mapped right behind it
+        map_file_range( map, map->size, new_file_size);
+        map->size = new_file_size;
+        return;
+    }
+
     //std::cout << "Resizing map " << map->size << " -> " << new_file_size << std::endl;
     
     if (map->ptr)
         map->ptr = mremap(map->ptr, map->size, new_file_size, MREMAP_MAYMOVE);
     else
-        map->ptr = mmap(NULL, new_file_size, PROT_WRITE, MAP_SHARED, map->fd, 0);
+        map->ptr = mmap(NULL, new_file_size, map->prot, MAP_SHARED, map->fd, 0);
         
     if (map->ptr == MAP_FAILED) { perror("[ERR]"); exit(0);}
     map->size = new_file_size;
 }
 
+// rounds the byte range [offset, offset+size) of 'map' outward to page boundaries
+static bool page_align_range( const mmap_t *map, uint64_t &offset, uint64_t &size)
+{
+    uint64_t ps = sysconf (_SC_PAGESIZE);
+    uint64_t end = std::min<uint64_t>( offset + size, map->size);
+    if (offset >= end)
+        return false;
+
+    offset = offset / ps * ps;
+    size = (end + ps - 1) / ps * ps - offset;
+    return true;
+}
+
+void writeback_mmap( mmap_t *map, uint64_t offset, uint64_t size)
+{
+    if (!page_align_range( map, offset, size))
+        return;
+
+    // only a hint, so failures (e.g. on file systems that do not support it) are ignored
+    sync_file_range( map->fd, offset, size, SYNC_FILE_RANGE_WRITE);
+}
+
+void release_mmap( mmap_t *map, uint64_t offset, uint64_t size)
+{
+    if (!page_align_range( map, offset, size))
+        return;
+
+    /* the page cache does not evict pages that are still mapped, so unmap them first. For
+     * shared file maps, this does not discard any data: dirty pages stay in the page cache
+     * until they are written back. */
+    madvise( (uint8_t*)map->ptr + offset, size, MADV_DONTNEED);
+    posix_fadvise( map->fd, offset, size, POSIX_FADV_DONTNEED);
+}
@@ -1,18 +1,43 @@
-
 #ifndef MEM_MAP_H
 #define MEM_MAP_H
 
 #include <stdint.h>
 
+#include "config.h"
+
 typedef struct mmap_t {
     void* ptr;
     int32_t fd;
     uint64_t size;
+    /* writeable maps are placed at the start of a reserved range of address space of this
+     * size (0 for read-only maps), so that they can grow in place */
+    uint64_t reservedSize;
+    int32_t  prot;
+    uint32_t options;
 } mmap_t;
 
-mmap_t init_mmap ( const char* file_name, bool readable=true, bool writeable=true, bool clearContents = false);
+/* options for init_mmap(). Both are meant for maps that are mostly read, and that are read
+ * as a whole (MMAP_POPULATE) or at random (MMAP_HUGE_PAGES) */
+static const uint32_t MMAP_POPULATE   = 1;  //read the whole file into memory right away
+static const uint32_t MMAP_HUGE_PAGES = 2;  //ask for transparent huge pages (fewer TLB misses)
+
+/* A writeable map reserves (at least) 'addressSpace' bytes of address space. While the file
+ * fits into that range, ensure_mmap_size() extends the mapping in place, and pointers into
+ * the map remain valid. Only when the file outgrows its reservation, the map is moved to a
+ * bigger one. */
+mmap_t init_mmap ( const char* file_name, bool readable=true, bool writeable=true, bool clearContents = false,
+                   uint32_t options = 0, uint64_t addressSpace = MMAP_ADDRESS_SPACE);
 void   free_mmap ( mmap_t *mmap);
 void   ensure_mmap_size( mmap_t *mmap, uint64_t size);
-//void   sync_mmap(mmap_t *mmap, uint64_t offset, 
+
+/* page cache control for maps that are written (or read) once, front to back, and are not
+ * accessed again soon. writeback_mmap() starts writing the dirty pages of the byte range 
+ * [offset, offset+size) back to the file, but does not wait for that to complete. 
+ * release_mmap() evicts the range from memory, so that it does not compete with more
+ * useful data for the page cache. The data itself is not affected (it is read back from the
+ * file on its next access), but pages that are still dirty or under writeback are not 
+ * evicted. So a range should be released only some time after its writeback was started. */
+void   writeback_mmap( mmap_t *mmap, uint64_t offset, uint64_t size);
+void   release_mmap( mmap_t *mmap, uint64_t offset, uint64_t size);
 
 #endif
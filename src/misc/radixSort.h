@@ -0,0 +1,89 @@
+#ifndef RADIX_SORT_H
+#define RADIX_SORT_H
+
+#include <stdint.h>
+
+#include <algorithm>    //for std::min(), std::max()
+#include <vector>
+
+#include <omp.h>
+
+/* sorts 'items' by the uint64_t key that 'getKey(item)' returns, using an LSD radix sort
+ * with (up to) 'numThreads' threads. The sort is stable, and T has to be trivially copyable.
+ * Only the bits in which the keys actually differ are sorted by (in digits of
+ * RADIX_SORT_DIGIT_BITS bits), so keys from a narrow range - like the node ids of a single
+ * bucket - take just two or three passes over the data.
+ *
+ * Each pass is parallelized by splitting the items into one slice per thread: each thread
+ * counts the digits of its slice, and then scatters its slice to the positions that the
+ * prefix sums over all (digit, thread) counts reserve for it. */
+static const uint32_t RADIX_SORT_DIGIT_BITS = 11;
+
+template <typename T, typename GetKey>
+void radixSort(std::vector<T> &items, GetKey getKey, uint32_t numThreads = 1)
+{
+    static const uint64_t RADIX = 1ull << RADIX_SORT_DIGIT_BITS;
+    static const uint64_t MIN_ITEMS_PER_THREAD = 1 << 16;
+
+    uint64_t numItems = items.size();
+    if (numItems < 2)
+        return;
+
+    uint64_t minKey = getKey(items[0]), maxKey = minKey;
+    for (const T &item : items)
+    {
+        minKey = std::min(minKey, getKey(item));
+        maxKey = std::max(maxKey, getKey(item));
+    }
+
+    if (minKey == maxKey)
+        return;
+
+    uint32_t numBits   = 64 - __builtin_clzll(maxKey - minKey);
+    uint32_t numPasses = (numBits + RADIX_SORT_DIGIT_BITS - 1) / RADIX_SORT_DIGIT_BITS;
+    numThreads = std::max<uint64_t>(1, std::min<uint64_t>(numThreads, numItems / MIN_ITEMS_PER_THREAD));
+
+    std::vector<T> buffer(numItems);
+    std::vector<uint64_t> counts(numThreads * RADIX);
+    T *src = items.data(), *dest = buffer.data();
+    for (uint32_t pass = 0; pass < numPasses; pass++)
+    {
+        uint32_t shift = pass * RADIX_SORT_DIGIT_BITS;
+        #pragma omp parallel num_threads(numThreads)
+        {
+            uint64_t threadId   = omp_get_thread_num();
+            uint64_t numWorkers = omp_get_num_threads();    //may be less than 'numThreads'
+            uint64_t first = numItems *  threadId      / numWorkers;
+            uint64_t last  = numItems * (threadId + 1) / numWorkers;
+            uint64_t *count = counts.data() + threadId * RADIX;
+
+            std::fill( count, count + RADIX, 0);
+            for (uint64_t i = first; i < last; i++)
+                count[ ((getKey(src[i]) - minKey) >> shift) & (RADIX - 1)]++;
+
+            #pragma omp barrier
+            #pragma omp single
+            {
+                // the items of a digit go to the same place in the order of the slices
+                uint64_t pos = 0;
+                for (uint64_t digit = 0; digit < RADIX; digit++)
+                    for (uint64_t thread = 0; thread < numWorkers; thread++)
+                    {
+                        uint64_t num = counts[thread * RADIX + digit];
+                        counts[thread * RADIX + digit] = pos;
+                        pos += num;
+                    }
+            }   //implicit barrier
+
+            for (uint64_t i = first; i < last; i++)
+                dest[ count[ ((getKey(src[i]) - minKey) >> shift) & (RADIX - 1)]++ ] = src[i];
+        }
+        std::swap(src, dest);
+    }
+
+    if (src != items.data())
+        items.swap(buffer);
+}
+
+#endif
+
@@ -5,6 +5,9 @@
 #include "config.h"
 #include <string.h> //for strlen
 #include "containers/chunkedFile.h"
+#ifndef COORDS_MAPNIK_PLUGIN
+    #include "misc/tagSetTable.h"
+#endif
 
 /* ON-DISK LAYOUT FOR TAGS:
     varUInt numBytes, *NOT* including this field itself
@@ -12,8 +15,12 @@
     uint8_t  isSymbolicName[ceil( (numTags*2)/8)] (bit array)
     
     for each name:
-    1. if is symbolic --> one uint8_t index into symbolicNames
+    1. if is symbolic --> varUint index into the SymbolicNameTable (one or two bytes)
     2. if is not symbolic --> zero-terminated string
+
+   or, for tag sets shared by many entities:
+    uint8_t 0 (i.e. numBytes == 0)
+    varUint id of the tag set in the TagSetTable
 */
 
 RawTags::RawTags(const uint8_t* src, uint64_t *nBytesRead)
@@ -22,6 +29,22 @@ RawTags::RawTags(const uint8_t* src, uint64_t *nBytesRead)
     
     uint32_t totalNumBytes = varUintFromBytes(src, &nRead);
 
+    this->tagSetId = -1;
+#ifndef COORDS_MAPNIK_PLUGIN
+    if (totalNumBytes == 0) //a reference to a shared tag set (see TagSetTable)
+    {
+        uint64_t tagSetId = varUintFromBytes(src + nRead, &nRead);
+        this->tagSetId = tagSetId;
+        MUST( tagSetId < getTagSets().size(), "invalid tag set reference");
+        if (nBytesRead)
+            *nBytesRead = 1 + nRead;
+
+        src = getTagSets()[tagSetId];
+        totalNumBytes = varUintFromBytes(src, &nRead);
+        nBytesRead = nullptr;   //already set
+    }
+#endif
+
     if (nBytesRead)
         *nBytesRead = totalNumBytes + nRead;
     
@@ -43,17 +66,49 @@ RawTags::RawTags(const uint8_t* src, uint64_t *nBytesRead)
 
 
 
+static int16_t getSymbolicId(const std::string &name)
+{
+    const uint16_t *id = getSymbolicNames().at(name.c_str(), name.length());
+    return id ? *id : -1;
+}
+
+static inline uint64_t getNameSize(const std::string &name, int16_t symbolicId)
+{
+    return symbolicId >= 0 ? varUintNumBytes(symbolicId) : name.length() + 1;
+}
+
+// the number of bytes of a serialized symbolic name (a varUint of at most two bytes)
+static inline uint64_t getSymbolicIdSize(const uint8_t *pos)
+{
+    return (*pos & 0x80) ? 2 : 1;
+}
+
+static inline const char* getSymbolicName(const uint8_t *pos)
+{
+    uint64_t id = (*pos & 0x80) ? (pos[0] & 0x7F) | (pos[1] << 7) : *pos;
+    return getSymbolicNames()[id];
+}
+
 uint64_t RawTags::getSerializedSize(const Tags &tags)
+{
+    SymbolicIds symbolicIds;
+    return getSerializedSize(tags, symbolicIds);
+}
+
+uint64_t RawTags::getSerializedSize(const Tags &tags, SymbolicIds &symbolicIdsOut)
 {
     uint64_t numTags = tags.size();
     uint64_t numNames = numTags * 2;    //one key, one value
     uint64_t bitfieldSize = (numNames +7) / 8; //one bit per name --> have to round up
     
+    symbolicIdsOut.resize(numNames);
     uint64_t numTagBytes = 0;
-    for (const std::pair<std::string, std::string> &kv: tags)
+    for (uint64_t i = 0; i < numTags; i++)
     {
-        numTagBytes += symbolicNameId.at(kv.first.c_str()) ? 1 : kv.first.length()  + 1;
-        numTagBytes += symbolicNameId.at(kv.second.c_str()) ? 1 : kv.second.length() + 1;
+        symbolicIdsOut[2*i]   = getSymbolicId(tags[i].first);
+        symbolicIdsOut[2*i+1] = getSymbolicId(tags[i].second);
+        numTagBytes += getNameSize(tags[i].first,  symbolicIdsOut[2*i]);
+        numTagBytes += getNameSize(tags[i].second, symbolicIdsOut[2*i+1]);
     }
     
     uint64_t numBytes = varUintNumBytes(numTags) +
@@ -116,10 +171,10 @@ void RawTags::serialize(const Tags &tags, FILE* fOut)
 }
 
 #ifndef COORDS_MAPNIK_PLUGIN
-void RawTags::serialize(const Tags &tags, Chunk& chunk)
+void RawTags::serialize(const Tags &tags, Chunk& chunk, const SymbolicIds *symbolicIds)
 {
     uint64_t numBytes = 0;
-    uint8_t *bytes = serialize(tags, &numBytes);
+    uint8_t *bytes = serialize(tags, &numBytes, symbolicIds);
     
     chunk.put(bytes, numBytes);
     delete [] bytes;
@@ -127,16 +182,18 @@ void RawTags::serialize(const Tags &tags, Chunk& chunk)
 #endif
 
 
-uint8_t* RawTags::serialize( const Tags &tags, uint64_t *numBytesOut)
+uint8_t* RawTags::serialize( const Tags &tags, uint64_t *numBytesOut, const SymbolicIds *symbolicIds)
 {
-    uint64_t numBytes = getSerializedSize(tags);
+    SymbolicIds ownSymbolicIds;
+    uint64_t numBytes = symbolicIds ? getSerializedSizeFromIds(tags, *symbolicIds) : 
+                                      getSerializedSize(tags, ownSymbolicIds);
     uint64_t numBytesIncludingSizeField = numBytes + varUintNumBytes(numBytes);
     if (numBytesOut)
         *numBytesOut = numBytesIncludingSizeField;
         
     uint8_t *outBuf = new uint8_t[numBytesIncludingSizeField];
     
-    RawTags::serialize(tags, numBytes, outBuf, numBytesIncludingSizeField);
+    RawTags::serialize(tags, symbolicIds ? *symbolicIds : ownSymbolicIds, numBytes, outBuf, numBytesIncludingSizeField);
 
     //MUST( outPos - outStart == (int64_t)numBytes, "tag set size mismatch");
     return outBuf;
@@ -145,6 +202,30 @@ uint8_t* RawTags::serialize( const Tags &tags, uint64_t *numBytesOut)
 void RawTags::serialize( const Tags &tags, uint64_t numBytes, 
                              uint8_t *outputBuffer, uint64_t outputBufferSize)
 {
+    SymbolicIds symbolicIds;
+    getSerializedSize(tags, symbolicIds);
+    serialize(tags, symbolicIds, numBytes, outputBuffer, outputBufferSize);
+}
+
+/* the sum of the sizes of all names is already known from getSerializedSize(). So 
+ * this only has to count the non-symbolic names' bytes again, without any lookup */
+uint64_t RawTags::getSerializedSizeFromIds(const Tags &tags, const SymbolicIds &symbolicIds)
+{
+    MUST( symbolicIds.size() == tags.size() * 2, "symbolic name id count mismatch");
+    uint64_t numTagBytes = 0;
+    for (uint64_t i = 0; i < tags.size(); i++)
+    {
+        numTagBytes += getNameSize(tags[i].first,  symbolicIds[2*i]);
+        numTagBytes += getNameSize(tags[i].second, symbolicIds[2*i+1]);
+    }
+    
+    return varUintNumBytes(tags.size()) + (tags.size() * 2 + 7) / 8 + numTagBytes;
+}
+
+void RawTags::serialize( const Tags &tags, const SymbolicIds &symbolicIds, uint64_t numBytes, 
+                         uint8_t *outputBuffer, uint64_t outputBufferSize)
+{
+    MUST( symbolicIds.size() == tags.size() * 2, "symbolic name id count mismatch");
     uint8_t *outPos = outputBuffer;
     
     outPos += varUintToBytes(numBytes, outPos);
@@ -172,11 +253,10 @@ void RawTags::serialize( const Tags &tags, uint64_t numBytes,
     {
         int byteIdx = idx / 8;
         int bitIdx  = 7 - (idx % 8);
-        const uint8_t *symbolicKey = symbolicNameId.at(kv.first.c_str());
-        if (symbolicKey)
+        if (symbolicIds[idx] >= 0)
         {
             isSymbolicName[byteIdx] |= (1 << bitIdx);
-            *(outPos++) =  *symbolicKey;
+            outPos += varUintToBytes(symbolicIds[idx], outPos);
         } else
         {
             const char* key = kv.first.c_str();
@@ -188,11 +268,10 @@ void RawTags::serialize( const Tags &tags, uint64_t numBytes,
         MUST( bitIdx > 0, "logic error");
         bitIdx -= 1;
 
-        const uint8_t *symbolicValue = symbolicNameId.at(kv.second.c_str());
-        if (symbolicValue)
+        if (symbolicIds[idx+1] >= 0)
         {
             isSymbolicName[byteIdx] |= (1 << bitIdx);
-            *(outPos++) = *symbolicValue;
+            outPos += varUintToBytes(symbolicIds[idx+1], outPos);
         } else
         {
             const char* val = kv.second.c_str();
@@ -221,8 +300,8 @@ bool RawTags::RawTagIterator::operator!=(const RawTagIterator &other)
         
 RawTags::RawTagIterator& RawTags::RawTagIterator::operator++()
 {
-    tagsAtPos += (isSymbolicName(pos*2)  ? 1 : strlen( (char*)tagsAtPos) + 1);
-    tagsAtPos += (isSymbolicName(pos*2+1)? 1 : strlen( (char*)tagsAtPos) + 1);
+    tagsAtPos += (isSymbolicName(pos*2)  ? getSymbolicIdSize(tagsAtPos) : strlen( (char*)tagsAtPos) + 1);
+    tagsAtPos += (isSymbolicName(pos*2+1)? getSymbolicIdSize(tagsAtPos) : strlen( (char*)tagsAtPos) + 1);
     pos += 1;
     
     return *this;
@@ -233,11 +312,11 @@ std::pair<const char*, const char*> RawTags::RawTagIterator::operator*()
     const char* key;
     const char* value;
     
-    key = isSymbolicName(pos*2) ? symbolicNames[ *tagsAtPos ] : (char*)tagsAtPos;
+    key = isSymbolicName(pos*2) ? getSymbolicName(tagsAtPos) : (char*)tagsAtPos;
     const uint8_t *valuePos = tagsAtPos + 
-        (isSymbolicName(pos*2) ? 1 : strlen((char*)tagsAtPos) + 1);
+        (isSymbolicName(pos*2) ? getSymbolicIdSize(tagsAtPos) : strlen((char*)tagsAtPos) + 1);
     
-    value = isSymbolicName(pos*2+1) ? symbolicNames[ *valuePos ] : (char*)valuePos;
+    value = isSymbolicName(pos*2+1) ? getSymbolicName(valuePos) : (char*)valuePos;
     
     return std::make_pair(key, value);
 }
@@ -22,24 +22,37 @@ public:
     //RawTags(const uint8_t* src);
     RawTags(const uint8_t* src, uint64_t *nBytesRead = nullptr);
 
+    /* the symbolic name index of each key and value of a tag set (in the order key0, value0, 
+     * key1, ...), or -1 for names that are not symbolic. getSerializedSize() returns them,
+     * so that serialize() does not have to look up every name a second time */
+    typedef std::vector<int16_t> SymbolicIds;
+
     //static RawTags fromRawData(const uint8_t* src);
     /* returns: a memory buffer into which the 'tags' have been serialized.
                 the caller takes ownership of the returned memory buffer. */
-    static uint8_t* serialize( const Tags &tags, uint64_t *numBytesOut = nullptr);
+    static uint8_t* serialize( const Tags &tags, uint64_t *numBytesOut = nullptr, 
+                               const SymbolicIds *symbolicIds = nullptr);
     static void serialize( const Tags &tags, uint64_t numBytes, 
                            uint8_t *outputBuffer, uint64_t outputBufferSize);
+    static void serialize( const Tags &tags, const SymbolicIds &symbolicIds, uint64_t numBytes, 
+                           uint8_t *outputBuffer, uint64_t outputBufferSize);
     
     static void     serialize( const Tags &tags, FILE* fOut);
 #ifndef COORDS_MAPNIK_PLUGIN
-    static void     serialize( const Tags &tags, Chunk &chunk);
+    static void     serialize( const Tags &tags, Chunk &chunk, const SymbolicIds *symbolicIds = nullptr);
 #endif
     uint64_t serialize( uint8_t * const outputBuffer) const;
 
     // returns the serialized size of 'Tags', *not* counting the leading numBytes field
     static uint64_t getSerializedSize( const Tags &tags);
+    static uint64_t getSerializedSize( const Tags &tags, SymbolicIds &symbolicIdsOut);
     
     uint64_t getSerializedSize() const;
     TagDictionary asDictionary() const;
+    /* the id of the shared tag set (see TagSetTable) these tags were read from, or -1. Entities
+     * with the same tag set id have the same tags, so results derived from the tags alone
+     * may be cached by tag set id */
+    int64_t  getTagSetId() const { return tagSetId; }
 
     class RawTagIterator {
     public:
@@ -60,9 +73,13 @@ public:
     RawTagIterator begin() const { return RawTagIterator(symbolicNameBits, tagsStart, 0);}
     RawTagIterator end()   const { return RawTagIterator(symbolicNameBits, tagsStart + numTagBytes, numTags);}
    
+private:
+    static uint64_t getSerializedSizeFromIds( const Tags &tags, const SymbolicIds &symbolicIds);
+
 private:
     uint64_t numTags;
     uint64_t numTagBytes;
+    int64_t  tagSetId;
     const uint8_t *symbolicNameBits;
     const uint8_t *tagsStart;
 };
@@ -4,6 +4,9 @@
 #include "stdio.h"
 #include "stdlib.h"
 
+#include <algorithm>
+#include <memory>
+
 const char *symbolicNames[] = {
     "building",
     "addr:housenumber",
@@ -265,16 +268,169 @@ const char *symbolicNames[] = {
 
 const uint64_t numSymbolicNames = sizeof(symbolicNames) / sizeof(const char*);
 
-RadixTree<uint8_t> createSymbolicNameMap()
+SymbolicNameHash::SymbolicNameHash(const char* const *names, uint64_t numNames): 
+    names(names), seeds( (numNames + 3) / 4 + 1, 0), 
+    ids( std::max<uint64_t>(numNames, 1), 0), 
+    lengths( std::max<uint64_t>(numNames, 1), 0xFFFFFFFF)  //an empty set gets a single slot that matches no name
 {
-    MUST( numSymbolicNames <= 256, "symbolic name overflow");
-    RadixTree<uint8_t> res;
+    MUST( numNames <= MAX_SYMBOLIC_NAMES, "symbolic name overflow");
+    
+    std::vector< std::vector<uint64_t> > buckets( seeds.size());
+    for (uint64_t i = 0; i < numNames; i++)
+        buckets[ hash(names[i], strlen(names[i]), 0) % buckets.size()].push_back(i);
+        
+    std::vector<uint64_t> bucketOrder;
+    for (uint64_t i = 0; i < buckets.size(); i++)
+        bucketOrder.push_back(i);
+    std::stable_sort( bucketOrder.begin(), bucketOrder.end(), [&](uint64_t a, uint64_t b) { 
+        return buckets[a].size() > buckets[b].size(); });
+    
+    std::vector<bool> isSlotUsed(numNames, false);
+    for (uint64_t bucket : bucketOrder)
+    {
+        if (buckets[bucket].size() == 0)
+            break;
+        
+        std::vector<uint64_t> slots;
+        uint32_t seed = 1;
+        for (; seed < 1000000; seed++)
+        {
+            slots.clear();
+            for (uint64_t name : buckets[bucket])
+            {
+                uint64_t slot = hash(names[name], strlen(names[name]), seed) % numNames;
+                if (isSlotUsed[slot] || std::find(slots.begin(), slots.end(), slot) != slots.end())
+                    break;
+                slots.push_back(slot);
+            }
+            
+            if (slots.size() == buckets[bucket].size())
+                break;
+        }
+        MUST( slots.size() == buckets[bucket].size(), "cannot create symbolic name hash");
+
+        seeds[bucket] = seed;
+        for (uint64_t i = 0; i < slots.size(); i++)
+        {
+            uint64_t name = buckets[bucket][i];
+            isSlotUsed[slots[i]] = true;
+            ids[slots[i]] = name;
+            lengths[slots[i]] = strlen(names[name]);
+        }
+    }
+}
 
-    for (uint64_t i = 0; i < numSymbolicNames; i++)
-        res.insert( symbolicNames[i], i);
 
+static std::vector<char> concatenate(const std::vector<std::string> &names)
+{
+    std::vector<char> res;
+    for (const std::string &name : names)
+        res.insert( res.end(), name.c_str(), name.c_str() + name.length() + 1);
+    return res;
+}
+
+static std::vector<const char*> getNamePointers(const std::vector<char> &nameData, uint64_t numNames)
+{
+    std::vector<const char*> res;
+    for (uint64_t pos = 0; res.size() < numNames; pos += strlen(&nameData[pos]) + 1)
+        res.push_back( &nameData[pos]);
     return res;
 }
 
-const RadixTree<uint8_t> symbolicNameId = createSymbolicNameMap();
+SymbolicNameTable::SymbolicNameTable(const char* const *names, uint64_t numNames):
+    names(names), numNames(numNames), hash(names, numNames) { }
+
+SymbolicNameTable::SymbolicNameTable(const std::vector<std::string> &names):
+    nameData( concatenate(names)), ownNames( getNamePointers(nameData, names.size())), 
+    names( ownNames.data()), numNames( names.size()), hash( ownNames.data(), names.size()) { }
+
+static const char     SYMBOLIC_NAMES_MAGIC[8] = {'C', 'O', 'O', 'R', 'D', 'S', 'S', 'N'};
+static const uint32_t SYMBOLIC_NAMES_VERSION  = 1;
+
+void SymbolicNameTable::store(const std::string &fileName) const
+{
+    FILE* f = fopen(fileName.c_str(), "wb");
+    MUST( f, "cannot create symbolic name file");
+    uint32_t header[2] = { SYMBOLIC_NAMES_VERSION, (uint32_t)numNames };
+    MUST( fwrite( SYMBOLIC_NAMES_MAGIC, sizeof(SYMBOLIC_NAMES_MAGIC), 1, f) == 1, "write error");
+    MUST( fwrite( header, sizeof(header), 1, f) == 1, "write error");
+    for (uint64_t i = 0; i < numNames; i++)
+        MUST( fwrite( names[i], strlen(names[i]) + 1, 1, f) == 1, "write error");
+    fclose(f);
+}
+
+SymbolicNameTable* SymbolicNameTable::load(const std::string &fileName)
+{
+    FILE* f = fopen(fileName.c_str(), "rb");
+    if (!f)
+        return nullptr;
+
+    char magic[sizeof(SYMBOLIC_NAMES_MAGIC)];
+    uint32_t header[2];
+    MUST( fread( magic, sizeof(magic), 1, f) == 1 && fread( header, sizeof(header), 1, f) == 1, 
+          "truncated symbolic name file");
+    MUST( memcmp( magic, SYMBOLIC_NAMES_MAGIC, sizeof(magic)) == 0 && header[0] == SYMBOLIC_NAMES_VERSION,
+          "invalid symbolic name file");
+
+    std::vector<std::string> names(header[1]);
+    for (std::string &name : names)
+    {
+        int ch;
+        while ( (ch = fgetc(f)) > 0)
+            name.push_back(ch);
+        MUST( ch == 0, "truncated symbolic name file");
+    }
+    fclose(f);
+
+    return new SymbolicNameTable(names);
+}
+
+static const SymbolicNameTable builtinSymbolicNames(symbolicNames, numSymbolicNames);
+static std::unique_ptr<SymbolicNameTable> loadedSymbolicNames;
+static const SymbolicNameTable *activeSymbolicNames = &builtinSymbolicNames;
+
+static std::string symbolicNamesTileDirectory;   //the directory of the last loadSymbolicNamesForTile()
+
+const SymbolicNameTable& getSymbolicNames()
+{
+#ifdef COORDS_MAPNIK_PLUGIN
+    MUST( loadedSymbolicNames, "no symbolic name table loaded for the tiles (see loadSymbolicNamesForTile())");
+#endif
+    return *activeSymbolicNames;
+}
+
+void useSymbolicNames(SymbolicNameTable *table)
+{
+    loadedSymbolicNames.reset(table);
+    activeSymbolicNames = table;
+    symbolicNamesTileDirectory.clear();
+}
+
+bool loadSymbolicNames(const std::string &directory)
+{
+    std::string path = directory;
+    if (path.length() && path.back() != '/' && path.back() != '\\')
+        path += "/";
+
+    SymbolicNameTable *table = SymbolicNameTable::load( path + SYMBOLIC_NAMES_FILE_NAME);
+    if (!table)
+        return false;
+
+    useSymbolicNames(table);
+    return true;
+}
+
+bool loadSymbolicNamesForTile(const std::string &tileFileName)
+{
+    size_t pos = tileFileName.find_last_of("/\\");
+    std::string directory = (pos == std::string::npos) ? "./" : tileFileName.substr(0, pos + 1);
+    if (loadedSymbolicNames && directory == symbolicNamesTileDirectory)
+        return true;
+
+    if (!loadSymbolicNames(directory))
+        return false;
+
+    symbolicNamesTileDirectory = directory;
+    return true;
+}
 
@@ -1,13 +1,103 @@
-
 #ifndef SYMBOLIC_NAMES_H
 #define SYMBOLIC_NAMES_H
 
 #include <stdint.h>
-#include "containers/radixTree.h"
+#include <string.h> //for strlen()
+
+#include <string>
+#include <vector>
+
+/* The class SymbolicNameHash is a minimal perfect hash over a fixed set of names: each of
+ * the 'numNames' names hashes to a different one of 'numNames' slots, so a lookup needs a
+ * single hash computation, and a single length check and memcmp() to reject names that are
+ * not in the set. The table is built by 'hash and displace': the names are split into
+ * buckets by a first hash, and for each bucket (biggest first), a seed for a second hash is
+ * searched that moves all names of the bucket to still unused slots.
+ */
+class SymbolicNameHash
+{
+public:
+    SymbolicNameHash(const char* const *names, uint64_t numNames);
+
+    // returns a pointer to the index of 'name' in the name list, or nullptr if 'name' is not in the list
+    const uint16_t* at(const char* name) const { return at(name, strlen(name)); }
+    const uint16_t* at(const char* name, uint64_t length) const
+    {
+        uint64_t h = hash(name, length, 0);
+        uint64_t slot = hash(name, length, seeds[h % seeds.size()]) % ids.size();
+        return (lengths[slot] == length && memcmp(names[ids[slot]], name, length) == 0) ? &ids[slot] : nullptr;
+    }
+
+private:
+    static uint64_t hash(const char* s, uint64_t length, uint32_t seed)
+    {
+        uint64_t h = 0xCBF29CE484222325ull ^ (seed * 0x9E3779B97F4A7C15ull);  //FNV-1a
+        for (uint64_t i = 0; i < length; i++)
+            h = (h ^ (uint8_t)s[i]) * 0x100000001B3ull;
+        return h ^ (h >> 29);
+    }
+
+private:
+    const char* const *names;
+    std::vector<uint32_t> seeds;    //per bucket
+    std::vector<uint16_t> ids;      //per slot: index into 'names'
+    std::vector<uint32_t> lengths;  //per slot: strlen() of that name
+};
+
+/* The class SymbolicNameTable is the list of names (tag keys and values) that RawTags stores
+ * as (varUint) indices into the list instead of as strings. So the first 128 names take a
+ * single byte, and the others two bytes.
+ * coordsCreateStorage ranks the names of each dataset by frequency, and stores its list in
+ * the storage directory, from where all tools working on that storage have to load it
+ * (see loadSymbolicNames()). Until then, RawTags uses the built-in 'symbolicNames'.
+ *
+ * File layout:
+ *   char[8] magic ("COORDSSN"), uint32_t version, uint32_t numNames,
+ *   numNames zero-terminated names
+ */
+class SymbolicNameTable
+{
+public:
+    SymbolicNameTable(const char* const *names, uint64_t numNames);   //does not copy the names
+    SymbolicNameTable(const std::vector<std::string> &names);
+    SymbolicNameTable(const SymbolicNameTable &other) = delete;         //'names' may point into 'nameData'
+
+    const char* operator[](uint64_t idx) const { return names[idx]; }
+    const uint16_t* at(const char* name, uint64_t length) const { return hash.at(name, length); }
+    uint64_t size() const { return numNames; }
+
+    void store(const std::string &fileName) const;
+    // returns nullptr if 'fileName' does not exist
+    static SymbolicNameTable* load(const std::string &fileName);
+
+private:
+    std::vector<char> nameData;
+    std::vector<const char*> ownNames;
+    const char* const *names;
+    uint64_t numNames;
+    SymbolicNameHash hash;
+};
+
+static const char* const SYMBOLIC_NAMES_FILE_NAME = "symbolicNames.bin";
+
+// the table that RawTags currently uses
+const SymbolicNameTable& getSymbolicNames();
+/* makes RawTags use 'table' (and takes ownership of it). Has to be called before any
+ * tags are serialized or deserialized, as tags are only readable with the table that
+ * was used to write them */
+void useSymbolicNames(SymbolicNameTable *table);
+/* makes RawTags use the table stored in the storage directory 'directory'. Returns false
+ * (and keeps the current table) if there is none */
+bool loadSymbolicNames(const std::string &directory);
+/* for tile readers (e.g. the mapnik plugin): makes RawTags use the table that coordsCreateTiles
+ * stored next to the tile file 'tileFileName'. The table is only loaded again if the tile is in
+ * a different directory than the previous one, so this can be called for every tile that is 
+ * opened (but not while other threads decode tags). Returns false if there is no table.
+ * In mapnik plugin builds, decoding tags before a table has been loaded is an error, as
+ * decoding them with the built-in table would silently yield wrong names */
+bool loadSymbolicNamesForTile(const std::string &tileFileName);
 
 extern const char* symbolicNames[];
 extern const uint64_t numSymbolicNames;
-extern const RadixTree<uint8_t> symbolicNameId;
 
 #endif
-
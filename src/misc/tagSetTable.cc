@@ -0,0 +1,156 @@
+
+#include "misc/tagSetTable.h"
+#include "misc/varInt.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <string.h> //for memcmp()
+
+#include <memory>
+
+TagSetTable::TagSetTable() {}
+
+TagSetTable* TagSetTable::load(const std::string &fileName)
+{
+    FILE* f = fopen(fileName.c_str(), "rb");
+    if (!f)
+        return nullptr;
+
+    fseek(f, 0, SEEK_END);
+    uint64_t fileSize = ftell(f);
+    rewind(f);
+    std::vector<uint8_t> bytes(fileSize);
+    MUST( fileSize == 0 || fread(bytes.data(), fileSize, 1, f) == 1, "tag set file read error");
+    fclose(f);
+
+    TagSetTable *table = new TagSetTable();
+    for (uint64_t pos = 0; pos < fileSize; )
+    {
+        int nRead = 0;
+        uint64_t tagsSize = varUintFromBytes( bytes.data() + pos, &nRead) + nRead;
+        MUST( pos + tagsSize <= fileSize, "truncated tag set file");
+        table->add( bytes.data() + pos, tagsSize, hash(bytes.data() + pos, tagsSize));
+        pos += tagsSize;
+    }
+
+    return table;
+}
+
+void TagSetTable::store(const std::string &fileName) const
+{
+    FILE* f = fopen(fileName.c_str(), "wb");
+    MUST( f, "cannot create tag set file");
+    MUST( data.size() == 0 || fwrite( data.data(), data.size(), 1, f) == 1, "write error");
+    fclose(f);
+}
+
+uint64_t TagSetTable::deduplicate(uint8_t *entity, uint64_t size, uint64_t tagsSize)
+{
+    if (tagsSize > TAG_SET_MAX_SIZE)
+        return size;
+
+    const uint8_t *tags = entity + size - tagsSize;
+    uint64_t h = hash(tags, tagsSize);
+    int64_t id = find(tags, tagsSize, h);
+    if (id >= 0)
+        return writeReference(entity, size, tagsSize, id);
+
+    if (idsByHash.count(h)) //hash collision with a different tag set
+        return size;
+
+    if (seenOnce.size() == 0)
+        seenOnce.resize( TAG_SET_CANDIDATE_SLOTS, 0);
+
+    uint64_t &slot = seenOnce[ h % seenOnce.size()];
+    if (slot != h || offsets.size() >= TAG_SET_MAX_ENTRIES)
+    {
+        slot = h;   //first time seen (as far as the lossy table can tell)
+        return size;
+    }
+
+    /* the reference must be shorter than the tags themselves (which is not the case for
+     * the smallest tag sets once the ids get bigger) */
+    if (1 + (uint64_t)varUintNumBytes( offsets.size()) >= tagsSize)
+        return size;
+
+    slot = 0;
+    add(tags, tagsSize, h);
+    return writeReference(entity, size, tagsSize, offsets.size() - 1);
+}
+
+uint64_t TagSetTable::replaceByReference(uint8_t *entity, uint64_t size, uint64_t tagsSize) const
+{
+    if (tagsSize > TAG_SET_MAX_SIZE)
+        return size;
+
+    const uint8_t *tags = entity + size - tagsSize;
+    int64_t id = find(tags, tagsSize, hash(tags, tagsSize));
+    return id >= 0 ? writeReference(entity, size, tagsSize, id) : size;
+}
+
+uint64_t TagSetTable::hash(const uint8_t *tags, uint64_t tagsSize)
+{
+    uint64_t h = 0xCBF29CE484222325ull;  //FNV-1a
+    for (uint64_t i = 0; i < tagsSize; i++)
+        h = (h ^ tags[i]) * 0x100000001B3ull;
+    h ^= h >> 29;
+    return h ? h : 1;   //0 marks empty slots in 'seenOnce'
+}
+
+int64_t TagSetTable::find(const uint8_t *tags, uint64_t tagsSize, uint64_t hash) const
+{
+    std::unordered_map<uint64_t, uint32_t>::const_iterator it = idsByHash.find(hash);
+    if (it == idsByHash.end())
+        return -1;
+
+    /* tag sets are only added if their hash is not yet used (see deduplicate()). So a
+     * hash collision merely means that the second tag set is not deduplicated */
+    uint64_t id = it->second;
+    uint64_t end = (id + 1 < offsets.size()) ? offsets[id + 1] : data.size();
+    if (end - offsets[id] != tagsSize || memcmp( data.data() + offsets[id], tags, tagsSize) != 0)
+        return -1;
+
+    return id;
+}
+
+void TagSetTable::add(const uint8_t *tags, uint64_t tagsSize, uint64_t hash)
+{
+    offsets.push_back( data.size());
+    data.insert( data.end(), tags, tags + tagsSize);
+    idsByHash.insert( std::make_pair(hash, offsets.size() - 1));
+}
+
+uint64_t TagSetTable::writeReference(uint8_t *entity, uint64_t size, uint64_t tagsSize, uint64_t id)
+{
+    uint8_t *pos = entity + size - tagsSize;
+    pos[0] = 0;
+    uint64_t referenceSize = 1 + varUintToBytes(id, pos + 1);
+    MUST( referenceSize < tagsSize, "tag set reference overflow");
+    return size - tagsSize + referenceSize;
+}
+
+static std::unique_ptr<TagSetTable> activeTagSets( new TagSetTable());
+
+const TagSetTable& getTagSets()
+{
+    return *activeTagSets;
+}
+
+void useTagSets(TagSetTable *table)
+{
+    activeTagSets.reset(table);
+}
+
+bool loadTagSets(const std::string &directory)
+{
+    std::string path = directory;
+    if (path.length() && path.back() != '/' && path.back() != '\\')
+        path += "/";
+
+    TagSetTable *table = TagSetTable::load( path + TAG_SETS_FILE_NAME);
+    if (!table)
+        return false;
+
+    useTagSets(table);
+    return true;
+}
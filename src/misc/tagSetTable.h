@@ -0,0 +1,71 @@
+#ifndef TAG_SET_TABLE_H
+#define TAG_SET_TABLE_H
+
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* The class TagSetTable stores the tag sets (serialized as RawTags) that are shared by many
+ * entities (e.g. 'building=yes', 'highway=crossing'), so that each of these entities only
+ * has to store a reference to the shared tag set instead of the tag set itself.
+ * A reference is a serialized tag set with a size field of 0 (which no actual tag set has,
+ * as even an empty one stores its number of tags), followed by the varUint id of the tag set
+ * in this table. RawTags resolves references transparently, using the table that has been
+ * loaded with loadTagSets().
+ *
+ * While creating a storage, a tag set is added to the table when it is seen for the second
+ * time. To keep the memory footprint bounded, the tag sets that have been seen only once are
+ * remembered by hash in a fixed-size (lossy) table of TAG_SET_CANDIDATE_SLOTS entries, and
+ * only small tag sets (of at most TAG_SET_MAX_SIZE bytes) are considered at all.
+ *
+ * File layout: the serialized tag sets (each including its size field), in the order of their ids
+ */
+class TagSetTable
+{
+public:
+    TagSetTable();
+    TagSetTable(const TagSetTable &other) = delete;
+
+    // returns nullptr if 'fileName' does not exist
+    static TagSetTable* load(const std::string &fileName);
+    void store(const std::string &fileName) const;
+
+    /* 'entity' is a serialized entity of 'size' bytes, whose last 'tagsSize' bytes are its
+     * serialized tags. If these tags are in the table (or have been seen before, and are added
+     * now), they are replaced in place by a (shorter) reference. Returns the new size of the entity */
+    uint64_t deduplicate(uint8_t *entity, uint64_t size, uint64_t tagsSize);
+    // the same, but only replaces tags that are already in the table
+    uint64_t replaceByReference(uint8_t *entity, uint64_t size, uint64_t tagsSize) const;
+
+    // the serialized tag set 'id' (including its size field)
+    const uint8_t* operator[](uint64_t id) const { return data.data() + offsets[id]; }
+    uint64_t size() const { return offsets.size(); }
+
+private:
+    static uint64_t hash(const uint8_t *tags, uint64_t tagsSize);
+    // returns the id of the given tag set, or -1 if it is not in the table
+    int64_t  find(const uint8_t *tags, uint64_t tagsSize, uint64_t hash) const;
+    void     add(const uint8_t *tags, uint64_t tagsSize, uint64_t hash);
+    static uint64_t writeReference(uint8_t *entity, uint64_t size, uint64_t tagsSize, uint64_t id);
+
+private:
+    std::vector<uint8_t>  data;
+    std::vector<uint64_t> offsets;  //per tag set: its position in 'data'
+    std::unordered_map<uint64_t, uint32_t> idsByHash;
+    std::vector<uint64_t> seenOnce; //hashes of tag sets that have been seen once
+};
+
+static const char* const TAG_SETS_FILE_NAME = "tagSets.data";
+
+// the table that RawTags uses to resolve references to tag sets (initially an empty one)
+const TagSetTable& getTagSets();
+/* makes RawTags use 'table' (and takes ownership of it). Has to be called before any
+ * tags are deserialized, and not while other threads use RawTags */
+void useTagSets(TagSetTable *table);
+/* makes RawTags use the table stored in the storage directory 'directory'. Returns false
+ * (and keeps the current table) if there is none */
+bool loadTagSets(const std::string &directory);
+
+#endif
@@ -5,346 +5,939 @@
 #include <arpa/inet.h>  //for ntohl
 #include <assert.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <string.h> //for memcpy()
 #include <zlib.h>
 
+#ifdef COORDS_HAVE_LZ4
+    #include <lz4.h>
+#endif
+
+#ifdef COORDS_HAVE_ZSTD
+    #include <zstd.h>
+#endif
+
+#include <condition_variable>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <omp.h>
 
 #include "config.h"
 #include "osm/osmTypes.h"
 #include "osm/osmParserPbf.h"
-#include "consumers/osmConsumerCounter.h"
+#include "osm/protobufReader.h"
+#include "consumers/osmConsumerBuffer.h"
+#include "containers/blockingQueue.h"
+
+#include "osmformat.pb.h"
 
 using namespace std;
 
-namespace OSMPBF {
-static const int max_uncompressed_blob_size = 32 * (1 << 20);
-}
+/* size of the range ahead of the current read position of a memory-mapped 
+ * input file that is advised to the kernel as being needed soon. */
+static const uint64_t READAHEAD_WINDOW_SIZE = 256 * (1 << 20);
 
-StringTable::StringTable(const google::protobuf::RepeatedPtrField<string>& src)
+StringTable::StringTable(const uint8_t *data, uint64_t size): data((const char*)data), dataSize(size)
 {
-    table.reserve( src.size());
-    for ( const string &s : src)
-        table.push_back(s);
+    ProtobufReader stringTable(data, size);
+    while (stringTable.nextField())
+    {
+        if (stringTable.getFieldNumber() != 1)  //not a string table entry 's'
+        {
+            stringTable.skip();
+            continue;
+        }
+        const uint8_t *data;
+        uint64_t length;
+        stringTable.readBytes(data, length);
+        table.push_back( (PbfString){.data = (const char*)data, .length = (uint32_t)length});
+    }
 }
     
-const string& StringTable::operator[](uint32_t idx) const
+const PbfString& StringTable::operator[](uint32_t idx) const
 {
     MUST( idx < table.size(), "range overflow");
     return table[idx];
 }
 
 
-OsmParserPbf::OsmParserPbf(FILE * file, OsmBaseConsumer *consumer): 
-    f(file), fileSize(0), consumer(consumer)
+OsmParserPbf::OsmParserPbf(FILE * file, OsmBaseConsumer *consumer, uint32_t numThreads): 
+    f(file), fileSize(0), consumer(consumer), numThreads(numThreads),
+    hasBlobSelection(false), nextSelectedBlob(0), nextReadAheadBlob(0), entityFilter(PARSE_ALL)
 {
+    MUST(numThreads > 0, "invalid number of parser threads");
     unpackBuffer = new uint8_t[OSMPBF::max_uncompressed_blob_size];  
     
     fseek(f, 0, SEEK_END);
     fileSize = ftell(f);
     rewind(f);
+
+    /* Map the whole input file, so that blob headers and compressed blob data can be
+     * decoded in place. If that is not possible (e.g. because the input is a pipe), fall 
+     * back to reading the file through fread().*/
+    inputMap = nullptr;
+    inputPos = readaheadPos = releasedPos = 0;
+    struct stat st;
+    if (fileSize > 0 && fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode))
+    {
+        void* ptr = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+        if (ptr != MAP_FAILED)
+        {
+            inputMap = (const uint8_t*)ptr;
+            madvise( ptr, fileSize, MADV_SEQUENTIAL);
+        }
+    }
 }
 
 OsmParserPbf::~OsmParserPbf() {
     delete [] unpackBuffer;
+    if (inputMap)
+        munmap( (void*)inputMap, fileSize);
     //    google::protobuf::ShutdownProtobufLibrary();  //only necessary to satisfy valgrind
 
 }
 
 
-void OsmParserPbf::unpackBlob( const OSMPBF::Blob &blob, FILE* /*fIn*/, uint8_t *unpackBufferOut, uint32_t &unpackedSizeOut)
+void OsmParserPbf::unpackBlob( const RawBlob &rawBlob, uint8_t *unpackBufferOut, uint32_t &unpackedSizeOut)
 {
-    if (blob.has_zlib_data())
+    /* Decode the Blob message directly from its wire format. Using OSMPBF::Blob
+     * instead would copy the (potentially multi-megabyte) compressed data into a
+     * std::string before inflating it. */
+    const uint8_t *data = nullptr;
+    uint64_t dataSize = 0;
+    uint32_t dataField = 0; //the field number of the (compressed) data
+    int64_t rawSize = -1;
+    
+    ProtobufReader blob(rawBlob.data, rawBlob.size);
+    while (blob.nextField())
+        switch (blob.getFieldNumber())
+        {
+            case 2: rawSize = blob.readVarUint(); break;    //raw_size
+            case 1:     //raw
+            case 3:     //zlib_data
+            case 4:     //lzma_data
+            case 5:     //OBSOLETE_bzip2_data
+            case 6:     //lz4_data
+            case 7:     //zstd_data
+                MUST( dataField == 0, "blob contains more than one data field");
+                dataField = blob.getFieldNumber();
+                blob.readBytes(data, dataSize); 
+                break;
+            default: blob.skip(); break;
+        }
+
+    MUST( rawSize <= OSMPBF::max_uncompressed_blob_size, "blob too large");
+    switch (dataField)
     {
-            // zlib information
-        z_stream z;
-        z.next_in = (unsigned char*) blob.zlib_data().c_str(), // next byte to decompress
-        z.avail_in  = blob.zlib_data().size(),  // number of bytes to decompress
-        z.next_out  = (unsigned char*) unpackBufferOut, // place of next decompressed byte
-        z.avail_out = OSMPBF::max_uncompressed_blob_size,     // space for decompressed data
-        z.zalloc    = Z_NULL,
-        z.zfree     = Z_NULL,
-        z.opaque    = Z_NULL;
-
-        MUST(inflateInit(&z) == Z_OK,  "failed to init zlib stream");
-        MUST(inflate(&z, Z_FINISH) == Z_STREAM_END, "failed to inflate zlib stream");
-        MUST(inflateEnd(&z) == Z_OK, "failed to deinit zlib stream");
-
-        unpackedSizeOut = z.total_out;
-        return;
-    };
+        case 0: MUST(false, "blob contains no data"); break;
+        case 1:
+            MUST( dataSize <= (uint64_t)OSMPBF::max_uncompressed_blob_size, "blob too large");
+            memcpy(unpackBufferOut, data, dataSize);
+            unpackedSizeOut = dataSize;
+            break;
+        case 3:
+        {
+                // zlib information
+            z_stream z;
+            z.next_in = (unsigned char*) data, // next byte to decompress
+            z.avail_in  = dataSize,  // number of bytes to decompress
+            z.next_out  = (unsigned char*) unpackBufferOut, // place of next decompressed byte
+            z.avail_out = OSMPBF::max_uncompressed_blob_size,     // space for decompressed data
+            z.zalloc    = Z_NULL,
+            z.zfree     = Z_NULL,
+            z.opaque    = Z_NULL;
+
+            MUST(inflateInit(&z) == Z_OK,  "failed to init zlib stream");
+            MUST(inflate(&z, Z_FINISH) == Z_STREAM_END, "failed to inflate zlib stream");
+            MUST(inflateEnd(&z) == Z_OK, "failed to deinit zlib stream");
+
+            unpackedSizeOut = z.total_out;
+            break;
+        }
+        case 6:
+        {
+#ifdef COORDS_HAVE_LZ4
+            /* lz4_data is a single LZ4 block (not an LZ4 frame), which does not store its 
+             * decompressed size. So 'raw_size' is required here. */
+            MUST( rawSize >= 0, "lz4-compressed blob without raw_size");
+            int res = LZ4_decompress_safe( (const char*)data, (char*)unpackBufferOut, 
+                                           dataSize, rawSize);
+            MUST( res >= 0, "failed to decompress lz4 blob");
+            unpackedSizeOut = res;
+#else
+            MUST(false, "lz4-compressed blobs are not supported by this build");
+#endif
+            break;
+        }
+        case 7:
+        {
+#ifdef COORDS_HAVE_ZSTD
+            size_t res = ZSTD_decompress( unpackBufferOut, OSMPBF::max_uncompressed_blob_size,
+                                          data, dataSize);
+            MUST( !ZSTD_isError(res), "failed to decompress zstd blob");
+            unpackedSizeOut = res;
+#else
+            MUST(false, "zstd-compressed blobs are not supported by this build");
+#endif
+            break;
+        }
+        /* could not yet be written and tested as no known tools exist that actually write
+         * blobs in these formats. */
+        default: MUST(false, "unimplemented"); break;
+    }
+    
+    MUST(rawSize < 0 || unpackedSizeOut == rawSize, "blob size mismatch");
+}
 
-    /* could not yet be written and tested as no known tools exist that actually write
-     * blobs uncompressed, or in any compression format other than DEFLATE (->zlib). */
-    MUST(false, "unimplemented");
+void OsmParserPbf::restrictTo(const std::vector<PbfBlobInfo> &blobs, uint8_t entityFilter)
+{
+    for (uint64_t i = 1; i < blobs.size(); i++)
+        MUST( blobs[i-1].offset < blobs[i].offset, "blob list is not sorted by file offset");
+
+    this->hasBlobSelection = true;
+    this->selectedBlobs = blobs;
+    this->nextSelectedBlob = 0;
+    this->nextReadAheadBlob = 0;
+    this->entityFilter = entityFilter;
 }
 
-string OsmParserPbf::prepareBlob(uint8_t *unpackBuffer, uint32_t &dataSizeOut)
+bool OsmParserPbf::readRawBlob(RawBlob &blobOut)
 {
-    OSMPBF::BlobHeader header;    
-    OSMPBF::Blob blob;
+    if (hasBlobSelection)
+    {
+        if (nextSelectedBlob == selectedBlobs.size())
+            return false;
+
+        uint64_t offset = selectedBlobs[nextSelectedBlob++].offset;
+        MUST( offset < fileSize, "blob offset beyond end of file");
+        if (inputMap)
+        {
+            inputPos = offset;
+            readAheadSelectedBlobs(offset);
+        }
+        else
+            MUST( fseeko(f, offset, SEEK_SET) == 0, "cannot seek to blob");
+    }
+
+    if (inputMap)
+        return readRawBlobFromMap(blobOut);
+        
+    int ch = fgetc(f);
+    if (ch == EOF)
+        return false;
+    ungetc(ch, f);
+
+    OSMPBF::BlobHeader header;
+    blobOut.filePos = ftello(f);
 
     uint32_t size;
     MUST(fread(&size, sizeof(size), 1, f) == 1, "could not read size indicator");
     size = ntohl(size);
 
-    MUST(size <= (1 << 15), "blob header too big");
-    MUST(fread(unpackBuffer, size, 1, f) == 1, "fread failed");
-    MUST( header.ParseFromArray(unpackBuffer, size), "Failed to parse BlobHeader");
-    //delete [] headerBuffer;
+    MUST(size <= OSMPBF::max_blob_header_size, "blob header too big");
+    uint8_t headerBuffer[OSMPBF::max_blob_header_size];
+    MUST(fread(headerBuffer, size, 1, f) == 1, "fread failed");
+    MUST( header.ParseFromArray(headerBuffer, size), "Failed to parse BlobHeader");
 
     size = header.datasize();
     MUST(size <= OSMPBF::max_uncompressed_blob_size, "blob header bigger than allowed 32 MiB" );    
     //cout<< "blob header for block type '" << header.type() << "' with raw size " << size << endl;
-    
-    MUST(fread(unpackBuffer, size, 1, f) == 1, "fread failed");
-    MUST( blob.ParseFromArray(unpackBuffer, size), "could not parse blob");
 
-    /*if (blob.has_raw())
-        cout << " contains raw data";
-    if (blob.has_raw_size())
-        cout << " contains compressed data, " << blob.zlib_data().size() << "-> "<<  blob.raw_size() << " bytes";*/
-        
-    cout << "\e[K" << endl;
+    blobOut.type = header.type();
+    blobOut.buffer.resize(size);
+    MUST(fread(blobOut.buffer.data(), size, 1, f) == 1, "fread failed");
+    blobOut.data = blobOut.buffer.data();
+    blobOut.size = size;
+    return true;
+}
+
+bool OsmParserPbf::readRawBlobFromMap(RawBlob &blobOut)
+{
+    if (inputPos == fileSize)
+        return false;
 
-    unpackBlob(/*ref*/blob, f, unpackBuffer, /*ref*/dataSizeOut);
-    assert(dataSizeOut == (uint32_t)blob.raw_size());
-    return header.type();
+    MUST( inputPos + sizeof(uint32_t) <= fileSize, "could not read size indicator");
+    blobOut.filePos = inputPos;
+
+    uint32_t headerSize;
+    memcpy(&headerSize, inputMap + inputPos, sizeof(headerSize));
+    headerSize = ntohl(headerSize);
+    inputPos += sizeof(headerSize);
+    
+    MUST(headerSize <= OSMPBF::max_blob_header_size, "blob header too big");
+    MUST(inputPos + headerSize <= fileSize, "truncated blob header");
+    
+    //decode BlobHeader in place
+    bool hasType = false;
+    int64_t size = -1;
+    ProtobufReader header(inputMap + inputPos, headerSize);
+    while (header.nextField())
+        switch (header.getFieldNumber())
+        {
+            case 1: //type
+            {
+                const uint8_t* type;
+                uint64_t typeLength;
+                header.readBytes(type, typeLength);
+                blobOut.type.assign( (const char*)type, typeLength);
+                hasType = true;
+                break;
+            }
+            case 3: size = header.readVarUint(); break; //datasize
+            default: header.skip(); break;
+        }
+    MUST( hasType && size >= 0, "Failed to parse BlobHeader");
+    inputPos += headerSize;
 
+    MUST(size <= OSMPBF::max_uncompressed_blob_size, "blob header bigger than allowed 32 MiB" );    
+    MUST(inputPos + size <= fileSize, "truncated blob");
+    blobOut.data = inputMap + inputPos;
+    blobOut.size = size;
+    inputPos += size;
+
+    /* keep the kernel reading ahead of the current position. Advising only whenever
+     * half of the window has been used up keeps the number of madvise() calls low. 
+     * With a blob selection, only the selected blobs are read ahead (in readRawBlob()) */
+    if (!hasBlobSelection && readaheadPos < fileSize && inputPos + READAHEAD_WINDOW_SIZE / 2 > readaheadPos)
+    {
+        uint64_t pageSize = sysconf(_SC_PAGESIZE);
+        uint64_t from = max(readaheadPos, blobOut.filePos) / pageSize * pageSize;
+        uint64_t to   = min(inputPos + READAHEAD_WINDOW_SIZE, fileSize);
+        madvise( (void*)(inputMap + from), to - from, MADV_WILLNEED);
+        readaheadPos = to;
+    }
+    return true;
 }
 
-void OsmParserPbf::parseDenseNodes( const OSMPBF::DenseNodes &nodes, const StringTable &stringTable, int32_t granularity, int64_t lat_offset, int64_t lon_offset)
+/* the blob selection counterpart of the readahead in readRawBlobFromMap(): advises the kernel
+ * to read the selected blobs that start less than READAHEAD_WINDOW_SIZE bytes after 'filePos'
+ * (and that have not been advised before). Adjacent blobs are advised in a single call. */
+void OsmParserPbf::readAheadSelectedBlobs(uint64_t filePos)
 {
-    //cout << "\t\t\tcontain " << (nodes.has_denseinfo() ? "":"NO ") << "DenseInfo block" << endl;
-    int64_t numNodes = nodes.id().size();
-    //cout << "\t\t\tcontain " << numNodes << " nodes" << endl;
-    //cout << "\t\t\tgot passed gran/dLat/dLng:" << granularity << "/" << lat_offset << "/" << lon_offset << endl;
-    MUST( nodes.lat().size() == numNodes, "property count mismatch"); 
-    MUST( nodes.lon().size() == numNodes, "property count mismatch"); 
-
-    bool hasDenseInfo = nodes.has_denseinfo();    
-    bool containsVisibilityInformation = nodes.denseinfo().visible().size();
-    
-    if (nodes.has_denseinfo())
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t from = 0, to = 0;
+    for (; nextReadAheadBlob < selectedBlobs.size(); nextReadAheadBlob++)
     {
-        MUST( nodes.denseinfo().version().size() == numNodes, "property count mismatch"); 
-        MUST( nodes.denseinfo().timestamp().size() == numNodes, "property count mismatch"); 
-        MUST( nodes.denseinfo().changeset().size() == numNodes, "property count mismatch"); 
-        MUST( nodes.denseinfo().uid().size() == numNodes, "property count mismatch"); 
-        MUST( nodes.denseinfo().user_sid().size() == numNodes, "property count mismatch"); 
-        MUST( nodes.denseinfo().user_sid().size() == numNodes, "property count mismatch"); 
-        MUST( (!containsVisibilityInformation) ||
-              nodes.denseinfo().visible().size() == numNodes, "property count mismatch"); 
+        const PbfBlobInfo &blob = selectedBlobs[nextReadAheadBlob];
+        if (blob.offset >= filePos + READAHEAD_WINDOW_SIZE)
+            break;
+
+        if (blob.offset > to)   //not adjacent to the previous blob
+        {
+            if (to > from)
+                madvise( (void*)(inputMap + from), to - from, MADV_WILLNEED);
+            from = blob.offset / pageSize * pageSize;
+        }
+        to = min(blob.offset + blob.size, fileSize);
     }
     
-    MUST(hasDenseInfo, "parsing under absence of denseinfo not implemented");
-    int64_t prevId = 0;
-    int64_t prevLat= 0;
-    int64_t prevLon= 0;
-    int64_t keyValPos = 0;
-/*    int64_t prevTimeStamp=0;
-    int64_t prevChangeset=0;
-    int32_t prevUid = 0;
-    int32_t prevUsid = 0;*/
-    for (int i = 0; i < numNodes; i++)
-    {
-        int64_t id =     prevId +  nodes.id().Get(i);
-        int64_t latRaw = prevLat + nodes.lat().Get(i);
-        int64_t lonRaw = prevLon + nodes.lon().Get(i);
-        int32_t version= nodes.denseinfo().version().Get(i);
-/*        int64_t timeStamp= prevTimeStamp+ nodes.denseinfo().timestamp().Get(i);
-        int64_t changeset= prevChangeset+ nodes.denseinfo().changeset().Get(i);
-        int32_t uid      = prevUid      + nodes.denseinfo().uid().Get(i);
-        int32_t usid     = prevUsid     + nodes.denseinfo().user_sid().Get(i);
-        bool    visible  = (!containsVisibilityInformation) || nodes.denseinfo().visible().Get(i);*/
+    if (to > from)
+        madvise( (void*)(inputMap + from), to - from, MADV_WILLNEED);
+}
+
+/* signals that 'blob' has been fully decoded, so that the kernel may drop the pages of
+ * the input file up to that blob. As the input map is read-only, this is merely a hint: 
+ * should the pages be accessed again, they are transparently re-read from the file. 
+ * With a blob selection, only the pages of the blob itself are released, since the blobs
+ * in between have never been read. */
+void OsmParserPbf::releaseRawBlob(const RawBlob &blob)
+{
+    if (!inputMap)
+        return;
         
-        //cout << "lat/lng:" << latRaw << "/" << lonRaw << endl;
-        OsmNode node( (int32_t)(latRaw * granularity/100 + lat_offset), (int32_t)(lonRaw * granularity/100 + lon_offset), id, version);
+    uint64_t pageSize = sysconf(_SC_PAGESIZE);
+    uint64_t blobEnd = (blob.data - inputMap) + blob.size;
+    uint64_t to = blobEnd / pageSize * pageSize;    //do not release the page shared with the next blob
+    uint64_t from = releasedPos;
+    if (hasBlobSelection)   //nor the one shared with the previous blob
+        from = max(from, (blob.filePos + pageSize - 1) / pageSize * pageSize);
+    if (to <= from)
+        return;
         
-        /*edge case: if no node in block contains any tags, there are no delimiters,
-         *           but instead the array is simply empty.*/
-        if (nodes.keys_vals().size() > 0)   
+    madvise( (void*)(inputMap + from), to - from, MADV_DONTNEED);
+    releasedPos = to;
+}
+
+/* inflates and decodes a single raw blob, and passes all entities it contains
+ * on to 'target' (in the order in which they are stored in the blob). */
+void OsmParserPbf::decodeBlob(const RawBlob &rawBlob, uint8_t *unpackBuffer, OsmBaseConsumer *target, uint8_t entityFilter)
+{
+    uint32_t size;
+    unpackBlob(rawBlob, unpackBuffer, /*ref*/size);
+
+    if ( rawBlob.type == "OSMHeader")
+    {    
+        //cout << "parsing headerBlock" << endl;
+        OSMPBF::HeaderBlock headerBlock;
+        MUST( headerBlock.ParseFromArray(unpackBuffer, size), "failed to parse HeaderBlock");
+        /*for (string s: headerBlock.required_features())
+            cout << "\trequires feature '" << s << "'" << endl;
+
+        for (string s: headerBlock.optional_features())
+            cout << "\thas optional feature " << s << "'" << endl;
+            
+        cout << "\twritten by '" << headerBlock.writingprogram() << "'" << endl;*/
+        return;
+    }
+
+    MUST( rawBlob.type == "OSMData", "invalid header type");
+
+    /* The PrimitiveBlock is decoded directly from its wire format. The string table is
+     * kept as views into the unpack buffer, and the groups are walked in place. Since 
+     * protobuf does not guarantee any field order, the block is scanned twice: first for
+     * its string table and coordinate parameters, then for its primitive groups. */
+    ProtobufReader block(unpackBuffer, size);
+    const uint8_t *stringTableData = nullptr;
+    uint64_t stringTableSize = 0;
+    bool hasStringTable = false;
+    int32_t granularity = 100;
+    int64_t lat_offset = 0;
+    int64_t lon_offset = 0;
+    //int32_t date_granularity = 1000;
+    while (block.nextField())
+        switch (block.getFieldNumber())
         {
-            while ( nodes.keys_vals().Get(keyValPos) != 0)
-            { 
-                MUST(keyValPos+1 < nodes.keys_vals().size(), "overflow in key/val id list");
-                int32_t sid = nodes.keys_vals().Get(keyValPos);
-                const string &key = stringTable[sid];
-                sid = nodes.keys_vals().Get(keyValPos+1);
-                MUST(sid != 0, "key without value");
-                const string &value = stringTable[sid];
-                keyValPos += 2;
-                node.tags.push_back(make_pair(key, value));
-                
+            case 1: block.readBytes(stringTableData, stringTableSize); hasStringTable = true; break;
+            case 17: granularity = block.readVarUint(); break;
+            case 19: lat_offset  = block.readVarUint(); break;
+            case 20: lon_offset  = block.readVarUint(); break;
+            default: block.skip(); break;
+        }
+    MUST( hasStringTable, "failed to parse PrimBlock");
+    StringTable strings(stringTableData, stringTableSize);
+
+    block = ProtobufReader(unpackBuffer, size);
+    while (block.nextField())
+    {
+        if (block.getFieldNumber() != 2)   //not a 'primitivegroup'
+        {
+            block.skip();
+            continue;
+        }
+        ProtobufReader primGroup = block.readMessage();
+
+        /* NOTE: more than one of these may be present in a given primitive group. They are
+         *       passed on to the consumer in the order dense nodes, ways, relations. */
+        ProtobufReader group = primGroup;
+        while (group.nextField())
+            switch (group.getFieldNumber())
+            {
+                case 1: MUST(false, "NOT IMPLEMENTED"); break;  //nodes
+                case 5: MUST(false, "NOT IMPLEMENTED"); break;  //changesets
+                case 2: 
+                    if (entityFilter & PARSE_NODES)
+                        parseDenseNodes( group.readMessage(), strings, granularity, lat_offset, lon_offset, target);
+                    else
+                        group.skip();
+                    break;
+                default: group.skip(); break;
             }
-            keyValPos ++;   //already observed the "end-of-key-value-list" marker, now step beyond it   
-        }        
-        consumer->consumeNode(node);
-        //cout << "\t\t\t" << node << endl; 
+
+        if (entityFilter & PARSE_WAYS)
+        {
+            group = primGroup;
+            while (group.nextField())
+                if (group.getFieldNumber() == 3)
+                    parseWay( group.readMessage(), strings, target);
+                else
+                    group.skip();
+        }
+
+        if (entityFilter & PARSE_RELATIONS)
+        {
+            group = primGroup;
+            while (group.nextField())
+                if (group.getFieldNumber() == 4)
+                    parseRelation( group.readMessage(), strings, target);
+                else
+                    group.skip();
+        }
+    }
+}
+
+/* counts the entities in a serialized PrimitiveBlock by only walking its wire format.
+ * This is much cheaper than fully decoding the block. */
+void OsmParserPbf::countEntities( const uint8_t *primitiveBlock, uint32_t size, PbfBlobInfo &infoOut)
+{
+    ProtobufReader block(primitiveBlock, size);
+    while (block.nextField())
+    {
+        if (block.getFieldNumber() != 2)   //not a 'primitivegroup'
+        {
+            block.skip();
+            continue;
+        }
         
-        prevId = id, prevLat = latRaw, prevLon = lonRaw/*, prevTimeStamp = timeStamp, 
-        prevChangeset = changeset,prevUid = uid, prevUsid = usid*/;
+        ProtobufReader group = block.readMessage();
+        while (group.nextField())
+            switch (group.getFieldNumber())
+            {
+                case 1: infoOut.numNodes++; group.skip(); break;
+                case 2:     //DenseNodes: count the entries of its packed 'id' array
+                {
+                    ProtobufReader dense = group.readMessage();
+                    while (dense.nextField())
+                    {
+                        if (dense.getFieldNumber() != 1)
+                        {
+                            dense.skip();
+                            continue;
+                        }
+                        const uint8_t *ids;
+                        uint64_t numBytes;
+                        dense.readBytes(ids, numBytes);
+                        //each varint ends with the only one of its bytes that has the MSB cleared
+                        for (uint64_t i = 0; i < numBytes; i++)
+                            infoOut.numNodes += (ids[i] & 0x80) == 0;
+                    }
+                    break;
+                }
+                case 3: infoOut.numWays++; group.skip(); break;
+                case 4: infoOut.numRelations++; group.skip(); break;
+                default: group.skip(); break;
+            }
     }
-    assert (keyValPos == nodes.keys_vals().size() && "extraneous key/value pair(s)");
 }
 
-void OsmParserPbf::parseWays(const google::protobuf::RepeatedPtrField<OSMPBF::Way> &ways, const StringTable &stringTable)
+std::vector<PbfBlobInfo> OsmParserPbf::scanBlobs()
 {
-//    cout << "\t\tprimitiveGroup contains " << ways.size() << " ways" << endl;    
-    for (const OSMPBF::Way &way : ways)
+    /* always scan the whole file, irrespective of any blob selection. The selection itself
+     * is restored afterwards */
+    bool oldHasBlobSelection = hasBlobSelection;
+    hasBlobSelection = false;
+    inputPos = 0;
+    if (!inputMap)
+        rewind(f);
+
+    std::vector<PbfBlobInfo> res;
+    std::vector<uint8_t*> unpackBuffers(numThreads);
+    for (uint8_t* &buffer : unpackBuffers)
+        buffer = new uint8_t[OSMPBF::max_uncompressed_blob_size];
+    
+    /* read blobs sequentially in batches, and inflate and inspect each batch in parallel */
+    const uint64_t batchSize = 4 * numThreads;
+    std::vector<RawBlob> batch(batchSize);
+    bool moreBlobs = true;
+    while (moreBlobs)
     {
-        MUST( way.keys().size()== way.vals().size(), "extraneous key or value");
-        int32_t version = way.has_info() && way.info().has_version() ? 
-            way.info().version() : 1;
-        OsmWay osmWay(way.id(), version);
-
-        //osmWay.tags.reserve( way.keys().size());        
-        for (int i = 0; i < way.keys().size(); i++)
-            osmWay.tags.push_back( make_pair( stringTable[way.keys().Get(i)], stringTable[way.vals().Get(i)] ));
-            
+        uint64_t numInBatch = 0;
+        while (numInBatch < batchSize && (moreBlobs = readRawBlob(batch[numInBatch])))
+        {
+            RawBlob &blob = batch[numInBatch++];
+            uint64_t endPos = inputMap ? inputPos : ftello(f);
+            PbfBlobInfo info = {blob.filePos, (uint32_t)(endPos - blob.filePos), 0, 0, 0, 0, 0};
+            if (blob.type == "OSMHeader")
+                info.flags |= PbfBlobInfo::IS_HEADER_BLOB;
+            else
+                MUST( blob.type == "OSMData", "invalid header type");
+            res.push_back(info);
+        }
+        
+        PbfBlobInfo *infos = res.data() + res.size() - numInBatch;
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(numThreads)
+        for (uint64_t i = 0; i < numInBatch; i++)
+        {
+            if (infos[i].flags & PbfBlobInfo::IS_HEADER_BLOB)
+                continue;
+                
+            uint8_t *unpackBuffer = unpackBuffers[omp_get_thread_num()];
+            uint32_t size;
+            unpackBlob(batch[i], unpackBuffer, size);
+            countEntities(unpackBuffer, size, infos[i]);
+        }
 
-        int64_t nodeId = 0;
-        //osmWay.refs.reserve( way.refs().size());
-        for (int64_t nodeIdRaw : way.refs())
+        if (numInBatch)
         {
-            nodeId += nodeIdRaw;
-            MUST(nodeId > 0, "invalid node id");
-            osmWay.refs.push_back( (OsmGeoPosition){.id = (uint64_t)nodeId,
-                                                    .lat= INVALID_LAT_LNG,
-                                                    .lng= INVALID_LAT_LNG} );
-        } 
+            printProgress(batch[numInBatch-1].filePos);
+            releaseRawBlob(batch[numInBatch-1]);
+        }
+    }
+
+    for (uint8_t* buffer : unpackBuffers)
+        delete [] buffer;
 
-        consumer->consumeWay(osmWay);
+    hasBlobSelection = oldHasBlobSelection;
+    inputPos = 0;
+    if (!inputMap)
+        rewind(f);
+    return res;
+}
 
-        //cout << osmWay << endl;
+std::vector<PbfBlobInfo> OsmParserPbf::listBlobs()
+{
+    //always list the whole file, irrespective of any blob selection (see scanBlobs())
+    bool oldHasBlobSelection = hasBlobSelection;
+    hasBlobSelection = false;
+    inputPos = 0;
+    if (!inputMap)
+        rewind(f);
+
+    /* only the headers are read, so there is no point in reading ahead the whole file */
+    uint64_t oldReadaheadPos = readaheadPos;
+    readaheadPos = fileSize;
+
+    std::vector<PbfBlobInfo> res;
+    RawBlob blob;
+    while (readRawBlob(blob))
+    {
+        uint64_t endPos = inputMap ? inputPos : ftello(f);
+        PbfBlobInfo info = {blob.filePos, (uint32_t)(endPos - blob.filePos), 0, 0, 0, 0, 0};
+        if (blob.type == "OSMHeader")
+            info.flags |= PbfBlobInfo::IS_HEADER_BLOB;
+        else
+            MUST( blob.type == "OSMData", "invalid header type");
+        res.push_back(info);
     }
+
+    readaheadPos = oldReadaheadPos;
+    hasBlobSelection = oldHasBlobSelection;
+    inputPos = 0;
+    if (!inputMap)
+        rewind(f);
+    return res;
+}
+
+/* DenseNodes store each node property as a separate packed array. These arrays are walked
+ * in lockstep by one ProtobufReader each, and decoded into a single OsmNodeBatch. Tags are
+ * not copied, but passed on as views into the block's string table. */
+void OsmParserPbf::parseDenseNodes( ProtobufReader nodes, const StringTable &stringTable, int32_t granularity, int64_t lat_offset, int64_t lon_offset, OsmBaseConsumer *target)
+{
+    ProtobufReader ids, lats, lons, keysVals, versions;
+    uint64_t numNodes = 0;
+    bool hasDenseInfo = false;
+    while (nodes.nextField())
+        switch (nodes.getFieldNumber())
+        {
+            case 1:
+            {
+                const uint8_t *idData;
+                uint64_t numBytes;
+                nodes.readBytes(idData, numBytes);
+                ids = ProtobufReader(idData, numBytes);
+                //each varint ends with the only one of its bytes that has the MSB cleared
+                for (uint64_t i = 0; i < numBytes; i++)
+                    numNodes += (idData[i] & 0x80) == 0;
+                break;
+            }
+            case 5: 
+            {
+                hasDenseInfo = true;
+                ProtobufReader denseInfo = nodes.readMessage();
+                while (denseInfo.nextField())
+                    if (denseInfo.getFieldNumber() == 1)
+                        versions = denseInfo.readMessage();
+                    else
+                        denseInfo.skip();
+                break;
+            }
+            case 8: lats = nodes.readMessage(); break;
+            case 9: lons = nodes.readMessage(); break;
+            case 10: keysVals = nodes.readMessage(); break;
+            default: nodes.skip(); break;
+        }
     
+    MUST(hasDenseInfo, "parsing under absence of denseinfo not implemented");
+
+    OsmNodeBatch batch;
+    batch.ids.reserve(numNodes);
+    batch.lats.reserve(numNodes);
+    batch.lngs.reserve(numNodes);
+    batch.versions.reserve(numNodes);
+    batch.tagsBegin.reserve(numNodes + 1);
+    batch.stringData = stringTable.getData();
+    batch.stringDataSize = stringTable.getDataSize();
+
+    /*edge case: if no node in block contains any tags, there are no delimiters,
+     *           but instead the array is simply empty.*/
+    bool hasKeysVals = !keysVals.atEnd();
+
+    int64_t id = 0;
+    int64_t latRaw = 0;
+    int64_t lonRaw = 0;
+    while (!ids.atEnd())
+    {
+        MUST( !lats.atEnd() && !lons.atEnd() && !versions.atEnd(), "property count mismatch");
+        id     += ProtobufReader::zigzagDecode( ids.readRawVarUint());
+        latRaw += ProtobufReader::zigzagDecode( lats.readRawVarUint());
+        lonRaw += ProtobufReader::zigzagDecode( lons.readRawVarUint());
+        
+        batch.ids.push_back(id);
+        batch.lats.push_back( (int32_t)(latRaw * granularity/100 + lat_offset));
+        batch.lngs.push_back( (int32_t)(lonRaw * granularity/100 + lon_offset));
+        batch.versions.push_back( versions.readRawVarUint());
+        
+        if (hasKeysVals)
+        {
+            uint32_t sid;
+            //readRawVarUint() fails on a missing "end-of-key-value-list" marker
+            while ( (sid = keysVals.readRawVarUint()) != 0)
+            { 
+                const PbfString &key = stringTable[sid];
+                MUST( !keysVals.atEnd(), "overflow in key/val id list");
+                sid = keysVals.readRawVarUint();
+                MUST(sid != 0, "key without value");
+                const PbfString &value = stringTable[sid];
+                batch.tagRefs.push_back( std::make_pair(
+                    (OsmNodeBatch::StringRef){ .offset = (uint32_t)(key.data   - batch.stringData), .length = key.length},
+                    (OsmNodeBatch::StringRef){ .offset = (uint32_t)(value.data - batch.stringData), .length = value.length}));
+            }
+        }
+        batch.tagsBegin.push_back( batch.tagRefs.size());
+    }
+    MUST( lats.atEnd() && lons.atEnd() && versions.atEnd(), "property count mismatch");
+    assert (keysVals.atEnd() && "extraneous key/value pair(s)");
+    
+    target->consumeNodeBatch(batch);
+}
+
+/* returns the 'version' of a serialized Info message, or 1 if it is absent */
+static int32_t getInfoVersion( ProtobufReader info)
+{
+    int32_t version = 1;
+    while (info.nextField())
+        if (info.getFieldNumber() == 1)
+            version = info.readVarUint();
+        else
+            info.skip();
+    return version;
 }
 
-void OsmParserPbf::parseRelations(const google::protobuf::RepeatedPtrField<OSMPBF::Relation> &rels, const StringTable &stringTable)
+void OsmParserPbf::parseWay( ProtobufReader way, const StringTable &stringTable, OsmBaseConsumer *target)
 {
-    for (const OSMPBF::Relation &rel : rels)
+    uint64_t id = 0;
+    int32_t version = 1;
+    ProtobufReader keys, vals, refs;
+    while (way.nextField())
+        switch (way.getFieldNumber())
+        {
+            case 1: id = way.readVarUint(); break;
+            case 2: keys = way.readMessage(); break;
+            case 3: vals = way.readMessage(); break;
+            case 4: version = getInfoVersion( way.readMessage()); break;
+            case 8: refs = way.readMessage(); break;
+            default: way.skip(); break;
+        }
+
+    OsmWay osmWay(id, version);
+    while (!keys.atEnd())
     {
-        int32_t version = rel.has_info() && rel.info().has_version() ? 
-            rel.info().version() : 1;
+        MUST( !vals.atEnd(), "extraneous key or value");
+        const PbfString &key   = stringTable[keys.readRawVarUint()];
+        const PbfString &value = stringTable[vals.readRawVarUint()];
+        osmWay.tags.push_back( make_pair( key.toString(), value.toString()));
+    }
+    MUST( vals.atEnd(), "extraneous key or value");
 
-        OsmRelation osmRel(rel.id(), version);
-        MUST( rel.keys().size() == rel.vals().size(), "extraneous key or value");
-        MUST( rel.roles_sid().size() == rel.memids().size(), "incomplete (type,role,ref) triple");
-        MUST( rel.roles_sid().size() == rel.types().size(), "incomplete (type,role,ref) triple");
+    int64_t nodeId = 0;
+    while (!refs.atEnd())
+    {
+        nodeId += ProtobufReader::zigzagDecode( refs.readRawVarUint());
+        MUST(nodeId > 0, "invalid node id");
+        osmWay.refs.push_back( (OsmGeoPosition){.id = (uint64_t)nodeId,
+                                                .lat= INVALID_LAT_LNG,
+                                                .lng= INVALID_LAT_LNG} );
+    } 
+
+    target->consumeWay(osmWay);
+}
 
-        //osmRel.tags.reserve( rel.keys().size());        
-        for (int i = 0; i < rel.keys().size(); i++)
-            osmRel.tags.push_back( make_pair( stringTable[rel.keys().Get(i)], stringTable[rel.vals().Get(i)] ));
-            
-        int64_t ref = 0;
-        //rel.members.reserve( rel.roles_sid().size());
-        for (int i = 0; i < rel.roles_sid().size(); i++)
+void OsmParserPbf::parseRelation( ProtobufReader rel, const StringTable &stringTable, OsmBaseConsumer *target)
+{
+    uint64_t id = 0;
+    int32_t version = 1;
+    ProtobufReader keys, vals, roles, memberIds, types;
+    while (rel.nextField())
+        switch (rel.getFieldNumber())
         {
-            ref += rel.memids().Get(i);
-            const string& role = stringTable[rel.roles_sid().Get(i)];
-            OSMPBF::Relation::MemberType iType = (OSMPBF::Relation::MemberType)rel.types().Get(i);
-            
-            OSM_ENTITY_TYPE type = 
-                           (iType == OSMPBF::Relation::NODE) ? OSM_ENTITY_TYPE::NODE : 
-                           (iType == OSMPBF::Relation::WAY)  ? OSM_ENTITY_TYPE::WAY :
-                           (iType == OSMPBF::Relation::RELATION) ? OSM_ENTITY_TYPE::RELATION:
-                           OSM_ENTITY_TYPE::OTHER;
-            MUST( type == OSM_ENTITY_TYPE::NODE || 
-                  type == OSM_ENTITY_TYPE::WAY  || 
-                  type == OSM_ENTITY_TYPE::RELATION, "invalid type");
-            osmRel.members.push_back( OsmRelationMember(type, ref, role));
+            case 1: id = rel.readVarUint(); break;
+            case 2: keys = rel.readMessage(); break;
+            case 3: vals = rel.readMessage(); break;
+            case 4: version = getInfoVersion( rel.readMessage()); break;
+            case 8: roles = rel.readMessage(); break;
+            case 9: memberIds = rel.readMessage(); break;
+            case 10: types = rel.readMessage(); break;
+            default: rel.skip(); break;
         }
+
+    OsmRelation osmRel(id, version);
+    while (!keys.atEnd())
+    {
+        MUST( !vals.atEnd(), "extraneous key or value");
+        const PbfString &key   = stringTable[keys.readRawVarUint()];
+        const PbfString &value = stringTable[vals.readRawVarUint()];
+        osmRel.tags.push_back( make_pair( key.toString(), value.toString()));
+    }
+    MUST( vals.atEnd(), "extraneous key or value");
+        
+    int64_t ref = 0;
+    while (!roles.atEnd())
+    {
+        MUST( !memberIds.atEnd() && !types.atEnd(), "incomplete (type,role,ref) triple");
+        ref += ProtobufReader::zigzagDecode( memberIds.readRawVarUint());
+        const PbfString &role = stringTable[roles.readRawVarUint()];
+        uint64_t iType = types.readRawVarUint();
         
-        consumer->consumeRelation(osmRel);
+        OSM_ENTITY_TYPE type = 
+                       (iType == OSMPBF::Relation::NODE) ? OSM_ENTITY_TYPE::NODE : 
+                       (iType == OSMPBF::Relation::WAY)  ? OSM_ENTITY_TYPE::WAY :
+                       (iType == OSMPBF::Relation::RELATION) ? OSM_ENTITY_TYPE::RELATION:
+                       OSM_ENTITY_TYPE::OTHER;
+        MUST( type == OSM_ENTITY_TYPE::NODE || 
+              type == OSM_ENTITY_TYPE::WAY  || 
+              type == OSM_ENTITY_TYPE::RELATION, "invalid type");
+        osmRel.members.push_back( OsmRelationMember(type, ref, role.toString()));
     }
+    MUST( memberIds.atEnd() && types.atEnd(), "incomplete (type,role,ref) triple");
+    
+    target->consumeRelation(osmRel);
+}
+
+void OsmParserPbf::printProgress(uint64_t filePos) const
+{
+    cout << "\e[K" << endl;
+    cout << "\e[u"; //move cursor to saved position
+    cout << "Processing data at file position "<< (filePos / 1000000) << "M (" << (filePos*100/fileSize) << "%)" << endl;
 }
 
 void OsmParserPbf::parse()
 {    
     assert(f);
-    int ch;
     cout << endl << endl << "\e[2A"; //reserve 2 lines of space for message
     cout << "\e[s"; //mark cursor position for future status updates
     
-    while ( (ch = fgetc(f)) != EOF)
+    /* a previous parse() or scanBlobs() may have read (and released) the whole file already */
+    nextSelectedBlob = nextReadAheadBlob = 0;
+    readaheadPos = releasedPos = 0;
+    if (numThreads > 1)
+        parsePipelined();
+    else
+        parseSequential();
+}
+
+void OsmParserPbf::parseSequential()
+{
+    RawBlob rawBlob;
+    rawBlob.seqNo = 0;
+    
+    while ( readRawBlob(rawBlob))
     {
-        ungetc(ch, f);
+        if (rawBlob.type == "OSMData")
+            printProgress(rawBlob.filePos);
 
-        uint32_t size;
-        uint64_t filePos = ftello(f);
-        string blobType = prepareBlob(unpackBuffer, size);
-        
-        if ( blobType == "OSMHeader")
-        {    
-            //cout << "parsing headerBlock" << endl;
-            OSMPBF::HeaderBlock headerBlock;
-            MUST( headerBlock.ParseFromArray(unpackBuffer, size), "failed to parse HeaderBlock");
-            /*for (string s: headerBlock.required_features())
-                cout << "\trequires feature '" << s << "'" << endl;
-
-            for (string s: headerBlock.optional_features())
-                cout << "\thas optional feature " << s << "'" << endl;
-                
-            cout << "\twritten by '" << headerBlock.writingprogram() << "'" << endl;
-            cout << endl << endl << "\e[2A";
-            cout << "\e[s"; //mark cursor position for future status updates*/
-        } else if (blobType == "OSMData")
+        decodeBlob(rawBlob, unpackBuffer, consumer, entityFilter);
+        releaseRawBlob(rawBlob);
+        rawBlob.seqNo++;
+    }
+}
+
+/* Pipelined parsing: 
+ * - a reader thread reads raw blobs sequentially and puts them into the 'rawBlobs' queue.
+ * - each of the 'numThreads' workers takes raw blobs from that queue, and decodes them into
+ *   an OsmConsumerBuffer (each worker has its own 32MiB unpack buffer).
+ * - the calling thread collects the decoded blobs, and replays them into the actual
+ *   consumer strictly in the order of their sequence numbers, i.e. in file order.
+ * At most 'maxBlobsInFlight' blobs may have been read but not yet been passed to the
+ * consumer, which bounds the memory consumption when the consumer is the bottleneck.
+ */
+void OsmParserPbf::parsePipelined()
+{
+    const uint64_t maxBlobsInFlight = 4 * numThreads;
+
+    BlockingQueue<RawBlob*> rawBlobs(maxBlobsInFlight);
+
+    std::mutex mutex;   //protects all of the following variables
+    std::condition_variable blobDecoded, blobCommitted;
+    std::map<uint64_t, std::pair<RawBlob*, OsmConsumerBuffer*> > decodedBlobs;
+    uint64_t numBlobsRead = 0;
+    uint64_t numBlobsCommitted = 0;
+    bool readerFinished = false;
+
+    std::thread reader( [&]() {
+        while (true)
         {
-            cout << "\e[u"; //move cursor to saved position
-            cout << "Processing data at file position "<< (filePos / 1000000) << "M (" << (filePos*100/fileSize) << "%)" << endl;
-            
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                while (numBlobsRead - numBlobsCommitted >= maxBlobsInFlight)
+                    blobCommitted.wait(lock);
+            }
 
-            OSMPBF::PrimitiveBlock primBlock;
-            MUST( primBlock.ParseFromArray(unpackBuffer, size), "failed to parse PrimBlock");
-                
-            //cout << "\tstringtable has " << primBlock.stringtable().s().size() << " entries" << endl;            
-            StringTable strings(primBlock.stringtable().s());
-            //vector<string> strings;
-
-            int32_t granularity = primBlock.has_granularity() ? primBlock.granularity() : 100;
-            int64_t lat_offset = primBlock.has_lat_offset() ? primBlock.lat_offset() : 0;
-            int64_t lon_offset = primBlock.has_lon_offset() ? primBlock.lon_offset() : 0;
-            //int32_t date_granularity = primBlock.has_date_granularity() ? primBlock.date_granularity() : 1000;
-            /*cout << "\tgranularity=" << granularity 
-                 << " offset=" << lat_offset << "/" << lon_offset 
-                 << " date_granularity=" << date_granularity << endl;*/
-            //for (const string &s : primBlock.stringtable().s())
-            //    strings.push_back(s);
-                
-            //cout << "\t" << primBlock.primitivegroup().size() << " primitive groups" << endl;
-            
-            for (const OSMPBF::PrimitiveGroup &primGroup : primBlock.primitivegroup())
+            RawBlob *rawBlob = new RawBlob();
+            rawBlob->seqNo = numBlobsRead;
+            if (! readRawBlob(*rawBlob))
             {
-                //NOTE: more than one of these may be present in a given primitive group
-
-                //cout << "\t\tgroup contains " << primGroup.nodes().size() << " nodes" << endl;
-                if (primGroup.nodes().size())
-                    MUST(false, "NOT IMPLEMENTED");
-                    
-                //cout << "\t\tgroup contains " << (primGroup.has_dense() ? "":"NO ") << "dense nodes" << endl;
-                if (primGroup.has_dense())
-                    parseDenseNodes( primGroup.dense(), strings, granularity, lat_offset, lon_offset);
-
-                //cout << "\t\tgroup contains " << primGroup.ways().size() << " ways" << endl;
-                if (primGroup.ways().size())
-                    parseWays( primGroup.ways(), strings);
-                
-                //cout << "\t\tgroup contains " << primGroup.relations().size() << " relations" << endl;
-                if (primGroup.relations().size())
-                    parseRelations( primGroup.relations(), strings);
-                
-                //cout << "\t\tgroup contains " << primGroup.changesets().size() << " changesets" << endl;
-                if (primGroup.changesets().size())
-                    MUST(false, "NOT IMPLEMENTED");
-                
+                delete rawBlob;
+                break;
             }
-//                cout << "string '" << s << "'" << endl;
-            //cout << "\tfirst string is '" << primBlock.stringtable().s().c_str() << "'" << endl;
- //           exit(0);
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                numBlobsRead++;
+            }
+            rawBlobs.push(rawBlob);
+        }
         
-        } else MUST(false, "invalid header type");
+        rawBlobs.close();
+        std::unique_lock<std::mutex> lock(mutex);
+        readerFinished = true;
+        blobDecoded.notify_all();
+    });
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < numThreads; i++)
+        workers.push_back( std::thread( [&]() {
+            uint8_t *workerUnpackBuffer = new uint8_t[OSMPBF::max_uncompressed_blob_size];
+            RawBlob *rawBlob;
+            while (rawBlobs.pop(rawBlob))
+            {
+                OsmConsumerBuffer *entities = new OsmConsumerBuffer();
+                decodeBlob(*rawBlob, workerUnpackBuffer, entities, entityFilter);
+                
+                std::unique_lock<std::mutex> lock(mutex);
+                decodedBlobs[rawBlob->seqNo] = std::make_pair(rawBlob, entities);
+                blobDecoded.notify_all();
+            }
+            delete [] workerUnpackBuffer;
+        }));
+
+    //ordered commit stage
+    while (true)
+    {
+        std::pair<RawBlob*, OsmConsumerBuffer*> next;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while ( !decodedBlobs.count(numBlobsCommitted) && 
+                    !(readerFinished && numBlobsCommitted == numBlobsRead))
+                blobDecoded.wait(lock);
+
+            if (!decodedBlobs.count(numBlobsCommitted))
+                break;  //all blobs have been read and committed
+
+            next = decodedBlobs[numBlobsCommitted];
+            decodedBlobs.erase(numBlobsCommitted);
+        }
+
+        if (next.first->type == "OSMData")
+            printProgress(next.first->filePos);
+
+        next.second->replayInto(consumer);
+        releaseRawBlob(*next.first);
+        delete next.second;
+        delete next.first;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        numBlobsCommitted++;
+        blobCommitted.notify_all();
     }
-    //delete [] unpackBuffer;
-    //if (!) { cerr << "Failed to parse blob header" << endl; exit(1); }
+
+    reader.join();
+    for (std::thread &worker : workers)
+        worker.join();
+    
+    MUST( decodedBlobs.empty(), "pipeline corruption");
 }
 
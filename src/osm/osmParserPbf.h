@@ -1,61 +1,132 @@
-
 #ifndef OSM_PARSER_PBF_H
 #define OSM_PARSER_PBF_H
 
 #include <vector>
 
 #include "consumers/osmConsumer.h"
+#include "osm/pbfBlobIndex.h"
+#include "osm/protobufReader.h"
 
 #include "fileformat.pb.h"
-#include "osmformat.pb.h"
 
-template<typename T>
-using GoogleList = google::protobuf::RepeatedPtrField<T>;
+namespace OSMPBF {
+static const int max_uncompressed_blob_size = 32 * (1 << 20);
+static const int max_blob_header_size = 32 * (1 << 10);
+}
+
+/* an entry of a PrimitiveBlock's string table. It is not zero-terminated, and points 
+ * directly into the inflated block, so it is only valid until the unpack buffer is reused. */
+struct PbfString {
+    const char *data;
+    uint32_t length;
+
+    std::string toString() const { return std::string(data, length); }
+};
 
 class StringTable {
 public:
-    StringTable(const GoogleList<std::string>& src);        
+    // 'data' and 'size' are those of the serialized StringTable message
+    StringTable(const uint8_t *data, uint64_t size);
     StringTable( const StringTable &other); //not defined to prevent copying
     StringTable& operator=(const StringTable &other); //not defined to prevent copying
-        const std::string& operator[](uint32_t idx) const;
+    const PbfString& operator[](uint32_t idx) const;
+    const char* getData()     const { return data; }
+    uint64_t    getDataSize() const { return dataSize; }
 private:
-    std::vector<std::string> table;
+    std::vector<PbfString> table;
+    const char *data;
+    uint64_t dataSize;
 };
 
+/* a single file block as read from disk: its BlobHeader type and the still
+ * serialized (and usually still compressed) Blob. 'data' points directly into
+ * the memory-mapped input file, or - if the input cannot be memory-mapped - into
+ * 'buffer'. */
+struct RawBlob {
+    uint64_t seqNo;
+    uint64_t filePos;
+    std::string type;
+    const uint8_t *data;
+    uint32_t size;
+    std::vector<uint8_t> buffer;
+};
 
 class OsmParserPbf
 {
 
 public:
-    OsmParserPbf(FILE * file, OsmBaseConsumer *consumer);
+    /* With numThreads > 1, parse() runs as a pipeline: a reader thread reads the raw
+     * blobs from the file, 'numThreads' worker threads inflate and decode them, and the
+     * calling thread passes the decoded entities on to the consumer in file order.
+     * So the consumer is always called from a single thread, and sees exactly the
+     * same sequence of entities as in the single-threaded case. */
+    OsmParserPbf(FILE * file, OsmBaseConsumer *consumer, uint32_t numThreads = 1);
     ~OsmParserPbf();
-    
+
     void parse();
+
+    enum ENTITY_FILTER { PARSE_NODES = 1, PARSE_WAYS = 2, PARSE_RELATIONS = 4, PARSE_ALL = 7};
+    /* restricts subsequent calls to parse() to the given blobs (which have to be sorted by
+     * file offset, e.g. as returned by PbfBlobIndex), and to entities of the types given
+     * by 'entityFilter' (a combination of ENTITY_FILTER flags). While a selection is active,
+     * only the selected blobs are read ahead, so the rest of the file is not read at all. */
+    void restrictTo(const std::vector<PbfBlobInfo> &blobs, uint8_t entityFilter = PARSE_ALL);
+
+    /* reads (and inflates) all blobs of the file, and returns their positions and 
+     * the number of entities of each type they contain. Used to create a PbfBlobIndex. */
+    std::vector<PbfBlobInfo> scanBlobs();
+    /* returns the positions of all blobs of the file, but - unlike scanBlobs() - only reads 
+     * the blob headers. So the entity counts of the returned PbfBlobInfos are all zero.
+     * Both always cover the whole file, but keep a selection set by restrictTo() in place */
+    std::vector<PbfBlobInfo> listBlobs();
+
+    /* decompresses the Blob of 'rawBlob' (raw, zlib, and - if compiled in - lz4 and zstd) 
+     * into 'unpackBufferOut', which has to hold at least max_uncompressed_blob_size bytes */
+    static void unpackBlob( const RawBlob &rawBlob, uint8_t *unpackBufferOut, uint32_t &unpackedSizeOut);
 private:
+    void   parseSequential();
+    void   parsePipelined();
+    bool   readRawBlob(RawBlob &blobOut);
+    bool   readRawBlobFromMap(RawBlob &blobOut);
+    void   releaseRawBlob(const RawBlob &blob);
+    void   readAheadSelectedBlobs(uint64_t filePos);
+    void   printProgress(uint64_t filePos) const;
 
-    void   unpackBlob( const OSMPBF::Blob &blob, FILE* fIn, uint8_t *unpackBufferOut, uint32_t &unpackedSizeOut);
-    std::string prepareBlob(uint8_t *unpackBuffer, uint32_t &dataSizeOut);
-    void   parseDenseNodes( const OSMPBF::DenseNodes &nodes, const StringTable &stringTable, int32_t granularity, int64_t lat_offset, int64_t lon_offset);
-    void   parseWays(const GoogleList<OSMPBF::Way> &ways, const StringTable &stringTable);
-    void   parseRelations(const GoogleList<OSMPBF::Relation> &rels, const StringTable &stringTable);
+    static void decodeBlob( const RawBlob &rawBlob, uint8_t *unpackBuffer, OsmBaseConsumer *target, uint8_t entityFilter);
+    static void countEntities( const uint8_t *primitiveBlock, uint32_t size, PbfBlobInfo &infoOut);
+    static void parseDenseNodes( ProtobufReader nodes, const StringTable &stringTable, int32_t granularity, int64_t lat_offset, int64_t lon_offset, OsmBaseConsumer *target);
+    static void parseWay( ProtobufReader way, const StringTable &stringTable, OsmBaseConsumer *target);
+    static void parseRelation( ProtobufReader rel, const StringTable &stringTable, OsmBaseConsumer *target);
 
-/*    void parseNode();    
-    void parseWay();    
+/*    void parseNode();
+    void parseWay();
     void parseRelation();
     void parseChangeset();*/
 //    bool readNextLine();
- 
+
 private:
-    
-    FILE * f; 
+
+    FILE * f;
     uint64_t fileSize;
     OsmBaseConsumer *consumer;
+    uint32_t numThreads;
     uint8_t *unpackBuffer;
+    /* the memory-mapped input file (nullptr if it could not be mapped), the position of
+     * the next blob in it, and the borders of the range that was madvise()d as needed */
+    const uint8_t *inputMap;
+    uint64_t inputPos;
+    uint64_t readaheadPos, releasedPos;
+    // the blobs and entity types parse() is restricted to (see restrictTo())
+    bool hasBlobSelection;
+    std::vector<PbfBlobInfo> selectedBlobs;
+    uint64_t nextSelectedBlob;
+    uint64_t nextReadAheadBlob; //the first selected blob not yet advised to be read ahead
+    uint8_t entityFilter;
 //    char* line_buffer;
 //    size_t line_buffer_size;
-//    uint64_t numLinesRead;    
+//    uint64_t numLinesRead;
 //    const char* line;
-    bool hasParsedNodes, hasParsedWays, hasParsedRelations;
 };
 
 #endif
+
@@ -16,6 +16,7 @@
 #include "misc/rawTags.h"
 #include "misc/varInt.h"
 #include "containers/chunkedFile.h"
+#include "misc/tagSetTable.h"
 //#include "symbolic_tags.h"
 
 #include <iostream>
@@ -84,9 +85,13 @@ OsmNode::OsmNode( FILE* f)
 }
 */
 
-uint64_t OsmNode::getSerializedSize() const
+uint64_t OsmNode::getSerializedSize(RawTags::SymbolicIds *symbolicIdsOut, uint64_t *tagsSizeOut) const
 {
-    uint64_t tagsSize = RawTags::getSerializedSize(tags);
+    uint64_t tagsSize = symbolicIdsOut ? RawTags::getSerializedSize(tags, *symbolicIdsOut) : 
+                                         RawTags::getSerializedSize(tags);
+    if (tagsSizeOut)
+        *tagsSizeOut = tagsSize + varUintNumBytes(tagsSize);
+
     return varUintNumBytes(id) + 
            varUintNumBytes(version) + 
            sizeof(lat) + 
@@ -97,7 +102,8 @@ uint64_t OsmNode::getSerializedSize() const
 
 OsmNode::OsmNode( int32_t lat, int32_t lng, uint64_t  id, uint32_t version, vector<OsmKeyValuePair> tags): id(id), version(version), lat(lat), lng(lng), tags(tags) {}
 
-void OsmNode::serialize( ChunkedFile &dataFile, mmap_t *index_map, mmap_t *vertex_data) const
+void OsmNode::serialize( ChunkedFile &dataFile, TaggedNodeIndex::Builder *index, mmap_t *vertex_data, 
+                        TagSetTable *tagSets) const
 {
     /** temporary nodes in OSM editors are allowed to have negative node IDs, 
       * but those in the official maps are guaranteed to be positive.
@@ -110,49 +116,52 @@ void OsmNode::serialize( ChunkedFile &dataFile, mmap_t *index_map, mmap_t *verte
     vertex_ptr[2*this->id]   = this->lat;
     vertex_ptr[2*this->id+1] = this->lng;
 
-    ensure_mmap_size( index_map, (id+1)*sizeof(uint64_t));
-    uint64_t* index_ptr = (uint64_t*)index_map->ptr;
-
-    /* if the whole node data (excluding lat/lng, which has been stored above already) would
-     * fit into the index entry that normally *points* to the node data, write the data
-     * into the index directly */
-    /* serialization format:
-     * bytes 0-6:
-     * -    varUint id
-     * -    varUint version
-     * byte 7: 0xFF
-     */
-    if (this->tags.size() == 0 && (varUintNumBytes(this->id) + varUintNumBytes(this->version) +1 <= 8))
-    {
-        uint8_t data[8] = {0, 0, 0, 0, 0, 0, 0, 0xFF};
-        int nRead = varUintToBytes( this->id, data);
-        nRead += varUintToBytes( this->version, data+nRead);
-        MUST( nRead < 8, "serialization overflow");
-        memcpy( &index_ptr[this->id], data, 8);
-    } else  //full serialization
+    /* untagged nodes are fully described by their vertex (their version is not needed by 
+     * any of the later processing steps), so only tagged nodes are stored in nodes.data */
+    if (this->tags.size() == 0)
+        return;
+
+    //full serialization
+    RawTags::SymbolicIds symbolicIds;
+    uint64_t tagsSize;
+    uint64_t size = this->getSerializedSize(&symbolicIds, &tagsSize);
+    if (!tagSets)
     {
-        Chunk chunk = dataFile.createChunk( this->getSerializedSize());
-        index_ptr[id] = chunk.getPositionInFile();
+        Chunk chunk = dataFile.createChunk( size);
+        index->add( id, chunk.getPositionInFile());
+        this->serialize(chunk, &symbolicIds);
+        return;
+    }
 
-        int numBytes;
-        uint8_t bytes[10];
-        
-        numBytes = varUintToBytes(id, bytes);
-        chunk.put(bytes, numBytes);
+    // the size of the chunk is only known once the tags have been deduplicated
+    uint8_t *bytes = new uint8_t[size];
+    Chunk tmp( bytes, 0, size);
+    this->serialize(tmp, &symbolicIds);
+    size = tagSets->deduplicate( bytes, size, tagsSize);
 
-        numBytes = varUintToBytes(version, bytes);
-        chunk.put(bytes, numBytes);
-        chunk.put(lat);
-        chunk.put(lng);
+    Chunk chunk = dataFile.createChunk( size);
+    index->add( id, chunk.getPositionInFile());
+    chunk.put( bytes, size);
+    delete [] bytes;
 
-        RawTags::serialize( tags, chunk );
+}
 
-        //std::cout << id << endl;    
-        ensure_mmap_size( index_map, (id+1)*sizeof(uint64_t));
-    }
 
-}
+void OsmNode::serialize( Chunk &chunk, const RawTags::SymbolicIds *symbolicIds) const
+{
+    int numBytes;
+    uint8_t bytes[10];
+    
+    numBytes = varUintToBytes(id, bytes);
+    chunk.put(bytes, numBytes);
+
+    numBytes = varUintToBytes(version, bytes);
+    chunk.put(bytes, numBytes);
+    chunk.put(lat);
+    chunk.put(lng);
 
+    RawTags::serialize( tags, chunk, symbolicIds);
+}
 
 bool OsmNode::hasKey(string key) const
 {
@@ -183,6 +192,52 @@ ostream& operator<<(ostream &out, const OsmNode &node)
     return out;
 }
 
+OsmNodeBatch::OsmNodeBatch(): tagsBegin(1, 0), stringData(nullptr), stringDataSize(0) {}
+
+vector<OsmKeyValuePair> OsmNodeBatch::getTags(uint64_t i) const
+{
+    vector<OsmKeyValuePair> tags;
+    tags.reserve( tagsBegin[i+1] - tagsBegin[i]);
+    for (uint32_t j = tagsBegin[i]; j < tagsBegin[i+1]; j++)
+    {
+        const StringRef &key   = tagRefs[j].first;
+        const StringRef &value = tagRefs[j].second;
+        tags.push_back( make_pair( string(stringData + key.offset,   key.length), 
+                                   string(stringData + value.offset, value.length)));
+    }
+    return tags;
+}
+
+OsmNode OsmNodeBatch::getNode(uint64_t i) const
+{
+    OsmNode node( lats[i], lngs[i], ids[i], versions[i]);
+    if (hasTags(i))
+        node.tags = getTags(i);
+    return node;
+}
+
+void OsmNodeBatch::clear()
+{
+    ids.clear();
+    lats.clear();
+    lngs.clear();
+    versions.clear();
+    tagsBegin.assign(1, 0);
+    tagRefs.clear();
+    stringData = nullptr;
+    stringDataSize = 0;
+    stringStorage.clear();
+}
+
+void OsmNodeBatch::ownStringData()
+{
+    if (stringData == stringStorage.data())
+        return;
+        
+    stringStorage.assign( stringData, stringData + stringDataSize);
+    stringData = stringStorage.data();
+}
+
 OsmWay::OsmWay( uint64_t id, uint32_t version, 
             std::vector<uint64_t> way_refs, std::vector<OsmKeyValuePair> tags):
         id(id), version(version), tags(tags)  
@@ -210,7 +265,7 @@ OsmWay::OsmWay( const uint8_t* &data)
     uint64_t numNodes = varUintFromBytes(data, &nRead);
     data += nRead;
     
-    MUST( numNodes <= 2000, "More node refs in way than specification allows");
+    MUST( numNodes <= MAX_WAY_NODES, "More node refs in way than specification allows");
     
     this->refs.reserve(numNodes);
     
@@ -253,9 +308,10 @@ OsmWay::OsmWay( OsmWay &&other)
 
 
 
-uint64_t OsmWay::getSerializedSize(uint64_t *numTagBytesOut) const
+uint64_t OsmWay::getSerializedSize(uint64_t *numTagBytesOut, RawTags::SymbolicIds *symbolicIdsOut) const
 {
-    uint64_t nTagBytes = RawTags::getSerializedSize(tags);
+    uint64_t nTagBytes = symbolicIdsOut ? RawTags::getSerializedSize(tags, *symbolicIdsOut) : 
+                                          RawTags::getSerializedSize(tags);
     if (numTagBytesOut)
         *numTagBytesOut = nTagBytes;    
     
@@ -296,7 +352,8 @@ void OsmWay::serialize(FILE* f)
     delete [] bytes;
 }
 
-void OsmWay::serialize(uint8_t* dest, uint64_t serializedSize, uint64_t nTagBytes)
+void OsmWay::serialize(uint8_t* dest, uint64_t serializedSize, uint64_t nTagBytes, 
+                       const RawTags::SymbolicIds *symbolicIds)
 {
     uint8_t* pos = dest;
     
@@ -322,23 +379,30 @@ void OsmWay::serialize(uint8_t* dest, uint64_t serializedSize, uint64_t nTagByte
         prevLng = p.lng;
     }
     
-    RawTags::serialize(this->tags, nTagBytes, pos, nTagBytes + varUintNumBytes(nTagBytes));
+    if (symbolicIds)
+        RawTags::serialize(this->tags, *symbolicIds, nTagBytes, pos, nTagBytes + varUintNumBytes(nTagBytes));
+    else
+        RawTags::serialize(this->tags, nTagBytes, pos, nTagBytes + varUintNumBytes(nTagBytes));
     pos += nTagBytes + varUintNumBytes(nTagBytes);
     //std::cout << (pos - bytes) << ", " << nBytes << std::endl;
     MUST( pos - dest == (int64_t)serializedSize, "compressed way serialization size mismatch");
 
 }
 
-uint8_t* OsmWay::serialize(uint64_t *numBytes)
+uint8_t* OsmWay::serialize(uint64_t *numBytes, uint64_t *tagsSizeOut)
 {
-    uint64_t nTagBytes = RawTags::getSerializedSize(this->tags);
-    uint64_t nBytes = this->getSerializedSize();
+    RawTags::SymbolicIds symbolicIds;
+    uint64_t nTagBytes;
+    uint64_t nBytes = this->getSerializedSize(&nTagBytes, &symbolicIds);
     uint8_t *bytes = new uint8_t[nBytes];
     
-    this->serialize(bytes, nBytes, nTagBytes);
+    this->serialize(bytes, nBytes, nTagBytes, &symbolicIds);
 
     if (numBytes)    
         *numBytes = nBytes;
+
+    if (tagsSizeOut)
+        *tagsSizeOut = nTagBytes + varUintNumBytes(nTagBytes);
         
     return bytes;
 }
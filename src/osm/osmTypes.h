@@ -8,7 +8,9 @@
 #include <vector>
 
 #include "osmBaseTypes.h"
+#include "containers/taggedNodeIndex.h"
 #include "misc/mem_map.h"
+#include "misc/rawTags.h"
 
 /* on-disk format for OsmNode:
     - v_uint id
@@ -19,6 +21,8 @@
 */
 
 class ChunkedFile;
+class Chunk;
+class TagSetTable;
 
 struct OsmNode
 {
@@ -26,7 +30,14 @@ struct OsmNode
     OsmNode( const uint8_t* data_ptr);
     //OsmNode( FILE* f);
         
-    void serialize( ChunkedFile &dataFile, mmap_t *index_map, mmap_t *vertex_data) const;
+    /* writes the node's vertex to 'vertex_data', and - if the node has tags - the node itself
+     * to 'dataFile' and its position to 'index'. If 'tagSets' is given, the node's tags are 
+     * replaced by a reference to a shared tag set where possible (see TagSetTable::deduplicate()) */
+    void serialize( ChunkedFile &dataFile, TaggedNodeIndex::Builder *index, mmap_t *vertex_data, 
+                    TagSetTable *tagSets = nullptr) const;
+    /* writes the full serialization of the node to 'chunk' (of getSerializedSize() bytes).
+     * 'symbolicIds' - if given - have to be those returned by getSerializedSize() */
+    void serialize( Chunk &chunk, const RawTags::SymbolicIds *symbolicIds = nullptr) const;
 
     const std::string &getValue(std::string key) const;
     bool hasKey(std::string key) const;
@@ -35,7 +46,10 @@ struct OsmNode
     bool operator==(const OsmNode &other) const;
     bool operator!=(const OsmNode &other) const;
     bool operator< (const OsmNode &other) const;
-    uint64_t getSerializedSize() const;    
+    /* 'tagsSizeOut' receives the size of the serialized tags (including their size field),
+     * which form the end of the serialized node */
+    uint64_t getSerializedSize(RawTags::SymbolicIds *symbolicIdsOut = nullptr, 
+                               uint64_t *tagsSizeOut = nullptr) const;
     uint64_t id;
     uint32_t version;
     int32_t lat;    //needs to be signed! -180° < lat < 180°
@@ -45,6 +59,40 @@ struct OsmNode
 
 std::ostream& operator<<(std::ostream &out, const OsmNode &node);
 
+/* A batch of consecutive nodes in struct-of-arrays layout, as stored in a PBF DenseNodes
+ * group. Tags are not materialized as strings. Instead, each tag is a pair of (offset, length)
+ * views into 'stringData' (i.e. into the PBF block's string table). The tags of the i-th node
+ * are tagRefs[tagsBegin[i]] to tagRefs[tagsBegin[i+1] - 1].
+ * 'stringData' is owned by the producer of the batch, and is only valid during the call to
+ * consumeNodeBatch() - unless ownStringData() has been called.
+ */
+struct OsmNodeBatch
+{
+    struct StringRef { uint32_t offset; uint32_t length; };
+
+    OsmNodeBatch();
+    OsmNodeBatch( const OsmNodeBatch &other) = delete;  //stringData may point into stringStorage
+    OsmNodeBatch( OsmNodeBatch &&other) = default;
+    
+    uint64_t size() const { return ids.size(); }
+    bool hasTags(uint64_t i) const { return tagsBegin[i+1] > tagsBegin[i]; }
+    std::vector<OsmKeyValuePair> getTags(uint64_t i) const;
+    OsmNode getNode(uint64_t i) const;
+    void clear();
+    // copies 'stringData' into the batch itself, so that the batch may outlive its producer
+    void ownStringData();
+
+    std::vector<uint64_t> ids;
+    std::vector<int32_t>  lats, lngs;
+    std::vector<uint32_t> versions;
+    std::vector<uint32_t> tagsBegin;    //size() + 1 entries
+    std::vector< std::pair<StringRef, StringRef> > tagRefs;
+    const char *stringData;
+    uint64_t    stringDataSize;
+private:
+    std::vector<char> stringStorage;
+};
+
 struct OsmWay
 {
 //    OSMWay( uint64_t way_id);
@@ -60,9 +108,15 @@ struct OsmWay
     OsmWay( OsmWay &&other);
     OsmWay( const OsmWay &other) = default;
 
-    uint64_t getSerializedSize(uint64_t *numTagBytesOut = nullptr) const;
+    uint64_t getSerializedSize(uint64_t *numTagBytesOut = nullptr, RawTags::SymbolicIds *symbolicIdsOut = nullptr) const;
     void serialize(FILE* f);
-    uint8_t* serialize(uint64_t *numBytes);
+    /* 'tagsSizeOut' receives the size of the serialized tags (including their size field),
+     * which form the end of the serialized way */
+    uint8_t* serialize(uint64_t *numBytes, uint64_t *tagsSizeOut = nullptr);
+    /* serializes the way into the caller-provided 'dest'. 'serializedSize', 'nTagBytes' and 
+     * 'symbolicIds' (if given) have to be those returned by getSerializedSize() */
+    void     serialize(uint8_t* dest, uint64_t serializedSize, uint64_t nTagBytes, 
+                       const RawTags::SymbolicIds *symbolicIds = nullptr);
     bool hasKey(std::string key) const;
     const std::string &getValue(std::string key) const;
     const std::string &operator[](std::string key) const {return getValue(key);}
@@ -73,10 +127,6 @@ struct OsmWay
     bool isClosed() const;
     double getArea() const;
     
-private:
-    void     serialize(uint8_t* dest, uint64_t serializedSize, uint64_t nTagBytes);
-    
-public:
     uint64_t id;
     uint32_t version;
     std::vector<OsmGeoPosition> refs;
@@ -0,0 +1,130 @@
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h> //for unlink()
+
+#include <iostream>
+
+#include "config.h"
+#include "osm/pbfBlobIndex.h"
+#include "osm/osmParserPbf.h"
+
+static const char     CACHE_MAGIC[8] = {'C', 'O', 'O', 'R', 'D', 'S', 'B', 'I'};
+static const uint32_t CACHE_VERSION = 1;
+
+PbfBlobIndex::PbfBlobIndex(const std::string &pbfFileName, uint32_t numThreads)
+{
+    struct stat st;
+    if (stat(pbfFileName.c_str(), &st) != 0)
+    {
+        std::cerr << "error: cannot access file '" << pbfFileName << "'" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    
+    fileSize  = st.st_size;
+    mtimeSec  = st.st_mtim.tv_sec;
+    mtimeNsec = st.st_mtim.tv_nsec;
+
+    std::string cacheFileName = getCacheFileName(pbfFileName);
+    if (loadCache(cacheFileName))
+        return;
+
+    FILE* f = fopen( pbfFileName.c_str(), "rb");
+    MUST(f, "cannot open PBF file");
+    std::cout << "creating blob index for '" << pbfFileName << "'" << std::endl;
+    OsmParserPbf parser(f, nullptr, numThreads);
+    blobs = parser.scanBlobs();
+    fclose(f);
+    
+    storeCache(cacheFileName);
+}
+
+std::string PbfBlobIndex::getCacheFileName(const std::string &pbfFileName)
+{
+    return pbfFileName + ".blobs";
+}
+
+bool PbfBlobIndex::loadCache(const std::string &cacheFileName)
+{
+    FILE* f = fopen(cacheFileName.c_str(), "rb");
+    if (!f)
+        return false;
+        
+    char magic[8];
+    uint32_t version, entrySize;
+    uint64_t cachedFileSize, numBlobs;
+    int64_t  cachedMtimeSec, cachedMtimeNsec;
+    bool isValid = 
+        fread(magic, sizeof(magic), 1, f) == 1 && memcmp(magic, CACHE_MAGIC, sizeof(magic)) == 0 &&
+        fread(&version,   sizeof(version),   1, f) == 1 && version   == CACHE_VERSION &&
+        fread(&entrySize, sizeof(entrySize), 1, f) == 1 && entrySize == sizeof(PbfBlobInfo) &&
+        fread(&cachedFileSize,  sizeof(cachedFileSize),  1, f) == 1 && cachedFileSize  == fileSize &&
+        fread(&cachedMtimeSec,  sizeof(cachedMtimeSec),  1, f) == 1 && cachedMtimeSec  == mtimeSec &&
+        fread(&cachedMtimeNsec, sizeof(cachedMtimeNsec), 1, f) == 1 && cachedMtimeNsec == mtimeNsec &&
+        fread(&numBlobs, sizeof(numBlobs), 1, f) == 1;
+
+    if (isValid)
+    {
+        blobs.resize(numBlobs);
+        isValid = numBlobs == 0 || fread(blobs.data(), sizeof(PbfBlobInfo), numBlobs, f) == numBlobs;
+    }
+    fclose(f);
+
+    if (!isValid)
+    {
+        std::cout << "[INFO] blob index cache '" << cacheFileName << "' is outdated, recreating it." << std::endl;
+        blobs.clear();
+    }
+    return isValid;
+}
+
+void PbfBlobIndex::storeCache(const std::string &cacheFileName) const
+{
+    FILE* f = fopen(cacheFileName.c_str(), "wb");
+    if (!f)
+    {
+        std::cout << "[WARN] cannot write blob index cache '" << cacheFileName << "', skipping." << std::endl;
+        return;
+    }
+
+    uint64_t numBlobs = blobs.size();
+    uint32_t entrySize = sizeof(PbfBlobInfo);
+    bool success = 
+        fwrite(CACHE_MAGIC, sizeof(CACHE_MAGIC), 1, f) == 1 &&
+        fwrite(&CACHE_VERSION, sizeof(CACHE_VERSION), 1, f) == 1 &&
+        fwrite(&entrySize, sizeof(entrySize), 1, f) == 1 &&
+        fwrite(&fileSize,  sizeof(fileSize),  1, f) == 1 &&
+        fwrite(&mtimeSec,  sizeof(mtimeSec),  1, f) == 1 &&
+        fwrite(&mtimeNsec, sizeof(mtimeNsec), 1, f) == 1 &&
+        fwrite(&numBlobs,  sizeof(numBlobs),  1, f) == 1 &&
+        (numBlobs == 0 || fwrite(blobs.data(), sizeof(PbfBlobInfo), numBlobs, f) == numBlobs);
+    fclose(f);
+    
+    if (!success)
+    {
+        std::cout << "[WARN] error writing blob index cache '" << cacheFileName << "', removing it." << std::endl;
+        unlink(cacheFileName.c_str());
+    }
+}
+
+std::vector<PbfBlobInfo> PbfBlobIndex::selectByEntityType(bool nodes, bool ways, bool relations) const
+{
+    std::vector<PbfBlobInfo> res;
+    for (const PbfBlobInfo &blob : blobs)
+        if ( (nodes && blob.numNodes) || (ways && blob.numWays) || (relations && blob.numRelations))
+            res.push_back(blob);
+            
+    return res;
+}
+
+std::vector<PbfBlobInfo> PbfBlobIndex::selectByByteRange(uint64_t begin, uint64_t end) const
+{
+    std::vector<PbfBlobInfo> res;
+    for (const PbfBlobInfo &blob : blobs)
+        if (blob.offset >= begin && blob.offset < end)
+            res.push_back(blob);
+            
+    return res;
+}
+
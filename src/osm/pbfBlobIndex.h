@@ -0,0 +1,64 @@
+#ifndef PBF_BLOB_INDEX_H
+#define PBF_BLOB_INDEX_H
+
+#include <stdint.h>
+
+#include <string>
+#include <vector>
+
+/* location and content summary of a single file block of a PBF file. 'offset' is the
+ * file position of the block's BlobHeader size prefix, 'size' the number of bytes of the
+ * whole block (size prefix, BlobHeader and Blob). */
+struct PbfBlobInfo {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint32_t numNodes;
+    uint32_t numWays;
+    uint32_t numRelations;
+    uint32_t reserved;  //padding, always zero
+
+    enum FLAGS { IS_HEADER_BLOB = 1 };
+};
+
+/* The class PbfBlobIndex stores where each file block of a PBF file is located and which
+ * kinds of OSM entities it contains. It allows a parser to skip over all blocks that do not
+ * contain entities of interest (e.g. the node section, for a tool interested only in
+ * relations), or to parse only a byte range of the file (e.g. to split the work between
+ * several processes).
+ *
+ * Creating the index requires inflating every block once. So the index is cached in a file
+ * next to the PBF file (<pbf file name>.blobs) and reused as long as size and modification
+ * time of the PBF file do not change. If the cache file cannot be written, the index still
+ * works, but has to be recreated the next time.
+ *
+ * Cache file layout:
+ *   char[8] magic ("COORDSBI"), uint32_t version, uint32_t sizeof(PbfBlobInfo),
+ *   uint64_t pbf file size, int64_t pbf mtime (s), int64_t pbf mtime (ns),
+ *   uint64_t numBlobs, PbfBlobInfo[numBlobs]
+ */
+class PbfBlobIndex {
+public:
+    PbfBlobIndex(const std::string &pbfFileName, uint32_t numThreads = 1);
+
+    const std::vector<PbfBlobInfo>& getBlobs() const { return blobs; }
+
+    // all blobs that contain at least one entity of any of the given types
+    std::vector<PbfBlobInfo> selectByEntityType(bool nodes, bool ways, bool relations) const;
+    /* all blobs that *start* in [begin, end[. So splitting a file into adjacent byte ranges
+     * assigns each blob to exactly one range.*/
+    std::vector<PbfBlobInfo> selectByByteRange(uint64_t begin, uint64_t end) const;
+
+    static std::string getCacheFileName(const std::string &pbfFileName);
+private:
+    bool loadCache(const std::string &cacheFileName);
+    void storeCache(const std::string &cacheFileName) const;
+
+private:
+    std::vector<PbfBlobInfo> blobs;
+    uint64_t fileSize;
+    int64_t  mtimeSec, mtimeNsec;
+};
+
+#endif
+
@@ -0,0 +1,116 @@
+#ifndef PROTOBUF_READER_H
+#define PROTOBUF_READER_H
+
+#include <stdint.h>
+#include <string.h> //for memcpy()
+
+#include "config.h"
+
+/* The class ProtobufReader walks the fields of a serialized protobuf message directly
+ * in its wire format, without creating a message object. Length-delimited fields
+ * (strings, bytes, sub-messages and packed arrays) are returned as pointer/length views
+ * into the underlying buffer, so no data is ever copied. The caller thus has to make
+ * sure that the buffer outlives all views obtained from it.
+ *
+ * Usage: while (reader.nextField()) switch (reader.getFieldNumber()) { ... }
+ *        Each field returned by nextField() has to be consumed by exactly one of the
+ *        read*() methods or by skip().
+ */
+class ProtobufReader
+{
+public:
+    enum WIRE_TYPE {VARINT = 0, FIXED64 = 1, LENGTH_DELIMITED = 2, FIXED32 = 5};
+
+    ProtobufReader(const uint8_t *begin, uint64_t size): pos(begin), end(begin + size),
+        fieldNumber(0), wireType(0) {}
+    ProtobufReader(): pos(nullptr), end(nullptr), fieldNumber(0), wireType(0) {}
+
+    bool nextField()
+    {
+        if (pos >= end)
+            return false;
+        uint64_t key = readRawVarUint();
+        fieldNumber = key >> 3;
+        wireType = key & 0x07;
+        return true;
+    }
+
+    uint32_t getFieldNumber() const { return fieldNumber; }
+    uint32_t getWireType()    const { return wireType; }
+    bool     atEnd()          const { return pos >= end; }
+
+    uint64_t readVarUint()
+    {
+        MUST( wireType == VARINT, "protobuf wire type mismatch");
+        return readRawVarUint();
+    }
+
+    int64_t readVarSint()   //'sint32' and 'sint64' fields, ZigZag-encoded
+    {
+        return zigzagDecode( readVarUint());
+    }
+
+    uint32_t readFixed32()
+    {
+        MUST( wireType == FIXED32 && pos + 4 <= end, "protobuf wire format error");
+        uint32_t res;
+        memcpy(&res, pos, sizeof(res));
+        pos += 4;
+        return res;
+    }
+
+    void readBytes(const uint8_t* &dataOut, uint64_t &sizeOut)
+    {
+        MUST( wireType == LENGTH_DELIMITED, "protobuf wire type mismatch");
+        sizeOut = readRawVarUint();
+        MUST( sizeOut <= (uint64_t)(end - pos), "protobuf field exceeds message");
+        dataOut = pos;
+        pos += sizeOut;
+    }
+
+    // for embedded messages and for packed repeated fields
+    ProtobufReader readMessage()
+    {
+        const uint8_t *data;
+        uint64_t size;
+        readBytes(data, size);
+        return ProtobufReader(data, size);
+    }
+
+    void skip()
+    {
+        switch (wireType)
+        {
+            case VARINT: readRawVarUint(); break;
+            case FIXED64: MUST(pos + 8 <= end, "protobuf wire format error"); pos += 8; break;
+            case FIXED32: MUST(pos + 4 <= end, "protobuf wire format error"); pos += 4; break;
+            case LENGTH_DELIMITED: { const uint8_t *data; uint64_t size; readBytes(data, size); break; }
+            default: MUST(false, "unsupported protobuf wire type"); break;
+        }
+    }
+
+    /* for iterating over packed repeated fields after readMessage(): every
+     * remaining byte belongs to a sequence of varints */
+    uint64_t readRawVarUint()
+    {
+        uint64_t res = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            MUST( pos < end && shift < 64, "protobuf varint overflow");
+            byte = *(pos++);
+            res |= ((uint64_t)(byte & 0x7F)) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        return res;
+    }
+
+    static int64_t zigzagDecode(uint64_t val) { return (int64_t)(val >> 1) ^ -(int64_t)(val & 1); }
+
+private:
+    const uint8_t *pos, *end;
+    uint32_t fieldNumber, wireType;
+};
+
+#endif
+
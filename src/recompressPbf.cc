@@ -0,0 +1,206 @@
+
+/* coordsRecompressPbf: re-encodes all blobs of a PBF file with a different compression codec.
+ * The entity data itself is not touched, only the compression of each blob changes. This is
+ * meant to convert an input file once (e.g. from zlib to zstd) when it is to be imported
+ * several times, as zstd and lz4 blobs decompress several times faster than zlib blobs.
+ */
+
+#include <arpa/inet.h>  //for ntohl()/htonl()
+#include <getopt.h>     //for getopt_long()
+#include <stdio.h>
+#include <string.h>
+#include <zlib.h>
+
+#ifdef COORDS_HAVE_LZ4
+    #include <lz4.h>
+#endif
+
+#ifdef COORDS_HAVE_ZSTD
+    #include <zstd.h>
+#endif
+
+#include <google/protobuf/stubs/common.h>   //for ShutdownProtobufLibrary()
+#include <iostream>
+#include <string>
+
+#include "config.h"
+#include "osm/osmParserPbf.h"
+
+#include "fileformat.pb.h"
+
+enum struct CODEC { NONE, ZLIB, LZ4, ZSTD };
+
+#ifdef COORDS_HAVE_ZSTD
+CODEC codec = CODEC::ZSTD;
+#else
+CODEC codec = CODEC::ZLIB;
+#endif
+int compressionLevel = -1;  //'-1': the codec's default level
+
+int parseArguments(int argc, char** argv)
+{
+    static const struct option long_options[] =
+    {
+        {"codec", required_argument, NULL, 'c'},
+        {"level", required_argument, NULL, 'l'},
+        {0,0,0,0}
+    };
+
+    int opt_idx = 0;
+    int opt;
+    while (-1 != (opt = getopt_long(argc, argv, "c:l:", long_options, &opt_idx)))
+    {
+        switch(opt) {
+            case '?': exit(EXIT_FAILURE); break; //unknown option; getopt_long() already printed an error message
+            case 'c':
+                if      (strcmp(optarg, "none") == 0) codec = CODEC::NONE;
+                else if (strcmp(optarg, "zlib") == 0) codec = CODEC::ZLIB;
+#ifdef COORDS_HAVE_LZ4
+                else if (strcmp(optarg, "lz4")  == 0) codec = CODEC::LZ4;
+#endif
+#ifdef COORDS_HAVE_ZSTD
+                else if (strcmp(optarg, "zstd") == 0) codec = CODEC::ZSTD;
+#endif
+                else
+                {
+                    std::cerr << "error: unsupported codec '" << optarg << "'" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'l': compressionLevel = atoi(optarg); break;
+            default: abort(); break;
+        }
+    }
+
+    if (compressionLevel >= 0 && (codec == CODEC::NONE || codec == CODEC::LZ4))
+    {
+        std::cerr << "error: the selected codec does not support compression levels" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return optind;
+}
+
+/* compresses 'size' bytes at 'data' into the matching data field of 'blobOut' */
+void compressBlob( const uint8_t *data, uint32_t size, OSMPBF::Blob &blobOut)
+{
+    if (codec == CODEC::NONE)
+    {
+        blobOut.set_raw( data, size);
+        return;
+    }
+
+    blobOut.set_raw_size(size);
+    switch (codec)
+    {
+        case CODEC::ZLIB:
+        {
+            std::string &out = *blobOut.mutable_zlib_data();
+            uLongf outSize = compressBound(size);
+            out.resize(outSize);
+            int level = compressionLevel >= 0 ? compressionLevel : Z_DEFAULT_COMPRESSION;
+            MUST( compress2( (Bytef*)&out[0], &outSize, data, size, level) == Z_OK, "zlib compression failed");
+            out.resize(outSize);
+            break;
+        }
+#ifdef COORDS_HAVE_LZ4
+        case CODEC::LZ4:    //LZ4 has no compression levels (only the separate LZ4-HC compressor)
+        {
+            std::string &out = *blobOut.mutable_lz4_data();
+            out.resize( LZ4_compressBound(size));
+            int outSize = LZ4_compress_default( (const char*)data, &out[0], size, out.size());
+            MUST( outSize > 0, "lz4 compression failed");
+            out.resize(outSize);
+            break;
+        }
+#endif
+#ifdef COORDS_HAVE_ZSTD
+        case CODEC::ZSTD:
+        {
+            std::string &out = *blobOut.mutable_zstd_data();
+            out.resize( ZSTD_compressBound(size));
+            int level = compressionLevel >= 0 ? compressionLevel : 3;
+            size_t outSize = ZSTD_compress( &out[0], out.size(), data, size, level);
+            MUST( !ZSTD_isError(outSize), "zstd compression failed");
+            out.resize(outSize);
+            break;
+        }
+#endif
+        default: MUST(false, "invalid codec"); break;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int nextArgumentIndex = parseArguments(argc, argv);
+    std::string usageLine = std::string("usage: ") + argv[0] + " [-c|--codec none|zlib|lz4|zstd] [-l|--level <n>] <input.pbf> <output.pbf>";
+    if (nextArgumentIndex + 2 != argc)
+    {
+        std::cerr << "error: expected an input and an output file argument" << std::endl;
+        std::cerr << usageLine << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    FILE* fIn = fopen( argv[nextArgumentIndex], "rb");
+    if (!fIn)
+    {
+        std::cerr << "error: cannot open file '" << argv[nextArgumentIndex] << "'" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    FILE* fOut = fopen( argv[nextArgumentIndex+1], "wb");
+    if (!fOut)
+    {
+        std::cerr << "error: cannot create file '" << argv[nextArgumentIndex+1] << "'" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    uint8_t *unpackBuffer = new uint8_t[OSMPBF::max_uncompressed_blob_size];
+    uint64_t numBlobs = 0, bytesIn = 0, bytesOut = 0;
+
+    uint32_t headerSize;
+    while (fread(&headerSize, sizeof(headerSize), 1, fIn) == 1)
+    {
+        headerSize = ntohl(headerSize);
+        MUST( headerSize <= OSMPBF::max_blob_header_size, "blob header too large");
+        std::string headerData(headerSize, '\0');
+        MUST( fread(&headerData[0], headerSize, 1, fIn) == 1, "read error");
+
+        OSMPBF::BlobHeader header;
+        MUST( header.ParseFromString(headerData), "failed to parse BlobHeader");
+
+        RawBlob rawBlob;
+        rawBlob.type = header.type();
+        rawBlob.buffer.resize( header.datasize());
+        MUST( fread(rawBlob.buffer.data(), rawBlob.buffer.size(), 1, fIn) == 1, "read error");
+        rawBlob.data = rawBlob.buffer.data();
+        rawBlob.size = rawBlob.buffer.size();
+
+        uint32_t size;
+        OsmParserPbf::unpackBlob( rawBlob, unpackBuffer, size);
+
+        OSMPBF::Blob blob;
+        compressBlob( unpackBuffer, size, blob);
+        std::string blobData = blob.SerializeAsString();
+
+        header.set_datasize( blobData.size());
+        headerData = header.SerializeAsString();
+        uint32_t headerSizeOut = htonl(headerData.size());
+        MUST( fwrite(&headerSizeOut, sizeof(headerSizeOut), 1, fOut) == 1, "write error");
+        MUST( fwrite(headerData.data(), headerData.size(), 1, fOut) == 1, "write error");
+        MUST( fwrite(blobData.data(), blobData.size(), 1, fOut) == 1, "write error");
+
+        numBlobs++;
+        bytesIn  += sizeof(headerSize) + headerSize + rawBlob.size;
+        bytesOut += sizeof(headerSizeOut) + headerData.size() + blobData.size();
+    }
+    MUST( feof(fIn), "read error");
+
+    delete [] unpackBuffer;
+    fclose(fIn);
+    MUST( fclose(fOut) == 0, "write error");
+
+    std::cout << "re-encoded " << numBlobs << " blobs: " << (bytesIn / 1000000) << "MB -> "
+              << (bytesOut / 1000000) << "MB" << std::endl;
+
+    google::protobuf::ShutdownProtobufLibrary();
+}
@@ -1,6 +1,8 @@
 
 #include <stdio.h>
+#include <string.h> //for memcpy()
 #include <getopt.h> //for getopt_long()
+#include <unistd.h> //for access(), sysconf()
 #include <assert.h>
 
 #include <iostream>
@@ -8,13 +10,21 @@
 #include <set>
 #include <map>
 #include <algorithm> //for sort()
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 #include "misc/mem_map.h"
 #include "misc/cleanup.h"
+#include "misc/radixSort.h"
+#include "misc/symbolicNames.h"
+#include "misc/tagSetTable.h"
 #include "containers/chunkedFile.h"
 #include "containers/reverseIndex.h"
 #include "containers/bucketFileSet.h"
+#include "containers/bucketPrefetcher.h"
 #include "containers/osmRelationStore.h"
+#include "containers/vertexStore.h"
 #include "geom/multipolygonReconstructor.h"
 
 //using namespace std;
@@ -31,124 +41,225 @@ bool firstIsLess( const pair<uint64_t, uint64_t> &a, const pair<uint64_t, uint64
     return a.first < b.first;
 }
 
-/* TODO: 1. the stored wayIds in the nodeRefsResolved buckets are not used anymore, so do not
- *          write them to the file in the first place.
- *       2. the huge number of fwrite() calls to create the bucket files is rather inefficient.
- *          Create a buffered file class that collects some bucket contents (e.g. 16k) in memory
- *          before writing them out all at once.
- */
-void buildReverseIndexAndResolvedNodeBuckets(const string storageDirectory, bool createReverseIndex)
+/* the location of a node referenced by a way, as stored in the nodeRefsResolved buckets */
+struct WayNodeLocation
 {
+    uint64_t key;   //(wayId << WAY_NODE_POSITION_BITS) | position of the node in the way
+    int32_t  lat;
+    int32_t  lng;
+};
+
+/* the result of resolveNodeBucket() for a single node bucket */
+struct ResolvedNodeBucket
+{
+    vector<pair<uint64_t, uint64_t> > refs;         //(nodeId, referrer), sorted by node id
+    vector<WayNodeLocation>           locations;    //the locations of the nodes referenced by ways
+};
+
+/* sorts the (nodeId, referrer) tuples of node bucket 'bucketId', and looks up the location
+ * of each node that is referenced by a way (unless 'vertices' is nullptr). Does not modify any
+ * shared state (and 'vertices' is private to the calling thread), so several buckets can be
+ * resolved concurrently. */
+void resolveNodeBucket(const BucketFileSet<uint64_t> &nodeBuckets, uint64_t bucketId, 
+                       VertexStore *vertices, uint32_t numSortThreads, ResolvedNodeBucket &res)
+{
+    nodeBuckets.readContents(bucketId, res.refs);
+    radixSort( res.refs, [](const pair<uint64_t, uint64_t> &ref) { return ref.first; }, numSortThreads);
+
+    if (!vertices)
+        return;
+
+    for ( const pair<uint64_t, uint64_t> &ref: res.refs)
+    {
+        if (! (ref.second & IS_WAY_REFERENCE)) //is actually a reference from a relation
+            continue;   //we do not actually resolve node references from relations at this point.
+
+        uint64_t wayId     = ref.second & ~(IS_WAY_REFERENCE | WAY_NODE_POSITION_MASK);
+        uint64_t posInWay  = (ref.second & WAY_NODE_POSITION_MASK) >> WAY_NODE_POSITION_SHIFT;
+        WayNodeLocation loc = {.key = (wayId << WAY_NODE_POSITION_BITS) | posInWay, .lat = 0, .lng = 0};
+        if (vertices->get( ref.first, loc.lat, loc.lng))
+            res.locations.push_back( loc);
+    }
+}
+
+/* The node buckets are resolved by 'numThreads' worker threads (each bucket on its own, see 
+ * resolveNodeBucket()), while the calling thread commits the results to the reverse index and
+ * to the resolved node buckets strictly in bucket order. So the result does not depend on the
+ * number of threads. At most two buckets per worker may have been resolved but not yet been
+ * committed, which bounds the memory consumption. If there are fewer buckets than threads,
+ * the remaining threads help sorting the buckets instead. 
+ * If the node locations of the ways have already been resolved during the import 
+ * ('!createResolvedNodeBuckets'), only the reverse index is built (if at all). */
+void buildReverseIndexAndResolvedNodeBuckets(const string storageDirectory, bool createReverseIndex,
+                                             bool createResolvedNodeBuckets, uint32_t numThreads)
+{
+    if (!createReverseIndex && !createResolvedNodeBuckets)
+    {
+        BucketFileSet<uint64_t>(storageDirectory +"nodeRefs", BUCKET_SIZE, true).clear();
+        return;
+    }
+
     ReverseIndex reverseNodeIndex(storageDirectory + "nodeReverse", true);
+    // the buckets are processed in order, and each one is sorted by node id
+    ReverseIndex::BulkBuilder reverseNodeRefs(reverseNodeIndex);
         
-    mmap_t vertex_mmap = init_mmap( (storageDirectory + "vertices.data").c_str(), true, false);
-    const int32_t *vertexData = (int32_t*)vertex_mmap.ptr;
-    MUST(vertex_mmap.size % (2*sizeof(int32_t)) == 0, "vertex storage corruption");
-    uint64_t numVertices = vertex_mmap.size / (2*sizeof(int32_t));
-
-    BucketFileSet<OsmGeoPosition> resolvedNodeBuckets(
+    BucketFileSet<WayNodeLocation> resolvedNodeBuckets(
         storageDirectory +"nodeRefsResolved", NODES_OF_WAYS_BUCKET_SIZE, false);
     BucketFileSet<uint64_t>       nodeBuckets(        
         storageDirectory +"nodeRefs", BUCKET_SIZE, true);
 
-    for (uint64_t bucketId = 0; bucketId < nodeBuckets.getNumBuckets(); bucketId++)
-    {
-        cout << "resolving node locations for bucket " << (bucketId + 1) << "/" << nodeBuckets.getNumBuckets() << endl;
-        
-        vector<pair<uint64_t, uint64_t> > tuples = nodeBuckets.getContents(bucketId);
-        sort( tuples.begin(), tuples.end(), firstIsLess);
-        
-        for ( pair<uint64_t, uint64_t> &tuple: tuples)
-        {
-            uint64_t nodeId = tuple.first;
-            uint64_t wayId  = tuple.second;
-            if (! (wayId & IS_WAY_REFERENCE)) //is actually a reference from a relation
+    uint64_t numBuckets = nodeBuckets.getNumBuckets();
+    uint32_t numWorkers = std::max<uint64_t>(1, std::min<uint64_t>(numThreads, numBuckets));
+    uint32_t numSortThreads = std::max<uint32_t>(1, numThreads / numWorkers);
+    const uint64_t maxBucketsInFlight = 2 * numWorkers;
+
+    std::mutex mutex;   //protects all of the following variables
+    std::condition_variable bucketResolved, bucketCommitted;
+    std::map<uint64_t, ResolvedNodeBucket*> resolvedBuckets;
+    uint64_t nextBucketId = 0;
+    uint64_t numBucketsCommitted = 0;
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < numWorkers; i++)
+        workers.push_back( std::thread( [&]() {
+            VertexStore *vertices = createResolvedNodeBuckets ? new VertexStore(storageDirectory) : nullptr;
+            while (true)
             {
-                if (createReverseIndex)
-                    reverseNodeIndex.addReferenceFromRelation( nodeId, wayId);
-                //nothing more to do, as we do not actually resolve node references from relations at this point.
-                continue;
+                uint64_t bucketId;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    while (nextBucketId < numBuckets && 
+                           nextBucketId - numBucketsCommitted >= maxBucketsInFlight)
+                        bucketCommitted.wait(lock);
+                    
+                    if (nextBucketId == numBuckets)
+                        break;
+                    bucketId = nextBucketId++;
+                }
+
+                ResolvedNodeBucket *res = new ResolvedNodeBucket();
+                resolveNodeBucket( nodeBuckets, bucketId, vertices, numSortThreads, *res);
+
+                std::unique_lock<std::mutex> lock(mutex);
+                resolvedBuckets[bucketId] = res;
+                bucketResolved.notify_all();
             }
+            delete vertices;
+        }));
+
+    //ordered commit stage
+    for (uint64_t bucketId = 0; bucketId < numBuckets; bucketId++)
+    {
+        ResolvedNodeBucket *res;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!resolvedBuckets.count(bucketId))
+                bucketResolved.wait(lock);
             
-            wayId &= ~IS_WAY_REFERENCE; //unset way reference flag to obtain the actual way id
-            if (createReverseIndex)
-                reverseNodeIndex.addReferenceFromWay( nodeId, wayId);
-            
-            if (nodeId < numVertices)
+            res = resolvedBuckets[bucketId];
+            resolvedBuckets.erase(bucketId);
+        }
+        cout << "resolving node locations for bucket " << (bucketId + 1) << "/" << numBuckets << endl;
+
+        if (createReverseIndex)
+            for ( const pair<uint64_t, uint64_t> &ref: res->refs)
             {
-                OsmGeoPosition pos = {.id  = nodeId, .lat = vertexData[ nodeId * 2],.lng = vertexData[ nodeId * 2 + 1]};
-                FILE* f = resolvedNodeBuckets.getFile(wayId);
-                MUST( fwrite( &pos, sizeof(pos), 1, f) == 1, "write error");
-                //resolvedNodeBuckets.write( wayId, pos);
+                if (ref.second & IS_WAY_REFERENCE)
+                    reverseNodeRefs.addReferenceFromWay( ref.first, 
+                                        ref.second & ~(IS_WAY_REFERENCE | WAY_NODE_POSITION_MASK));
+                else
+                    reverseNodeRefs.addReferenceFromRelation( ref.first, ref.second);
             }
-        }
+        
+        for (const WayNodeLocation &location : res->locations)
+            resolvedNodeBuckets.writeRaw( location.key >> WAY_NODE_POSITION_BITS, &location, sizeof(WayNodeLocation));
+
+        delete res;
         nodeBuckets.clearBucket(bucketId);
-    }
-    nodeBuckets.clear();
 
+        std::unique_lock<std::mutex> lock(mutex);
+        numBucketsCommitted++;
+        bucketCommitted.notify_all();
+    }
 
+    for (std::thread &worker : workers)
+        worker.join();
+    
+    MUST( resolvedBuckets.empty(), "pipeline corruption");
+    nodeBuckets.clear();
 }
 
-inline bool hasSmallerNodeId( const OsmGeoPosition &a, const OsmGeoPosition &b)
+/* reads the locations of a resolved node bucket, sorted by (wayId, position in way). So the
+ * locations of each way are consecutive, and in the order of its nodes */
+vector<WayNodeLocation> sortLocations(const vector<uint8_t> &bucketContents, uint32_t numThreads)
 {
-    return a.id < b.id;
+    uint64_t size = bucketContents.size();
+    MUST( size % sizeof(WayNodeLocation) == 0, "resolved node ref bucket file corruption");
+    
+    vector<WayNodeLocation> locations( size / sizeof(WayNodeLocation));
+    if (size > 0)
+        memcpy( locations.data(), bucketContents.data(), size);
+    
+    radixSort( locations, [](const WayNodeLocation &loc) { return loc.key; }, numThreads);
+    return locations;
 }
 
-inline bool isSmallerNodeId( const OsmGeoPosition &a, const uint64_t &nodeId)
+/* returns the index of the first location of way 'wayId' in the sorted 'locations' (or of the
+ * first location of a later way, if there is none). Ways usually come in id order, so the 
+ * search continues at 'cursor' (the result for the previous way), and all ways of a bucket 
+ * are merged with its locations in a single linear pass. Only a way that is out of order
+ * needs a binary search. */
+uint64_t findFirstLocation(const vector<WayNodeLocation> &locations, uint64_t wayId, uint64_t &cursor)
 {
-    return a.id < nodeId;
-}
+    uint64_t key = wayId << WAY_NODE_POSITION_BITS;
+    if (cursor > 0 && locations[cursor - 1].key >= key)
+        cursor = lower_bound( locations.begin(), locations.end(), key, 
+                    [](const WayNodeLocation &loc, uint64_t value) { return loc.key < value; }) - locations.begin();
 
-vector<OsmGeoPosition> buildReferencesMap(FILE* bucketFile)
-{
-    fseek (bucketFile, 0, SEEK_END);
-    uint64_t size = ftell(bucketFile);
-    rewind(bucketFile);
-    
-    MUST( size % sizeof(OsmGeoPosition) == 0, "resolved node ref bucket file corruption");
-    uint64_t numItems = size / sizeof(OsmGeoPosition);
-    
-    vector<OsmGeoPosition> refs;
-    refs.resize( numItems);
-    
-    MUST( fread( refs.data(), size, 1, bucketFile) == 1, "read error");
+    while (cursor < locations.size() && locations[cursor].key < key)
+        cursor++;
     
-    sort( refs.begin(), refs.end(), hasSmallerNodeId);
-    
-    return refs;
+    return cursor;
 }
 
-void resolveNodeLocations(OsmWay &way, const vector<OsmGeoPosition> &nodeRefs)
+/* sets the node locations of 'way' from its locations, which start at 'loc'. Nodes whose
+ * location is missing (because they do not exist) are skipped */
+void resolveNodeLocations(OsmWay &way, const WayNodeLocation *loc, const WayNodeLocation *locBeyond)
 {
-    //assert(way.isDataMapped && "is noop for unmapped data");
     for (uint64_t i = 0; i < way.refs.size(); i++)
     {
-        uint64_t nodeId = way.refs[i].id;
-        
-        /* returns the first element in the sorted 'nodeRefs' vector that is not
-         * smaller than 'nodeId'. This will be an entry containing 'nodeId', if such
-         * an entry exists, and one with a higher id than 'nodeId' otherwise */
-        auto notSmaller = lower_bound( nodeRefs.begin(), nodeRefs.end(), nodeId, isSmallerNodeId);
-        
-        if ( notSmaller == nodeRefs.end() || notSmaller->id != nodeId)
+        if (loc == locBeyond || loc->key != ((way.id << WAY_NODE_POSITION_BITS) | i))
         {
-            cout << "[WARN] reference to node " << nodeId << " could not be resolved in way " << way.id << endl;
+            cout << "[WARN] reference to node " << way.refs[i].id << " could not be resolved in way " << way.id << endl;
             continue;
         }
         
-        way.refs[i].lat = notSmaller->lat;
-        way.refs[i].lng = notSmaller->lng;
+        way.refs[i].lat = loc->lat;
+        way.refs[i].lng = loc->lng;
+        loc++;
     }
-
 }
 
+/* a way of stage 5 after its node locations have been resolved */
+struct ResolvedWay
+{
+    uint8_t         *bytes;         //the serialized way
+    uint64_t         numBytes;
+    vector<uint64_t> relationIds;   //the renderable relations that reference the way
+};
+
+/* The ways of each bucket are processed in batches: the ways of a batch are parsed and merged 
+ * with the bucket's locations on the calling thread, and are then resolved and serialized by
+ * 'numThreads' threads. Their chunks in ways.data are created in way order on the calling
+ * thread again (so the result does not depend on the number of threads), but are filled in
+ * parallel. */
 void resolveWayNodeRefsAndCreateRelationBuckets(const string storageDirectory, 
-                        const set<uint64_t> &rendereableRelationIds)
+                        const set<uint64_t> &rendereableRelationIds, uint32_t numThreads)
 {
 
     ReverseIndex reverseWayIndex(storageDirectory +"wayReverse");
     
-    BucketFileSet<OsmGeoPosition> resolvedNodeBuckets(
+    BucketFileSet<WayNodeLocation> resolvedNodeBuckets(
                 storageDirectory +"nodeRefsResolved",
                 NODES_OF_WAYS_BUCKET_SIZE, true);
     
@@ -163,52 +274,106 @@ void resolveWayNodeRefsAndCreateRelationBuckets(const string storageDirectory,
     ChunkedFile waysStorage(storageDirectory + "ways.data");
     mmap_t waysIndex = init_mmap( (storageDirectory + "ways.idx").c_str(), true, true, true);
     MUST( resolvedNodeBuckets.getNumBuckets() == wayBuckets.getNumBuckets(), "bucket count mismatch")
-    for (uint64_t i = 0; i < resolvedNodeBuckets.getNumBuckets(); i++)
+    /* both bucket sets are read ahead (bucket i+1 while bucket i is processed). In turn, the
+     * writeback of the ways.data and ways.idx parts written for bucket i is started right
+     * after that bucket, and these parts are evicted from memory after bucket i+1 (when their
+     * writeback should have completed). So they do not crowd out the page cache. */
+    BucketPrefetcher<WayNodeLocation, vector<uint8_t> > resolvedNodesPrefetcher(resolvedNodeBuckets);
+    BucketPrefetcher<void*, vector<uint8_t> >           waysPrefetcher(wayBuckets);
+    vector<uint8_t> resolvedNodesRaw, waysRaw;
+    uint64_t prevChunksBegin = 0, prevChunksEnd = 0;
+    uint64_t i, wayBucketId;
+    
+    vector<OsmWay>      ways;
+    vector<uint64_t>    firstLocations; //for each way of the batch, the index of its first location
+    vector<ResolvedWay> resolvedWays;
+    vector<Chunk>       chunks;
+    ways.reserve( RESOLVE_WAY_BATCH_SIZE);
+    while (resolvedNodesPrefetcher.next(i, resolvedNodesRaw))
     {
+        MUST( waysPrefetcher.next(wayBucketId, waysRaw) && wayBucketId == i, "bucket mismatch");
         cout << "resolving node references for bucket "<< (i+1) << "/" << resolvedNodeBuckets.getNumBuckets() << endl;
-        /*TODO: the following call will take some seconds. The OS should be instructed to 
-                write back all data from the previous iteration of the outer loop to disk
-                during that time. */
 
-        //for each wayId, mapping its nodeIds to the corresponding lat/lng pair
-        vector<OsmGeoPosition> refs = buildReferencesMap(resolvedNodeBuckets.getFile( 
-                                                            i*NODES_OF_WAYS_BUCKET_SIZE));
+        vector<WayNodeLocation> locations = sortLocations(resolvedNodesRaw, numThreads);
+        const WayNodeLocation *locationsBeyond = locations.data() + locations.size();
+        uint64_t cursor = 0;
         
-        FILE* f = wayBuckets.getFile( i * NODES_OF_WAYS_BUCKET_SIZE);
-        fseek (f, 0, SEEK_END);
-        uint64_t numWayBytes = ftell(f);
-        fseek(f, 0, SEEK_SET);
-        uint8_t *waysRaw = new uint8_t[numWayBytes];
-        MUST( fread( waysRaw, numWayBytes, 1, f) == 1, "way bucket read error");
-
-        const uint8_t* waysPos = waysRaw;
-        const uint8_t* waysBeyond = waysRaw + numWayBytes;
+        const uint8_t* waysPos = waysRaw.data();
+        const uint8_t* waysBeyond = waysRaw.data() + waysRaw.size();
+        //the range of ways.data that holds the chunks of this bucket
+        uint64_t chunksBegin = UINT64_MAX, chunksEnd = 0;
         
         while (waysPos < waysBeyond)
         {
-            OsmWay way(waysPos);
-            MUST( way.id >=  i   * NODES_OF_WAYS_BUCKET_SIZE &&
-                  way.id <  (i+1)* NODES_OF_WAYS_BUCKET_SIZE, "Way in wrong bucket file");
+            ways.clear();
+            firstLocations.clear();
+            uint64_t maxWayId = 0;
+            while (waysPos < waysBeyond && ways.size() < RESOLVE_WAY_BATCH_SIZE)
+            {
+                ways.push_back( OsmWay(waysPos));
+                const OsmWay &way = ways.back();
+                MUST( way.id >=  i   * NODES_OF_WAYS_BUCKET_SIZE &&
+                      way.id <  (i+1)* NODES_OF_WAYS_BUCKET_SIZE, "Way in wrong bucket file");
+                firstLocations.push_back( findFirstLocation( locations, way.id, cursor));
+                maxWayId = std::max( maxWayId, way.id);
+            }
+
+            resolvedWays.clear();
+            resolvedWays.resize( ways.size());
+            #pragma omp parallel for schedule(dynamic, 64) num_threads(numThreads)
+            for (uint64_t j = 0; j < ways.size(); j++)
+            {
+                OsmWay &way = ways[j];
+                ResolvedWay &res = resolvedWays[j];
+                resolveNodeLocations(way, locations.data() + firstLocations[j], locationsBeyond);
 
-            resolveNodeLocations(way, refs);
+                uint64_t tagsSize = 0;
+                res.bytes = way.serialize( &res.numBytes, &tagsSize);
+                res.numBytes = getTagSets().replaceByReference( res.bytes, res.numBytes, tagsSize);
 
-            for (uint64_t relId : reverseWayIndex.getReferencingRelations(way.id))
-                if (rendereableRelationIds.count(relId))
-                    way.serialize( waysReferencedByRelationsBuckets.getFile(relId));
+                for (uint64_t relId : reverseWayIndex.getReferencingRelations(way.id))
+                    if (rendereableRelationIds.count(relId))
+                        res.relationIds.push_back(relId);
+            }
 
-            ensure_mmap_size( &waysIndex, sizeof(uint64_t) * (way.id+1));
+            ensure_mmap_size( &waysIndex, sizeof(uint64_t) * (maxWayId+1));
             uint64_t *index = (uint64_t*)waysIndex.ptr;
-                    
-            uint64_t numBytes = 0;
-            uint8_t* wayBytes = way.serialize( &numBytes);
-            Chunk chunk = waysStorage.createChunk( numBytes);
-            index[way.id] = chunk.getPositionInFile();
-            chunk.put( wayBytes, numBytes);
+            chunks.clear();
+            for (uint64_t j = 0; j < ways.size(); j++)
+            {
+                const ResolvedWay &res = resolvedWays[j];
+                for (uint64_t relId : res.relationIds)
+                    waysReferencedByRelationsBuckets.writeRaw( relId, res.bytes, res.numBytes);
+
+                chunks.push_back( waysStorage.createChunk( res.numBytes));
+                index[ways[j].id] = chunks.back().getPositionInFile();
+                chunksBegin = std::min( chunksBegin, chunks.back().getPositionInFile());
+                chunksEnd   = std::max( chunksEnd,   chunks.back().getPositionInFile() + chunks.back().getSize());
+            }
 
-            delete [] wayBytes;
+            #pragma omp parallel for schedule(dynamic, 256) num_threads(numThreads)
+            for (uint64_t j = 0; j < ways.size(); j++)
+            {
+                chunks[j].put( resolvedWays[j].bytes, resolvedWays[j].numBytes);
+                delete [] resolvedWays[j].bytes;
+            }
         }
         MUST( waysPos == waysBeyond, "overflow");
-        delete [] waysRaw;
+
+        uint64_t indexBytesPerBucket = NODES_OF_WAYS_BUCKET_SIZE * sizeof(uint64_t);
+        if (chunksBegin < chunksEnd)
+            waysStorage.startWriteback( chunksBegin, chunksEnd - chunksBegin);
+        writeback_mmap( &waysIndex, i * indexBytesPerBucket, indexBytesPerBucket);
+
+        if (i > 0)
+        {
+            if (prevChunksBegin < prevChunksEnd)
+                waysStorage.release( prevChunksBegin, prevChunksEnd - prevChunksBegin);
+            release_mmap( &waysIndex, (i-1) * indexBytesPerBucket, indexBytesPerBucket);
+        }
+        prevChunksBegin = chunksBegin;
+        prevChunksEnd   = chunksEnd;
+
         resolvedNodeBuckets.clearBucket(i); 
         wayBuckets.clearBucket(i);
     }
@@ -218,20 +383,49 @@ void resolveWayNodeRefsAndCreateRelationBuckets(const string storageDirectory,
 
 }
 
+/* the variant of stage 5 for ways whose node locations have already been resolved during the
+ * import (see coordsCreateStorage's '--resolve-locations'): ways.data is final already, and
+ * only the "referencedWays" buckets are created from it, with the same contents as 
+ * resolveWayNodeRefsAndCreateRelationBuckets() would have written. */
+void createRelationBucketsFromResolvedWays(const string storageDirectory, 
+                                           const set<uint64_t> &rendereableRelationIds)
+{
+    ReverseIndex reverseWayIndex(storageDirectory +"wayReverse");
+    BucketFileSet<uint64_t> waysReferencedByRelationsBuckets(
+                storageDirectory + "referencedWays", 
+                WAYS_OF_RELATIONS_BUCKET_SIZE, false);
+
+    ChunkedFile waysStorage(storageDirectory + "ways.data");
+    ChunkedFile::Iterator beyond = waysStorage.end();
+    for (ChunkedFile::Iterator it = waysStorage.begin(); it != beyond; ++it)
+    {
+        const uint8_t *wayBytes = (*it).getDataPtr();
+        const uint8_t *wayEnd = wayBytes;
+        OsmWay way(wayEnd);
+        
+        for (uint64_t relId : reverseWayIndex.getReferencingRelations(way.id))
+            if (rendereableRelationIds.count(relId))
+                waysReferencedByRelationsBuckets.writeRaw( relId, wayBytes, wayEnd - wayBytes);
+    }
+}
+
 void registerWayRefsFromRelations(string storageDirectory) 
 {
     ReverseIndex reverseWayIndex(storageDirectory + "wayReverse", false);
+    ReverseIndex::BulkBuilder reverseWayRefs(reverseWayIndex);
     BucketFileSet<uint64_t> relationWayRefs(storageDirectory+"wayRefs", BUCKET_SIZE, true);
     
-    for (uint64_t i = 0; i < relationWayRefs.getNumBuckets(); i++)
+    BucketPrefetcher<uint64_t, vector< pair<uint64_t, uint64_t> > > prefetcher(relationWayRefs);
+    vector< pair<uint64_t, uint64_t> > refs;
+    uint64_t bucketId;
+    while (prefetcher.next(bucketId, refs))
     {
-        vector< pair<uint64_t, uint64_t> > refs = relationWayRefs.getContents(i);
         sort( refs.begin(), refs.end(), firstIsLess);
         
         for ( pair<uint64_t, uint64_t> kv : refs)
         {
             MUST(!( kv.second & IS_WAY_REFERENCE), "invalid way referencing another way");
-            reverseWayIndex.addReferenceFromRelation(kv.first, kv.second);
+            reverseWayRefs.addReferenceFromRelation(kv.first, kv.second);
         }
     }
     
@@ -242,17 +436,20 @@ void registerRelationRefsFromRelations(string storageDirectory)
 {
     //register references from relations referencing other relations
     ReverseIndex reverseRelationIndex(storageDirectory +"relationReverse", false);
+    ReverseIndex::BulkBuilder reverseRelationRefs(reverseRelationIndex);
     BucketFileSet<uint64_t> relationRelationRefs(storageDirectory+"relationRefs", BUCKET_SIZE, true);
     
-    for (uint64_t i = 0; i < relationRelationRefs.getNumBuckets(); i++)
+    BucketPrefetcher<uint64_t, vector< pair<uint64_t, uint64_t> > > prefetcher(relationRelationRefs);
+    vector< pair<uint64_t, uint64_t> > refs;
+    uint64_t bucketId;
+    while (prefetcher.next(bucketId, refs))
     {
-        vector< pair<uint64_t, uint64_t> > refs = relationRelationRefs.getContents(i);
         sort( refs.begin(), refs.end(), firstIsLess);
         
         for ( pair<uint64_t, uint64_t> kv : refs)
         {
             MUST(!( kv.second & IS_WAY_REFERENCE), "invalid way referencing another way");
-            reverseRelationIndex.addReferenceFromRelation(kv.first, kv.second);
+            reverseRelationRefs.addReferenceFromRelation(kv.first, kv.second);
         }
     }
     
@@ -312,34 +509,64 @@ std::set<uint64_t> getRenderableRelationIds(const string &storageDirectory)
     return res; 
 }
 
+/* rewrites those reverse indices of the storage that exist without unused space (see 
+ * ReverseIndex::compact()) */
+void compactReverseIndices(const string &storageDirectory)
+{
+    for (const char* name : {"nodeReverse", "wayReverse", "relationReverse"})
+    {
+        string baseName = storageDirectory + name;
+        if (access( (baseName + ".idx").c_str(), F_OK) != 0)
+            continue;
+
+        ReverseIndex reverseIndex(baseName);
+        cout << "compacting " << name << " (" << reverseIndex.getUnusedSize() << " bytes unused)" << endl;
+        reverseIndex.compact();
+    }
+}
+
 std::string storageDirectory;
 bool keepReverseIndexFiles = true;
 bool assembleMultipolygons = true;
 bool resolveReferences = true;
 bool keepWayBuckets = false;
+bool compactReverseIndexFiles = false;
+/* number of threads for the parallelized stages. '1' runs everything on the main thread */
+uint32_t numThreads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
 
 void parseArguments(int argc, char** argv)
 {
-    std::string usageLine = std::string("usage: ") + argv[0] + /*" [-k|--keep-way-buckets]*/" [-m|--no-multipolygons] [-r|--no-resolve] [-u|--no-updates] <storage directory>";
+    std::string usageLine = std::string("usage: ") + argv[0] + /*" [-k|--keep-way-buckets]*/" [-c|--compact] [-m|--no-multipolygons] [-r|--no-resolve] [-t|--threads <n>] [-u|--no-updates] <storage directory>";
 
     static const struct option long_options[] =
     {
 //        {"keep-way-buckets", no_argument, NULL, 'k'},
+        {"compact",          no_argument, NULL, 'c'},
         {"no-multipolygons", no_argument, NULL, 'm'},
         {"no-resolve",       no_argument, NULL, 'r'},
+        {"threads",          required_argument, NULL, 't'},
         {"no-updates",       no_argument, NULL, 'u'},
         {0,0,0,0}
     };
 
     int opt_idx = 0;
     int opt;
-    while (-1 != (opt = getopt_long(argc, argv, "mru", long_options, &opt_idx)))
+    while (-1 != (opt = getopt_long(argc, argv, "cmrt:u", long_options, &opt_idx)))
     {
         switch(opt) {
             case '?': exit(EXIT_FAILURE); break; //unknown option; getopt_long() already printed an error message
 //            case 'k': keepWayBuckets = true; break;
+            case 'c': compactReverseIndexFiles = true; break;
             case 'm': assembleMultipolygons = false; break;
             case 'r': resolveReferences = false; break;
+            case 't': 
+                numThreads = atoi(optarg);
+                if (numThreads < 1)
+                {
+                    std::cerr << "error: invalid number of threads '" << optarg << "'" << endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'u': keepReverseIndexFiles = false; break;
             default: abort(); break;
         }
@@ -371,8 +598,21 @@ int main(int argc, char** argv)
 {
     parseArguments(argc, argv);
 
+    if (!loadSymbolicNames(storageDirectory) || !loadTagSets(storageDirectory))
+    {
+        std::cerr << "error: no symbolic name or tag set table found in '" << storageDirectory 
+                  << "'. Please re-create the storage with coordsCreateStorage." << endl;
+        exit(EXIT_FAILURE);
+    }
+
     if (resolveReferences)
     {
+        /* coordsCreateStorage writes either way buckets to be resolved, or (with 
+         * '--resolve-locations') the final ways.data plus a marker file */
+        bool waysResolvedOnImport = access( (storageDirectory + WAYS_RESOLVED_FILE_NAME).c_str(), F_OK) == 0;
+        MUST( !waysResolvedOnImport || access( (storageDirectory + "ways00000.raw").c_str(), F_OK) != 0,
+              "storage contains both resolved ways and way buckets");
+
         cout << "Stage 1: determining set of multipolygon relations" << endl;
         /* Input: all relations
          * Output: set of relation IDs for relations that are either multipolygons or boundaries
@@ -401,21 +641,31 @@ int main(int argc, char** argv)
         /* Input: - vertex data file 
          *        - node buckets ( (nodeId, wayId) tuples, bucketed by *nodeId*)
          * Output: - reverse dependency file for nodes (which ways and relations refer to each node)
-         *         - resolved node buckets (nodeId, nodePos, wayId) tuples, bucketed by *wayId*)
+         *         - resolved node buckets ( (wayId, position in way, nodePos) tuples, bucketed by *wayId*)
          *         - the input node buckets are destroyed */
-        buildReverseIndexAndResolvedNodeBuckets(storageDirectory, keepReverseIndexFiles);
+        buildReverseIndexAndResolvedNodeBuckets(storageDirectory, keepReverseIndexFiles, 
+                                                !waysResolvedOnImport, numThreads);
         
-        cout << "Stage 5: Resolving node references for all ways" << endl;
-        /* Input: - resolved node buckets
-         *        - all ways
-         * Output: - updated ways files where the each node ref in each way has been
-         *           augmented by the actual node lat/lng position
-         *         - "referencedWays" bucket files: for each way referenced by a multipolygon or 
-         *           boundary relation an entry containing the full serialized way, bucketed by
-         *           relation id (used later for multipolygon reconstruction)
-         *         - the input resolved node buckets are destroyed
-         */
-        resolveWayNodeRefsAndCreateRelationBuckets(storageDirectory, renderableRelations);
+        if (waysResolvedOnImport)
+        {
+            cout << "Stage 5: creating bucket files of ways referenced by relations" << endl;
+            cout << "         (node references have been resolved during the import)" << endl;
+            createRelationBucketsFromResolvedWays(storageDirectory, renderableRelations);
+        }
+        else
+        {
+            cout << "Stage 5: Resolving node references for all ways" << endl;
+            /* Input: - resolved node buckets
+             *        - all ways
+             * Output: - updated ways files where the each node ref in each way has been
+             *           augmented by the actual node lat/lng position
+             *         - "referencedWays" bucket files: for each way referenced by a multipolygon or 
+             *           boundary relation an entry containing the full serialized way, bucketed by
+             *           relation id (used later for multipolygon reconstruction)
+             *         - the input resolved node buckets are destroyed
+             */
+            resolveWayNodeRefsAndCreateRelationBuckets(storageDirectory, renderableRelations, numThreads);
+        }
     }
     
     if (assembleMultipolygons)
@@ -444,6 +694,12 @@ int main(int argc, char** argv)
         deleteIfExists(storageDirectory, "relationReverse.aux");
         deleteIfExists(storageDirectory, "relationReverse.idx");
     }    
+
+    if (compactReverseIndexFiles)
+    {
+        cout << "Stage 7: compacting reverse indices" << endl;
+        compactReverseIndices(storageDirectory);
+    }
     
 }
 
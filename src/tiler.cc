@@ -23,6 +23,8 @@
 #include "containers/chunkedFile.h"
 #include "misc/cleanup.h"
 #include "misc/escapeSequences.h"
+#include "misc/symbolicNames.h"
+#include "misc/tagSetTable.h"
 #include "lod/lodHandler.h"
 #include "lod/addressLodHandler.h"
 #include "lod/placeLodHandler.h"
@@ -455,7 +457,15 @@ void parseWays(std::vector<LodHandler*> &lodHandlers, std::string storageDirecto
 int main(int argc, char** argv)
 {
     bool createLods = parseArguments(argc, argv);
+    if (!loadSymbolicNames(storageDirectory) || !loadTagSets(storageDirectory))
+    {
+        cerr << "error: no symbolic name or tag set table found in '" << storageDirectory 
+             << "'. Please re-create the storage with coordsCreateStorage." << endl;
+        exit(EXIT_FAILURE);
+    }
     ensureDirectoryExists(tileDirectory);
+    // the tags in the tiles are only readable with the table they were written with (see loadSymbolicNamesForTile())
+    getSymbolicNames().store(tileDirectory + SYMBOLIC_NAMES_FILE_NAME);
 
     std::vector<LodHandler*> lodHandlers;
     lodHandlers.push_back( new BuildingPolygonLodHandler(tileDirectory, "building"));
@@ -0,0 +1,123 @@
+
+/* microbenchmark: RadixTree vs. CompactRadixTree, using the tag filter lists of
+ * OsmConsumerDumper as trees and the symbolic names (plus some non-matching variants)
+ * as queries. Both trees are checked to return the same results.
+ *
+ * build: configure with 'cmake -DBUILD_BENCHMARKS=ON', then 'make radixTreeBenchmark'
+ */
+
+#include <stdio.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "containers/radixTree.h"
+#include "containers/compactRadixTree.h"
+#include "misc/symbolicNames.h"
+#include "osm/osm_tags.h"
+
+using namespace std;
+
+static const uint64_t NUM_ROUNDS = 2000;
+static const uint64_t NUM_COLD_ROUNDS = 20;
+static const uint64_t COLD_BATCH_SIZE = 16;             //about the number of tags of an entity
+static const uint64_t EVICTION_BUFFER_SIZE = 8 << 20;   //bigger than the L2 cache
+
+template <typename TREE>
+void fill(TREE &keys, TREE &prefixes)
+{
+    for (uint32_t i = 0; i < num_ignore_keys; i++)
+        keys.insert(ignore_keys[i], i);
+
+    for (uint32_t i = 0; i < num_ignore_key_prefixes; i++)
+        prefixes.insert(ignore_key_prefixes[i], i);
+}
+
+// the same two queries that OsmConsumerDumper::filterTags() does per tag
+template <typename TREE>
+uint64_t run(const TREE &keys, const TREE &prefixes, const vector<string> &queries, double &nsPerQueryOut)
+{
+    uint64_t numMatches = 0;
+    auto start = chrono::steady_clock::now();
+    for (uint64_t round = 0; round < NUM_ROUNDS; round++)
+        for (const string &query : queries)
+            if (keys.at(query.c_str()) || prefixes.containsPrefixOf(query.c_str()))
+                numMatches++;
+
+    chrono::duration<double, nano> duration = chrono::steady_clock::now() - start;
+    nsPerQueryOut = duration.count() / (NUM_ROUNDS * queries.size());
+    return numMatches;
+}
+
+/* the same queries, but in batches between which the CPU caches are filled with other data
+ * (as they are by parsing the input between two entities). Only the queries are timed */
+template <typename TREE>
+uint64_t runCold(const TREE &keys, const TREE &prefixes, const vector<string> &queries, double &nsPerQueryOut)
+{
+    vector<uint8_t> evictionBuffer(EVICTION_BUFFER_SIZE);
+    uint64_t numMatches = 0;
+    chrono::duration<double, nano> duration(0);
+    for (uint64_t round = 0; round < NUM_COLD_ROUNDS; round++)
+        for (uint64_t i = 0; i < queries.size(); i += COLD_BATCH_SIZE)
+        {
+            for (uint64_t j = 0; j < evictionBuffer.size(); j += 64)
+                evictionBuffer[j]++;
+
+            auto start = chrono::steady_clock::now();
+            for (uint64_t j = i; j < i + COLD_BATCH_SIZE && j < queries.size(); j++)
+                if (keys.at(queries[j].c_str()) || prefixes.containsPrefixOf(queries[j].c_str()))
+                    numMatches++;
+            duration += chrono::steady_clock::now() - start;
+        }
+
+    nsPerQueryOut = duration.count() / (NUM_COLD_ROUNDS * queries.size());
+    return numMatches;
+}
+
+int main()
+{
+    vector<string> queries;
+    for (uint64_t i = 0; i < numSymbolicNames; i++)
+    {
+        queries.push_back( symbolicNames[i]);
+        queries.push_back( string(symbolicNames[i]) + ":de");
+    }
+    for (uint32_t i = 0; i < num_ignore_keys; i++)
+        queries.push_back( ignore_keys[i]);
+    for (uint32_t i = 0; i < num_ignore_key_prefixes; i++)
+        queries.push_back( string(ignore_key_prefixes[i]) + "id");
+
+    RadixTree<int> keys, prefixes;
+    CompactRadixTree<int> compactKeys, compactPrefixes;
+    fill(keys, prefixes);
+    fill(compactKeys, compactPrefixes);
+
+    for (const string &query : queries)
+    {
+        const int *a = keys.at(query.c_str());
+        const int *b = compactKeys.at(query.c_str());
+        MUST( (!a && !b) || (a && b && *a == *b), "result mismatch in at()");
+        MUST( prefixes.containsPrefixOf(query.c_str()) == compactPrefixes.containsPrefixOf(query.c_str()),
+              "result mismatch in containsPrefixOf()");
+    }
+
+    double nsRadix, nsCompact;
+    uint64_t matchesRadix   = run(keys, prefixes, queries, nsRadix);
+    uint64_t matchesCompact = run(compactKeys, compactPrefixes, queries, nsCompact);
+    MUST( matchesRadix == matchesCompact, "result mismatch");
+
+    double nsRadixCold, nsCompactCold;
+    MUST( runCold(keys, prefixes, queries, nsRadixCold) == matchesRadix * NUM_COLD_ROUNDS / NUM_ROUNDS &&
+          runCold(compactKeys, compactPrefixes, queries, nsCompactCold) == matchesRadix * NUM_COLD_ROUNDS / NUM_ROUNDS,
+          "result mismatch");
+
+    cout << queries.size() << " queries, " << (matchesRadix / NUM_ROUNDS) << " matches" << endl;
+    cout << "RadixTree:        " << nsRadix   << " ns/query (hot cache), "
+         << nsRadixCold   << " ns/query (cold cache)" << endl;
+    cout << "CompactRadixTree: " << nsCompact << " ns/query (hot cache), "
+         << nsCompactCold << " ns/query (cold cache), "
+         << (compactKeys.getNumBytes() + compactPrefixes.getNumBytes()) << " bytes" << endl;
+}
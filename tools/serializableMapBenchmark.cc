@@ -0,0 +1,100 @@
+/* microbenchmark and consistency check for SerializableMap: inserts ids in ascending order
+ * (with gaps, like OSM ids), but holds back every HOLD_BACK_INTERVAL-th id and inserts it only
+ * at the end (like the out-of-order references from ways and relations). Then looks up all
+ * inserted ids (hits) and ids in between (misses), modifies values through operator[], and
+ * checks all results - also after the map has been merged and re-opened from disk.
+ *
+ * build: configure with 'cmake -DBUILD_BENCHMARKS=ON', then 'make serializableMapBenchmark'
+ * usage: serializableMapBenchmark [<map file name>]
+ */
+
+#include <stdio.h>
+#include <unistd.h> //for unlink()
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "containers/serializableMap.h"
+
+using namespace std;
+
+static const uint64_t NUM_KEYS = 4000000;
+static const uint64_t HOLD_BACK_INTERVAL = 64;
+static const int      MAX_ITEMS_IN_MEMORY = 100000;
+
+typedef SerializableMap<uint64_t, uint64_t, MAX_ITEMS_IN_MEMORY> Map;
+
+// inserted keys are all even, so that all odd keys are misses
+static uint64_t keyOf(uint64_t i)   { return 2 * (5 * i + i % 3); }
+static uint64_t valueOf(uint64_t key) { return key * 3 + 1; }
+
+static double secondsSince(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void checkContents(Map &map, const string &when)
+{
+    auto start = chrono::steady_clock::now();
+    for (uint64_t i = 0; i < NUM_KEYS; i++)
+    {
+        uint64_t key = keyOf(i);
+        MUST( map.count(key) == 1, ("missing key " + when).c_str());
+        uint64_t expected = valueOf(key) + (i % 1000 == 0 ? 1 : 0);
+        MUST( map[key] == expected, ("wrong value " + when).c_str());
+    }
+    double hitSeconds = secondsSince(start);
+
+    start = chrono::steady_clock::now();
+    for (uint64_t i = 0; i < NUM_KEYS; i++)
+        MUST( map.count( keyOf(i) + 1) == 0, ("spurious key " + when).c_str());
+    double missSeconds = secondsSince(start);
+
+    MUST( map.size() == NUM_KEYS, ("wrong size " + when).c_str());
+    cout << "lookups " << when << ": " << (hitSeconds * 1e9 / NUM_KEYS) << " ns/hit, "
+         << (missSeconds * 1e9 / NUM_KEYS) << " ns/miss" << endl;
+}
+
+int main(int argc, char** argv)
+{
+    string fileName = argc > 1 ? argv[1] : "serializableMapBenchmark.bin";
+    {
+        Map map(fileName.c_str(), true);
+
+        auto start = chrono::steady_clock::now();
+        vector<uint64_t> heldBack;
+        for (uint64_t i = 0; i < NUM_KEYS; i++)
+        {
+            if (i % HOLD_BACK_INTERVAL == HOLD_BACK_INTERVAL - 1)
+            {
+                heldBack.push_back(i);
+                continue;
+            }
+            map.insert( make_pair(keyOf(i), valueOf(keyOf(i))));
+        }
+
+        for (uint64_t i : heldBack)
+            map.insert( make_pair(keyOf(i), valueOf(keyOf(i))));
+        cout << "insertion: " << (secondsSince(start) * 1e9 / NUM_KEYS) << " ns/key" << endl;
+
+        for (uint64_t i = 0; i < NUM_KEYS; i += 1000)
+            map[keyOf(i)]++;
+
+        checkContents(map, "before merge");
+        start = chrono::steady_clock::now();
+        map.merge();
+        cout << "merge: " << secondsSince(start) << " s" << endl;
+        checkContents(map, "after merge");
+    }
+
+    {
+        Map map(fileName.c_str());
+        checkContents(map, "after re-opening");
+    }
+
+    unlink(fileName.c_str());
+    cout << "all checks passed" << endl;
+}